@@ -0,0 +1,467 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// asynchronous reads
+
+#define _DEFAULT_SOURCE // syscall
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "res.h"
+#include "libres_internal.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define RES_HAVE_URING 1
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+static void* res_queue_worker (void *arg);
+static void res_queue_push (RQUEUE *q, ResAsyncReq *req);
+static void res_queue_run (ResAsyncReq *req);
+static void res_queue_complete (RQUEUE *q, ResAsyncReq *req);
+static int res_ring_open (RQUEUE *q);
+static int res_ring_start (RQUEUE *q, ResAsyncReq *req);
+static void res_ring_close (RQUEUE *q);
+
+RQUEUE* res_queue_open (int threads) {
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0) threads = 1;
+    RQUEUE *q = res_malloc(sizeof(RQUEUE));
+    if (q == NULL) efail(ENOMEM);
+    bzero(q, sizeof(RQUEUE));
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->work, NULL);
+    pthread_cond_init(&q->done, NULL);
+    q->notify[0] = q->notify[1] = -1;
+    
+#ifdef __linux__
+    q->notify[0] = q->notify[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (q->notify[0] == -1) {
+#else
+    if (pipe(q->notify) == 0) {
+        fcntl(q->notify[0], F_SETFL, O_NONBLOCK);
+        fcntl(q->notify[1], F_SETFL, O_NONBLOCK);
+    } else {
+#endif
+        int err = errno;
+        res_queue_close(q);
+        efail(err);
+    }
+    
+    q->threads = res_malloc(threads * sizeof(pthread_t));
+    if (q->threads == NULL) {
+        res_queue_close(q);
+        efail(ENOMEM);
+    }
+    for(int i=0; i < threads; i++) {
+        if (pthread_create(&q->threads[i], NULL, res_queue_worker, q)) break;
+        q->numThreads++;
+    }
+    if (q->numThreads == 0) {
+        res_queue_close(q);
+        efail(EAGAIN);
+    }
+    
+    // without io_uring everything goes to the threads
+    res_ring_open(q);
+    return q;
+}
+
+int res_read_async (RQUEUE *q, RFILE *rp, ResAsyncReq *req) {
+    if (q == NULL || rp == NULL || req == NULL) eret(EINVAL, -1);
+    if (req->buf != NULL && req->size == 0) eret(EINVAL, -1);
+    req->rp = rp;
+    req->next = NULL;
+    req->error = 0;
+    req->done = 0;
+    req->owned = 0;
+    
+    pthread_mutex_lock(&q->lock);
+    if (q->stop) {
+        pthread_mutex_unlock(&q->lock);
+        eret(ECANCELED, -1);
+    }
+    q->pending++;
+    pthread_mutex_unlock(&q->lock);
+    
+    if (q->ring == NULL || res_ring_start(q, req)) res_queue_push(q, req);
+    return 0;
+}
+
+ResAsyncReq* res_queue_poll (RQUEUE *q, int wait) {
+    if (q == NULL) efail(EINVAL);
+    pthread_mutex_lock(&q->lock);
+    while (q->doneHead == NULL) {
+        int err = wait ? (q->pending ? 0 : ENOENT) : EAGAIN;
+        if (err) {
+            pthread_mutex_unlock(&q->lock);
+            efail(err);
+        }
+        pthread_cond_wait(&q->done, &q->lock);
+    }
+    ResAsyncReq *req = q->doneHead;
+    q->doneHead = req->next;
+    if (q->doneHead == NULL) {
+        // nothing left, stop being readable
+        uint64_t count;
+        q->doneTail = NULL;
+        while (read(q->notify[0], &count, sizeof count) > 0);
+    }
+    pthread_mutex_unlock(&q->lock);
+    req->next = NULL;
+    return req;
+}
+
+int res_queue_fd (RQUEUE *q) {
+    if (q == NULL) eret(EINVAL, -1);
+    return q->notify[0];
+}
+
+int res_queue_close (RQUEUE *q) {
+    if (q == NULL) eret(EBADF, EOF);
+    pthread_mutex_lock(&q->lock);
+    while (q->pending) pthread_cond_wait(&q->done, &q->lock);
+    q->stop = 1;
+    pthread_cond_broadcast(&q->work);
+    pthread_mutex_unlock(&q->lock);
+    for(int i=0; i < q->numThreads; i++) pthread_join(q->threads[i], NULL);
+    res_ring_close(q);
+    
+    if (q->notify[0] != -1) close(q->notify[0]);
+    if (q->notify[1] != -1 && q->notify[1] != q->notify[0]) close(q->notify[1]);
+    pthread_cond_destroy(&q->work);
+    pthread_cond_destroy(&q->done);
+    pthread_mutex_destroy(&q->lock);
+    res_free(q->threads);
+    res_free(q);
+    return 0;
+}
+
+#if 0
+#pragma mark -
+#pragma mark Private Functions
+#endif
+
+static void* res_queue_worker (void *arg) {
+    RQUEUE *q = arg;
+    pthread_mutex_lock(&q->lock);
+    for(;;) {
+        while (q->head == NULL && !q->stop) pthread_cond_wait(&q->work, &q->lock);
+        ResAsyncReq *req = q->head;
+        if (req == NULL) break;
+        q->head = req->next;
+        if (q->head == NULL) q->tail = NULL;
+        pthread_mutex_unlock(&q->lock);
+        
+        res_queue_run(req);
+        res_queue_complete(q, req);
+        pthread_mutex_lock(&q->lock);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+static void res_queue_push (RQUEUE *q, ResAsyncReq *req) {
+    req->next = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail) q->tail->next = req;
+    else q->head = req;
+    q->tail = req;
+    pthread_cond_signal(&q->work);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void res_queue_run (ResAsyncReq *req) {
+    // the blocking way, on a pool thread
+    RFILE *rp = req->rp;
+    struct RmType *t = res_type_find(rp, req->type);
+    struct RmResRef *ref = t ? res_ref_find(rp, t, req->ID) : NULL;
+    size_t read = 0;
+    void *buf = NULL;
+    errno = ENOENT;
+    if (ref) buf = res_read_ref(rp, t, ref, req->buf, req->start, req->size, &read, NULL);
+    if (buf == NULL) {
+        req->error = errno;
+        req->size = 0;
+        return;
+    }
+    req->buf = buf;
+    req->size = read;
+}
+
+static void res_queue_complete (RQUEUE *q, ResAsyncReq *req) {
+    // the callback may free the request, don't touch it afterwards
+    if (req->func) {
+        req->func(req->ctx, req);
+        pthread_mutex_lock(&q->lock);
+    } else {
+        req->next = NULL;
+        pthread_mutex_lock(&q->lock);
+        if (q->doneTail) q->doneTail->next = req;
+        else {
+            uint64_t one = 1;
+            q->doneHead = req;
+            if (write(q->notify[1], &one, sizeof one) == -1) {}
+        }
+        q->doneTail = req;
+    }
+    q->pending--;
+    pthread_cond_broadcast(&q->done);
+    pthread_mutex_unlock(&q->lock);
+}
+
+#ifdef RES_HAVE_URING
+#if 0
+#pragma mark -
+#pragma mark io_uring
+#endif
+
+struct RmRing {
+    int                 fd;
+    unsigned            entries;
+    unsigned            inflight;
+    int                 broken;     // kernel can't do plain reads
+    void                *sq;
+    void                *cq;
+    size_t              sqSize;
+    size_t              cqSize;
+    struct io_uring_sqe *sqes;
+    size_t              sqesSize;
+    unsigned            *sqTail;
+    unsigned            *sqMask;
+    unsigned            *sqArray;
+    unsigned            *cqHead;
+    unsigned            *cqTail;
+    unsigned            *cqMask;
+    struct io_uring_cqe *cqes;
+    pthread_mutex_t     lock;       // submissions
+    pthread_t           reaper;
+};
+
+static void* res_ring_reaper (void *arg);
+static int res_ring_prepare (RFILE *rp, ResAsyncReq *req);
+static int res_ring_submit (struct RmRing *ring, ResAsyncReq *req);
+static void res_ring_done (RQUEUE *q, ResAsyncReq *req, int res);
+
+static int res_ring_open (RQUEUE *q) {
+    struct io_uring_params p;
+    bzero(&p, sizeof p);
+    int fd = (int)syscall(__NR_io_uring_setup, kAsyncRingSize, &p);
+    if (fd == -1) return -1;
+    struct RmRing *ring = res_malloc(sizeof(struct RmRing));
+    if (ring == NULL) {
+        close(fd);
+        eret(ENOMEM, -1);
+    }
+    bzero(ring, sizeof(struct RmRing));
+    ring->fd = fd;
+    ring->entries = p.sq_entries;
+    ring->sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqSize > ring->sqSize) ring->sqSize = ring->cqSize;
+        ring->cqSize = 0;
+    }
+    
+    ring->sq = mmap(NULL, ring->sqSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQ_RING);
+    ring->cq = ring->cqSize ? mmap(NULL, ring->cqSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_CQ_RING) : ring->sq;
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQES);
+    if (ring->sq == MAP_FAILED || ring->cq == MAP_FAILED || ring->sqes == MAP_FAILED) goto error;
+    ring->sqTail = ring->sq + p.sq_off.tail;
+    ring->sqMask = ring->sq + p.sq_off.ring_mask;
+    ring->sqArray = ring->sq + p.sq_off.array;
+    ring->cqHead = ring->cq + p.cq_off.head;
+    ring->cqTail = ring->cq + p.cq_off.tail;
+    ring->cqMask = ring->cq + p.cq_off.ring_mask;
+    ring->cqes = ring->cq + p.cq_off.cqes;
+    
+    pthread_mutex_init(&ring->lock, NULL);
+    q->ring = ring;
+    if (pthread_create(&ring->reaper, NULL, res_ring_reaper, q)) {
+        q->ring = NULL;
+        pthread_mutex_destroy(&ring->lock);
+        goto error;
+    }
+    return 0;
+error:
+    if (ring->sq != MAP_FAILED && ring->sq) munmap(ring->sq, ring->sqSize);
+    if (ring->cqSize && ring->cq != MAP_FAILED && ring->cq) munmap(ring->cq, ring->cqSize);
+    if (ring->sqes != MAP_FAILED && ring->sqes) munmap(ring->sqes, ring->sqesSize);
+    close(fd);
+    res_free(ring);
+    return -1;
+}
+
+static int res_ring_start (RQUEUE *q, ResAsyncReq *req) {
+    struct RmRing *ring = q->ring;
+    if (res_ring_prepare(req->rp, req)) return -1;
+    pthread_mutex_lock(&ring->lock);
+    int err = ring->broken || ring->inflight == ring->entries || res_ring_submit(ring, req);
+    pthread_mutex_unlock(&ring->lock);
+    if (err && req->owned) {
+        free(req->buf);
+        req->buf = NULL;
+        req->owned = 0;
+    }
+    return err ? -1 : 0;
+}
+
+static void res_ring_close (RQUEUE *q) {
+    struct RmRing *ring = q->ring;
+    if (ring == NULL) return;
+    
+    // an empty request stops the reaper
+    pthread_mutex_lock(&ring->lock);
+    unsigned tail = *ring->sqTail, index = tail & *ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    bzero(sqe, sizeof *sqe);
+    sqe->opcode = IORING_OP_NOP;
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail+1, __ATOMIC_RELEASE);
+    while (syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0) == -1 && errno == EINTR);
+    pthread_mutex_unlock(&ring->lock);
+    pthread_join(ring->reaper, NULL);
+    
+    pthread_mutex_destroy(&ring->lock);
+    munmap(ring->sq, ring->sqSize);
+    if (ring->cqSize) munmap(ring->cq, ring->cqSize);
+    munmap(ring->sqes, ring->sqesSize);
+    close(ring->fd);
+    res_free(ring);
+    q->ring = NULL;
+}
+
+static void* res_ring_reaper (void *arg) {
+    RQUEUE *q = arg;
+    struct RmRing *ring = q->ring;
+    for(int stop = 0; !stop;) {
+        if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1 && errno != EINTR) break;
+        unsigned head = *ring->cqHead, tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+        for(; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+            ResAsyncReq *req = (ResAsyncReq*)(uintptr_t)cqe->user_data;
+            int res = cqe->res;
+            __atomic_store_n(ring->cqHead, head+1, __ATOMIC_RELEASE);
+            if (req) res_ring_done(q, req, res);
+            else stop = 1;
+        }
+    }
+    return NULL;
+}
+
+static int res_ring_prepare (RFILE *rp, ResAsyncReq *req) {
+    // only plain reads from descriptors, of types that are already loaded
+    if (rp->fd == -1) return -1;
+    size_t i = res_search32(rp->typeCodes, rp->numTypes, req->type);
+    if (i == rp->numTypes || !__atomic_load_n(&rp->types[i].loaded, __ATOMIC_ACQUIRE)) return -1;
+    struct RmResRef *ref = res_ref_find(rp, &rp->types[i], req->ID);
+    if (ref == NULL || ref->flags.fl.compressed) return -1;
+    if (res_cache_wants(rp, &rp->types[i], ref)) return -1;
+    if (req->start > ref->psize) return -1;
+    
+    size_t size = req->size;
+    if (size == 0 || req->start + size > ref->psize) size = ref->psize - req->start;
+    req->offset = ref->offset + rp->dataOffset + 4 + req->start;
+    req->length = size;
+    if (req->offset + size > rp->size) return -1;
+    if (req->buf == NULL) {
+        req->buf = malloc(size ? size : 1);
+        if (req->buf == NULL) return -1;
+        req->owned = 1;
+    }
+    req->submitted = __atomic_load_n(&rp->trace, __ATOMIC_RELAXED) ? res_nanotime() : 0;
+    return 0;
+}
+
+static int res_ring_submit (struct RmRing *ring, ResAsyncReq *req) {
+    // called with the lock held, the kernel copies the entry on submission
+    unsigned tail = *ring->sqTail, index = tail & *ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    bzero(sqe, sizeof *sqe);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = req->rp->fd;
+    sqe->addr = (uintptr_t)req->buf + req->done;
+    sqe->len = (unsigned)(req->length - req->done);
+    sqe->off = req->rp->base + req->offset + req->done;
+    sqe->user_data = (uintptr_t)req;
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail+1, __ATOMIC_RELEASE);
+    
+    long r;
+    do r = syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0);
+    while (r == -1 && errno == EINTR);
+    if (r != 1) {
+        __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+        return -1;
+    }
+    ring->inflight++;
+    return 0;
+}
+
+static void res_ring_done (RQUEUE *q, ResAsyncReq *req, int res) {
+    struct RmRing *ring = q->ring;
+    pthread_mutex_lock(&ring->lock);
+    ring->inflight--;
+    if (res > 0) req->done += res;
+    // short reads continue where they stopped
+    int again = res > 0 && req->done < req->length && res_ring_submit(ring, req) == 0;
+    if (res == -EINVAL || res == -EOPNOTSUPP) ring->broken = 1;
+    pthread_mutex_unlock(&ring->lock);
+    if (again) return;
+    
+    if (res < 0 || req->done < req->length) {
+        // let a thread try it the usual way, and report the error if it fails too
+        if (req->owned) {
+            free(req->buf);
+            req->buf = NULL;
+            req->owned = 0;
+        }
+        res_queue_push(q, req);
+        return;
+    }
+    res_read_done(req->rp, req->offset, req->length, 1, req->submitted);
+    req->size = req->length;
+    res_queue_complete(q, req);
+}
+
+#else
+// no io_uring
+
+static int res_ring_open (RQUEUE *q) {
+    eret(ENOSYS, -1);
+}
+
+static int res_ring_start (RQUEUE *q, ResAsyncReq *req) {
+    eret(ENOSYS, -1);
+}
+
+static void res_ring_close (RQUEUE *q) {
+}
+#endif
@@ -0,0 +1,188 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// batched reads
+
+#define _DEFAULT_SOURCE // preadv
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "res.h"
+#include "libres_internal.h"
+
+static int res_batch_compar (const struct RmBatchEnt *a, const struct RmBatchEnt *b);
+static size_t res_batch_run (struct RmBatchEnt *ents, size_t count);
+static int res_batch_readv (RFILE *rp, struct RmBatchEnt *ents, size_t count);
+static int res_batch_span (RFILE *rp, struct RmBatchEnt *ents, size_t count);
+
+size_t res_read_many (RFILE *rp, ResReadReq *reqs, size_t count) {
+    if (count == 0) return 0;
+    struct RmBatchEnt *ents = res_file_malloc(rp, count * sizeof(struct RmBatchEnt));
+    size_t numEnts = 0, done = 0;
+    
+    // resolve, anything that isn't a plain read goes the usual way
+    for(size_t i=0; i < count; i++) {
+        ResReadReq *req = &reqs[i];
+        req->error = 0;
+        struct RmType *t = res_type_find(rp, req->type);
+        struct RmResRef *ref = t ? res_ref_find(rp, t, req->ID) : NULL;
+        if (ref == NULL) {
+            req->error = ENOENT;
+            continue;
+        }
+        if (req->buf && req->size == 0) {
+            req->error = EINVAL;
+            continue;
+        }
+        if (ents == NULL || ref->flags.fl.compressed || res_cache_wants(rp, t, ref)) {
+            size_t read;
+            void *buf = res_read_ref(rp, t, ref, req->buf, 0, req->size, &read, NULL);
+            if (buf == NULL) {
+                req->error = errno;
+                continue;
+            }
+            req->buf = buf;
+            req->size = read;
+            done++;
+            continue;
+        }
+        
+        struct RmBatchEnt *e = &ents[numEnts];
+        e->offset = ref->offset + rp->dataOffset + 4;
+        e->size = (req->buf && req->size < ref->psize) ? req->size : ref->psize;
+        e->req = req;
+        e->owned = 0;
+        if (e->offset + e->size > rp->size) {
+            req->error = EFAULT;
+            continue;
+        }
+        if (req->buf == NULL) {
+            req->buf = malloc(e->size ? e->size : 1);
+            if (req->buf == NULL) {
+                req->error = ENOMEM;
+                continue;
+            }
+            e->owned = 1;
+        }
+        numEnts++;
+    }
+    if (numEnts == 0) goto end;
+    
+    // memory needs no planning
+    if (rp->buf) {
+        for(size_t i=0; i < numEnts; i++) {
+            memcpy(ents[i].req->buf, rp->buf + ents[i].offset, ents[i].size);
+            ents[i].req->size = ents[i].size;
+        }
+        done += numEnts;
+        goto end;
+    }
+    
+    // read in file order, merging close ranges
+    qsort(ents, numEnts, sizeof(struct RmBatchEnt), (int(*)(const void*, const void*))res_batch_compar);
+    for(size_t i=0; i < numEnts;) {
+        size_t n = res_batch_run(&ents[i], numEnts - i);
+        if (res_batch_readv(rp, &ents[i], n) && res_batch_span(rp, &ents[i], n)) {
+            // fall back to one read each
+            for(size_t j=i; j < i+n; j++)
+                if (res_bread(rp, ents[j].req->buf, ents[j].offset, ents[j].size) == NULL) ents[j].req->error = errno;
+        }
+        for(size_t j=i; j < i+n; j++) {
+            ResReadReq *req = ents[j].req;
+            if (req->error == 0) {
+                req->size = ents[j].size;
+                done++;
+            } else if (ents[j].owned) {
+                free(req->buf);
+                req->buf = NULL;
+            }
+        }
+        i += n;
+    }
+    
+end:
+    if (ents) res_free(ents);
+    return done;
+}
+
+#if 0
+#pragma mark -
+#pragma mark Private Functions
+#endif
+
+static int res_batch_compar (const struct RmBatchEnt *a, const struct RmBatchEnt *b) {
+    if (a->offset == b->offset) return 0;
+    return a->offset < b->offset ? -1 : 1;
+}
+
+static size_t res_batch_run (struct RmBatchEnt *ents, size_t count) {
+    // entries that can be read together, overlaps (the same resource twice) start a new run
+    size_t n = 1, end = ents[0].offset + ents[0].size;
+    while (n < count && n < kBatchMaxIov/2) {
+        if (ents[n].offset < end || ents[n].offset - end > kBatchMaxGap) break;
+        end = ents[n].offset + ents[n].size;
+        n++;
+    }
+    return n;
+}
+
+static int res_batch_readv (RFILE *rp, struct RmBatchEnt *ents, size_t count) {
+    // one preadv per run, the gaps land in a scratch buffer
+    if (rp->fd == -1) return -1;
+    char gap[kBatchMaxGap];
+    struct iovec iov[kBatchMaxIov];
+    int numIov = 0;
+    size_t end = ents[0].offset;
+    for(size_t i=0; i < count; i++) {
+        if (ents[i].offset > end) {
+            iov[numIov].iov_base = gap;
+            iov[numIov++].iov_len = ents[i].offset - end;
+        }
+        iov[numIov].iov_base = ents[i].req->buf;
+        iov[numIov++].iov_len = ents[i].size;
+        end = ents[i].offset + ents[i].size;
+    }
+    size_t total = end - ents[0].offset;
+    
+    ssize_t r;
+    size_t calls = 0;
+    uint64_t start = __atomic_load_n(&rp->trace, __ATOMIC_RELAXED) ? res_nanotime() : 0;
+    do {
+        r = preadv(rp->fd, iov, numIov, (off_t)(rp->base + ents[0].offset));
+        calls++;
+    } while (r == -1 && errno == EINTR);
+    res_read_done(rp, ents[0].offset, total, calls, start);
+    return (r == (ssize_t)total) ? 0 : -1;
+}
+
+static int res_batch_span (RFILE *rp, struct RmBatchEnt *ents, size_t count) {
+    // functions get the whole span in one call and it's scattered from there
+    if (rp->fd != -1 || count == 1) return -1;
+    size_t start = ents[0].offset, span = ents[count-1].offset + ents[count-1].size - start;
+    void *buf = res_file_malloc(rp, span ? span : 1);
+    if (buf == NULL) return -1;
+    if (res_bread(rp, buf, start, span) == NULL) {
+        res_free(buf);
+        return -1;
+    }
+    for(size_t i=0; i < count; i++) memcpy(ents[i].req->buf, buf + ents[i].offset - start, ents[i].size);
+    res_free(buf);
+    return 0;
+}
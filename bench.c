@@ -0,0 +1,513 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// benchmarks over a generated resource fork
+
+#define _DEFAULT_SOURCE // mkstemp
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "res.h"
+
+#define kBenchTime      0.2 // seconds per benchmark
+#define kDataOffset     256
+#define kBlockSize      16
+
+struct Shape {
+    int         types;
+    int         perType;
+    int         namePct;    // resources with names
+    int         minSize;
+    int         maxSize;
+    int         cmpPct;     // resources compressed with 'dcmp' 1
+    int         unsorted;   // ref lists out of ID order
+    uint32_t    seed;
+};
+
+struct GenRes {
+    uint32_t    type;
+    int16_t     ID;
+    char        name[16];
+    uint8_t     *data;
+    size_t      size;
+    int         compressed;
+    size_t      seq;        // generation order
+};
+
+struct Fork {
+    uint8_t         *buf;
+    size_t          size;
+    struct GenRes   *res;
+    size_t          count;
+    char            path[1024];
+};
+
+struct Counters {
+    uint64_t    allocs;
+    uint64_t    calls;  // backend callbacks
+    long        syscr;  // read syscalls, -1 if unknown
+};
+
+static struct Counters counters;
+static uint32_t rngState;
+static struct Fork fork_;
+static const uint8_t *funcsBuf;
+static size_t funcsSize, funcsPos;
+static useconds_t funcsLatency; // per callback, standing in for a remote store
+
+#if 0
+#pragma mark -
+#pragma mark Generator
+#endif
+
+static uint32_t rng (void) {
+    // xorshift32, the same fork for the same seed everywhere
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return rngState;
+}
+
+static int rng_range (int lo, int hi) {
+    return lo + (int)(rng() % (uint32_t)(hi - lo + 1));
+}
+
+static void put16 (uint8_t *p, uint16_t v) {
+    p[0] = v >> 8; p[1] = v & 0xFF;
+}
+
+static void put32 (uint8_t *p, uint32_t v) {
+    p[0] = v >> 24; p[1] = (v >> 16) & 0xFF; p[2] = (v >> 8) & 0xFF; p[3] = v & 0xFF;
+}
+
+static size_t put_varint (uint8_t *p, int v) {
+    if (v >= 0 && v < 0x80) {
+        p[0] = v;
+        return 1;
+    }
+    p[0] = 0xC0 + ((v >> 8) & 0xFF);
+    p[1] = v & 0xFF;
+    return 2;
+}
+
+static size_t dcmp1_encode (const uint8_t *src, size_t size, uint8_t *dst) {
+    // 16-byte blocks: byte runs, remembered literals and new literals
+    const uint8_t *lits[0x1B0];
+    size_t numLits = 0, o = 0;
+    uint8_t *hdr = dst;
+    memset(hdr, 0, 18);
+    put32(hdr, 0xA89F6572);
+    put32(hdr+4, 0x00120801);
+    put32(hdr+8, (uint32_t)size);
+    put16(hdr+14, 1);
+    o = 18;
+    
+    size_t pos = 0;
+    for(; pos + kBlockSize <= size; pos += kBlockSize) {
+        const uint8_t *b = src + pos;
+        int run = 1;
+        for(int i=1; i < kBlockSize; i++) if (b[i] != b[0]) run = 0;
+        if (run) {
+            dst[o++] = 0xFE;
+            dst[o++] = 0x02;
+            o += put_varint(dst+o, b[0]);
+            o += put_varint(dst+o, kBlockSize-1);
+            continue;
+        }
+        size_t i;
+        for(i=0; i < numLits; i++) if (memcmp(lits[i], b, kBlockSize) == 0) break;
+        if (i < numLits) {
+            if (i < 0xB0) dst[o++] = 0x20 + i;
+            else {
+                dst[o++] = 0xD2;
+                dst[o++] = i - 0xB0;
+            }
+            continue;
+        }
+        dst[o++] = numLits < 0x1B0 ? 0x1F : 0x0F;
+        if (numLits < 0x1B0) lits[numLits++] = b;
+        memcpy(dst+o, b, kBlockSize);
+        o += kBlockSize;
+    }
+    for(; pos < size; pos++) {
+        dst[o++] = 0x00;
+        dst[o++] = src[pos];
+    }
+    dst[o++] = 0xFF;
+    return o;
+}
+
+static int type_compar (const void *a, const void *b) {
+    // keep each type's refs in the order they were generated
+    const struct GenRes *x = a, *y = b;
+    if (x->type != y->type) return x->type < y->type ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static int gen_fork (const struct Shape *s, struct Fork *f) {
+    rngState = s->seed ? s->seed : 1;
+    f->count = (size_t)s->types * s->perType;
+    f->res = calloc(f->count, sizeof(struct GenRes));
+    if (f->res == NULL) return -1;
+    
+    // a few distinct blocks make the data compressible
+    uint8_t vocab[32][kBlockSize];
+    for(int i=0; i < 32; i++) for(int j=0; j < kBlockSize; j++) vocab[i][j] = i < 4 ? i * 0x11 : rng();
+    
+    size_t n = 0;
+    for(int t=0; t < s->types; t++) {
+        uint32_t type;
+        for(int again = 1; again;) {
+            type = 0;
+            for(int k=0; k < 4; k++) type = type << 8 | rng_range('A', 'z');
+            again = 0;
+            for(size_t i=0; i < n; i++) if (f->res[i].type == type) again = 1;
+        }
+        int ID = rng_range(-200, 200);
+        for(int r=0; r < s->perType; r++, n++) {
+            struct GenRes *g = &f->res[n];
+            g->type = type;
+            g->ID = (int16_t)ID;
+            ID += rng_range(1, 3);
+            if (rng_range(1, 100) <= s->namePct) snprintf(g->name, sizeof g->name, "res %d", g->ID);
+            g->size = rng_range(s->minSize, s->maxSize);
+            g->data = malloc(g->size + 1);
+            if (g->data == NULL) return -1;
+            for(size_t k=0; k < g->size; k += kBlockSize) {
+                size_t len = g->size - k < kBlockSize ? g->size - k : kBlockSize;
+                memcpy(g->data + k, vocab[rng() % 32], len);
+            }
+            g->compressed = rng_range(1, 100) <= s->cmpPct;
+        }
+        if (s->unsorted) {
+            for(int r = s->perType - 1; r > 0; r--) {
+                int k = rng_range(0, r);
+                struct GenRes tmp = f->res[n - s->perType + r];
+                f->res[n - s->perType + r] = f->res[n - s->perType + k];
+                f->res[n - s->perType + k] = tmp;
+            }
+        }
+    }
+    
+    // files list types alphabetically
+    for(size_t i=0; i < f->count; i++) f->res[i].seq = i;
+    qsort(f->res, f->count, sizeof(struct GenRes), type_compar);
+    
+    // data section
+    size_t maxData = 0;
+    for(size_t i=0; i < f->count; i++) maxData += 4 + 18 + 2 * f->res[i].size + 64;
+    size_t mapMax = 30 + 8 * s->types + 12 * f->count + 17 * f->count;
+    f->buf = calloc(1, kDataOffset + maxData + mapMax);
+    if (f->buf == NULL) return -1;
+    uint32_t *offsets = calloc(f->count + 1, sizeof(uint32_t));
+    size_t d = kDataOffset;
+    for(size_t i=0; i < f->count; i++) {
+        struct GenRes *g = &f->res[i];
+        offsets[i] = (uint32_t)(d - kDataOffset);
+        size_t len = g->compressed ? dcmp1_encode(g->data, g->size, f->buf + d + 4) : g->size;
+        if (!g->compressed) memcpy(f->buf + d + 4, g->data, len);
+        put32(f->buf + d, (uint32_t)len);
+        d += 4 + len;
+    }
+    if (d - kDataOffset > 0xFFFFFF) {
+        fprintf(stderr, "bench: data section over 16MB\n");
+        return -1;
+    }
+    
+    // map: header, type list, ref lists, names
+    uint8_t *map = f->buf + d;
+    size_t typeList = 28, refs = typeList + 2 + 8 * s->types;
+    size_t names = refs + 12 * f->count;
+    if (names > 0xFFFF) {
+        fprintf(stderr, "bench: too many resources for one map\n");
+        return -1;
+    }
+    put16(map + 24, typeList);
+    put16(map + 26, names);
+    put16(map + typeList, s->types - 1);
+    size_t nameLen = 0;
+    for(int t=0; t < s->types; t++) {
+        size_t first = (size_t)t * s->perType;
+        uint8_t *te = map + typeList + 2 + 8 * t;
+        put32(te, f->res[first].type);
+        put16(te+4, s->perType - 1);
+        put16(te+6, 2 + 8 * s->types + 12 * first);
+        for(int r=0; r < s->perType; r++) {
+            struct GenRes *g = &f->res[first + r];
+            uint8_t *re = map + refs + 12 * (first + r);
+            put16(re, (uint16_t)g->ID);
+            size_t len = strlen(g->name);
+            if (len && nameLen + len + 1 < 0xFFFF) {
+                put16(re+2, nameLen);
+                map[names + nameLen] = len;
+                memcpy(map + names + nameLen + 1, g->name, len);
+                nameLen += len + 1;
+            } else {
+                put16(re+2, 0xFFFF);
+                g->name[0] = '\0';
+            }
+            re[4] = g->compressed ? 0x01 : 0x00;
+            uint32_t off = offsets[first + r];
+            re[5] = off >> 16;
+            put16(re+6, off & 0xFFFF);
+        }
+    }
+    free(offsets);
+    size_t mapLength = names + nameLen;
+    put32(f->buf, kDataOffset);
+    put32(f->buf+4, d);
+    put32(f->buf+8, d - kDataOffset);
+    put32(f->buf+12, mapLength);
+    memcpy(map, f->buf, 16);
+    f->size = d + mapLength;
+    return 0;
+}
+
+#if 0
+#pragma mark -
+#pragma mark Counting
+#endif
+
+static void* count_alloc (void *ctx, size_t size) {
+    counters.allocs++;
+    return malloc(size);
+}
+
+static void count_free (void *ctx, void *ptr) {
+    free(ptr);
+}
+
+static long read_syscalls (void) {
+    // Linux only
+    FILE *fp = fopen("/proc/self/io", "r");
+    if (fp == NULL) return -1;
+    char key[32];
+    long value, syscr = -1;
+    while (fscanf(fp, "%31s %ld", key, &value) == 2)
+        if (strcmp(key, "syscr:") == 0) syscr = value;
+    fclose(fp);
+    return syscr;
+}
+
+static unsigned long funcs_seek (void *priv, long offset, int whence) {
+    counters.calls++;
+    if (funcsLatency) usleep(funcsLatency);
+    if (whence == SEEK_SET) funcsPos = offset;
+    else if (whence == SEEK_CUR) funcsPos += offset;
+    else funcsPos = funcsSize + offset;
+    return funcsPos;
+}
+
+static unsigned long funcs_read (void *priv, void *buf, unsigned long count) {
+    counters.calls++;
+    if (funcsLatency) usleep(funcsLatency);
+    if (funcsPos > funcsSize) return 0;
+    if (count > funcsSize - funcsPos) count = funcsSize - funcsPos;
+    memcpy(buf, funcsBuf + funcsPos, count);
+    funcsPos += count;
+    return count;
+}
+
+static unsigned long funcs_read_at (void *priv, void *buf, unsigned long count, unsigned long offset) {
+    counters.calls++;
+    if (funcsLatency) usleep(funcsLatency);
+    memcpy(buf, funcsBuf + offset, count);
+    return count;
+}
+
+#if 0
+#pragma mark -
+#pragma mark Benchmarks
+#endif
+
+enum Backend { kPath, kPathMmap, kPathLazy, kMem, kFuncs, kFuncsAt, kFuncsRA, kFuncsAtRA };
+static const char *backendNames[] = {"path", "mmap", "lazy", "mem", "funcs", "funcs_at", "funcs_ra", "funcs_at_ra"};
+
+static RFILE* open_backend (int backend) {
+    switch (backend) {
+        case kPath:     return res_open(fork_.path, 0);
+        case kPathMmap: return res_open(fork_.path, RES_MODE_MMAP);
+        case kPathLazy: return res_open(fork_.path, RES_MODE_LAZY);
+        case kMem:      return res_open_mem(fork_.buf, fork_.size, 1);
+        case kFuncs:    return res_open_funcs(NULL, funcs_seek, funcs_read);
+        case kFuncsAt:  return res_open_funcs_at(NULL, fork_.size, funcs_read_at, 0);
+        case kFuncsRA:  return res_open_funcs_mode(NULL, funcs_seek, funcs_read, RES_MODE_READAHEAD);
+        case kFuncsAtRA: return res_open_funcs_at(NULL, fork_.size, funcs_read_at, RES_MODE_READAHEAD);
+    }
+    return NULL;
+}
+
+typedef void (*bench_func)(RFILE *rp, int backend, uint64_t i);
+
+static void bench_open (RFILE *rp, int backend, uint64_t i) {
+    res_close(open_backend(backend));
+}
+
+static void bench_list (RFILE *rp, int backend, uint64_t i) {
+    uint32_t type = fork_.res[i % fork_.count].type;
+    free(res_list(rp, type, NULL, 0, 0, NULL, NULL));
+}
+
+static void bench_attr (RFILE *rp, int backend, uint64_t i) {
+    struct GenRes *g = &fork_.res[(i * 2654435761u) % fork_.count];
+    ResAttr attr;
+    res_attr(rp, g->type, g->ID, &attr);
+}
+
+static void bench_attr_named (RFILE *rp, int backend, uint64_t i) {
+    struct GenRes *g = &fork_.res[(i * 2654435761u) % fork_.count];
+    ResAttr attr;
+    if (g->name[0]) res_attr_named(rp, g->type, g->name, &attr);
+    else res_attr_named(rp, g->type, "missing", &attr);
+}
+
+static void bench_read (RFILE *rp, int backend, uint64_t i) {
+    struct GenRes *g = &fork_.res[(i * 2654435761u) % fork_.count];
+    free(res_read(rp, g->type, g->ID, NULL, 0, 0, NULL, NULL));
+}
+
+static void bench_scan (RFILE *rp, int backend, uint64_t i) {
+    // in file order
+    struct GenRes *g = &fork_.res[i % fork_.count];
+    free(res_read(rp, g->type, g->ID, NULL, 0, 0, NULL, NULL));
+}
+
+static double now (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run (const char *name, int backend, bench_func func, int needsFile) {
+    RFILE *rp = needsFile ? open_backend(backend) : NULL;
+    if (needsFile && rp == NULL) {
+        fprintf(stderr, "bench: %s/%s: %s\n", name, backendNames[backend], strerror(errno));
+        return;
+    }
+    
+    // warm up, then count whole batches until the time is up
+    for(uint64_t i=0; i < 16; i++) func(rp, backend, i);
+    struct Counters start = counters;
+    start.syscr = read_syscalls();
+    uint64_t ops = 0, batch = 16;
+    double t0 = now(), elapsed;
+    do {
+        for(uint64_t i=0; i < batch; i++) func(rp, backend, ops + i);
+        ops += batch;
+        if (batch < 0x10000) batch *= 2;
+        elapsed = now() - t0;
+    } while (elapsed < kBenchTime);
+    long syscr = read_syscalls();
+    
+    printf("%-12s %-11s %10llu %12.1f %10.2f %10.2f", name, backendNames[backend], (unsigned long long)ops, elapsed * 1e9 / ops,
+        (double)(counters.allocs - start.allocs) / ops, (double)(counters.calls - start.calls) / ops);
+    // the /proc read itself shows up once
+    if (syscr >= 0 && start.syscr >= 0) printf(" %10.2f\n", (double)(syscr - start.syscr - 1) / ops);
+    else printf(" %10s\n", "-");
+    if (rp) res_close(rp);
+}
+
+static int verify (int backend) {
+    RFILE *rp = open_backend(backend);
+    if (rp == NULL) return -1;
+    int bad = 0;
+    for(size_t i=0; i < fork_.count; i++) {
+        struct GenRes *g = &fork_.res[i];
+        size_t size;
+        void *data = res_read(rp, g->type, g->ID, NULL, 0, 0, &size, NULL);
+        if (data == NULL || size != g->size || memcmp(data, g->data, size)) bad++;
+        free(data);
+    }
+    res_close(rp);
+    return bad;
+}
+
+static void usage (void) {
+    fprintf(stderr, "usage: bench [-t types] [-n resources per type] [-N named%%] [-s min size] [-S max size]\n"
+                    "             [-c compressed%%] [-u] [-r seed] [-l callback latency us] [-o fork]\n");
+    exit(2);
+}
+
+int main (int argc, char **argv) {
+    struct Shape s = {20, 100, 50, 16, 1024, 0, 0, 1};
+    const char *out = NULL;
+    int c;
+    while ((c = getopt(argc, argv, "t:n:N:s:S:c:ur:l:o:")) != -1) {
+        switch (c) {
+            case 't': s.types = atoi(optarg); break;
+            case 'n': s.perType = atoi(optarg); break;
+            case 'N': s.namePct = atoi(optarg); break;
+            case 's': s.minSize = atoi(optarg); break;
+            case 'S': s.maxSize = atoi(optarg); break;
+            case 'c': s.cmpPct = atoi(optarg); break;
+            case 'u': s.unsorted = 1; break;
+            case 'r': s.seed = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'l': funcsLatency = (useconds_t)atoi(optarg); break;
+            case 'o': out = optarg; break;
+            default: usage();
+        }
+    }
+    if (s.types < 1 || s.types > 0x8000 || s.perType < 1 || s.perType > 0x8000 || s.minSize < 0 || s.maxSize < s.minSize) usage();
+    
+    if (gen_fork(&s, &fork_)) {
+        fprintf(stderr, "bench: can't generate fork\n");
+        return 1;
+    }
+    funcsBuf = fork_.buf;
+    funcsSize = fork_.size;
+    
+    // path backends need it on disk
+    int fd;
+    if (out) {
+        snprintf(fork_.path, sizeof fork_.path, "%s", out);
+        fd = open(fork_.path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    } else {
+        snprintf(fork_.path, sizeof fork_.path, "/tmp/libres-bench.XXXXXX");
+        fd = mkstemp(fork_.path);
+    }
+    if (fd == -1 || write(fd, fork_.buf, fork_.size) != (ssize_t)fork_.size) {
+        fprintf(stderr, "bench: %s: %s\n", fork_.path, strerror(errno));
+        return 1;
+    }
+    close(fd);
+    
+    res_set_allocator(NULL, count_alloc, count_free);
+    for(int b = kPath; b <= kFuncsAtRA; b++) {
+        if (verify(b) == 0) continue;
+        fprintf(stderr, "bench: %s backend reads back wrong data\n", backendNames[b]);
+        return 1;
+    }
+    
+    printf("%d types x %d resources, %d%% named, %d-%d bytes, %d%% compressed%s, fork is %zu bytes\n\n",
+        s.types, s.perType, s.namePct, s.minSize, s.maxSize, s.cmpPct, s.unsorted ? ", unsorted" : "", fork_.size);
+    printf("%-12s %-11s %10s %12s %10s %10s %10s\n", "benchmark", "backend", "ops", "ns/op", "allocs/op", "calls/op", "reads/op");
+    for(int b = kPath; b <= kFuncsAtRA; b++) run("res_open", b, bench_open, 0);
+    run("res_list", kPath, bench_list, 1);
+    run("res_attr", kPath, bench_attr, 1);
+    run("res_attr", kPathLazy, bench_attr, 1);
+    run("named", kPath, bench_attr_named, 1);
+    for(int b = kPath; b <= kFuncsAtRA; b++) if (b != kPathLazy) run("res_read", b, bench_read, 1);
+    for(int b = kFuncs; b <= kFuncsAtRA; b++) run("scan", b, bench_scan, 1);
+    
+    if (out == NULL) unlink(fork_.path);
+    return 0;
+}
@@ -0,0 +1,316 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// LRU cache of read resources
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "res.h"
+#include "libres_internal.h"
+
+static struct RmCacheEnt ** res_cache_slot (struct RmCache *c, uint32_t type, int16_t ID);
+static void res_cache_unlink (struct RmCache *c, struct RmCacheEnt *e);
+static void res_cache_trim (struct RmCache *c);
+static int res_cache_grow (struct RmCache *c);
+
+int res_cache (RFILE *rp, size_t budget) {
+    // handles shared by res_pool can be set up from several threads, so the cache
+    // stays until the file is closed, disabling it only empties it
+    struct RmCache *c = __atomic_load_n(&rp->cache, __ATOMIC_ACQUIRE);
+    if (c == NULL && budget == 0) return 0;
+    if (c == NULL) c = res_cache_create(rp);
+    if (c == NULL) return -1;
+    pthread_mutex_lock(&rp->cacheLock);
+    __atomic_store_n(&c->budget, budget, __ATOMIC_RELAXED);
+    res_cache_trim(c);
+    pthread_mutex_unlock(&rp->cacheLock);
+    return 0;
+}
+
+const void* res_acquire (RFILE *rp, uint32_t type, int16_t ID, size_t *size) {
+    struct RmType *t = res_type_find(rp, type);
+    if (t == NULL) efail(ENOENT);
+    struct RmCacheEnt *e = res_cache_get(rp, type, res_ref_find(rp, t, ID));
+    if (e == NULL) return NULL;
+    if (size) *size = e->size;
+    return e->data;
+}
+
+void res_release (RFILE *rp, const void *data) {
+    if (data == NULL) return;
+    res_cache_put(rp, (struct RmCacheEnt*)(data - offsetof(struct RmCacheEnt, data)));
+}
+
+ResCacheStats* res_cache_stats (RFILE *rp, ResCacheStats *buf) {
+    if (buf == NULL) buf = malloc(sizeof(ResCacheStats));
+    if (buf == NULL) efail(ENOMEM);
+    bzero(buf, sizeof(ResCacheStats));
+    struct RmCache *c = __atomic_load_n(&rp->cache, __ATOMIC_ACQUIRE);
+    if (c == NULL) return buf;
+    
+    pthread_mutex_lock(&rp->cacheLock);
+    buf->hits       = c->hits;
+    buf->misses     = c->misses;
+    buf->evictions  = c->evictions;
+    buf->bytes      = c->bytes;
+    buf->entries    = c->entries;
+    buf->preloaded  = c->pinned;
+    buf->preloadedBytes = c->pinnedBytes;
+    pthread_mutex_unlock(&rp->cacheLock);
+    return buf;
+}
+
+#if 0
+#pragma mark -
+#pragma mark Private Functions
+#endif
+
+struct RmCache * res_cache_create (RFILE *rp) {
+    // returns the file's cache, whoever creates it first
+    struct RmCache *c = res_file_malloc(rp, sizeof(struct RmCache));
+    if (c == NULL) efail(ENOMEM);
+    bzero(c, sizeof(struct RmCache));
+    c->buckets = res_file_malloc(rp, kCacheBuckets * sizeof(struct RmCacheEnt*));
+    if (c->buckets == NULL) effail(ENOMEM, c);
+    bzero(c->buckets, kCacheBuckets * sizeof(struct RmCacheEnt*));
+    c->numBuckets = kCacheBuckets;
+    struct RmCache *old = NULL;
+    if (!__atomic_compare_exchange_n(&rp->cache, &old, c, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        res_free(c->buckets);
+        res_free(c);
+        return old;
+    }
+    return c;
+}
+
+void res_cache_close (RFILE *rp) {
+    // entries are freed even if still acquired, their data dies with the file
+    struct RmCache *c = rp->cache;
+    if (c == NULL) return;
+    for(size_t i=0; i < c->numBuckets; i++) {
+        struct RmCacheEnt *e = c->buckets[i];
+        while (e) {
+            struct RmCacheEnt *next = e->hnext;
+            res_free(e);
+            e = next;
+        }
+    }
+    res_free(c->buckets);
+    res_free(c);
+    rp->cache = NULL;
+    for(size_t i=0; i < rp->numTypes; i++) {
+        if (rp->types[i].pinned) res_free(rp->types[i].pinned);
+        rp->types[i].pinned = NULL;
+    }
+}
+
+struct RmCacheEnt * res_cache_get (RFILE *rp, uint32_t type, struct RmResRef *ref) {
+    if (ref == NULL) efail(ENOENT);
+    struct RmCache *c = __atomic_load_n(&rp->cache, __ATOMIC_ACQUIRE);
+    
+    // hit
+    if (c) {
+        pthread_mutex_lock(&rp->cacheLock);
+        struct RmCacheEnt *e = *res_cache_slot(c, type, ref->ID);
+        if (e) {
+            c->hits++;
+            if (!e->pinned) {
+                res_cache_unlink(c, e);
+                e->next = c->head;
+                if (c->head) c->head->prev = e;
+                c->head = e;
+                if (c->tail == NULL) c->tail = e;
+            }
+            e->refs++;
+            pthread_mutex_unlock(&rp->cacheLock);
+            return e;
+        }
+        c->misses++;
+        pthread_mutex_unlock(&rp->cacheLock);
+    }
+    
+    // miss, read the whole resource without holding the lock
+    struct RmCacheEnt *e = res_file_malloc(rp, sizeof(struct RmCacheEnt) + ref->size);
+    if (e == NULL) efail(ENOMEM);
+    bzero(e, sizeof(struct RmCacheEnt));
+    e->type = type;
+    e->ID = ref->ID;
+    e->size = ref->size;
+    e->refs = 1;
+    void *r;
+    if (ref->size == 0) r = e->data;
+    else if (ref->flags.fl.compressed) r = res_read_dcmp(rp, ref, e->data, 0, ref->size, NULL, NULL);
+    else r = res_read_raw(rp, ref, e->data, 0, ref->size, NULL, NULL);
+    if (r == NULL) effail(errno, e);
+    
+    // keep it if it fits, unless another thread got there first
+    if (c == NULL) return e;
+    pthread_mutex_lock(&rp->cacheLock);
+    struct RmCacheEnt *o = *res_cache_slot(c, type, ref->ID);
+    if (o) {
+        o->refs++;
+        pthread_mutex_unlock(&rp->cacheLock);
+        res_free(e);
+        return o;
+    }
+    if (e->size <= c->budget) {
+        if (c->entries + c->pinned >= c->numBuckets) res_cache_grow(c); // chains just get longer if this fails
+        struct RmCacheEnt **slot = res_cache_slot(c, type, ref->ID);
+        e->hnext = *slot;
+        *slot = e;
+        e->next = c->head;
+        if (c->head) c->head->prev = e;
+        c->head = e;
+        if (c->tail == NULL) c->tail = e;
+        e->cached = 1;
+        c->bytes += e->size;
+        c->entries++;
+        res_cache_trim(c);
+    }
+    pthread_mutex_unlock(&rp->cacheLock);
+    return e;
+}
+
+void res_cache_pin (RFILE *rp, struct RmType *t, struct RmResRef *ref, struct RmCacheEnt *e) {
+    // takes e, which may be dropped for an entry that's already cached
+    struct RmCache *c = __atomic_load_n(&rp->cache, __ATOMIC_ACQUIRE);
+    pthread_mutex_lock(&rp->cacheLock);
+    if (t->pinned == NULL) {
+        uint8_t *pinned = res_file_malloc(rp, t->count);
+        if (pinned == NULL) {
+            // reads just won't find it
+            pthread_mutex_unlock(&rp->cacheLock);
+            res_free(e);
+            return;
+        }
+        bzero(pinned, t->count);
+        __atomic_store_n(&t->pinned, pinned, __ATOMIC_RELEASE);
+    }
+    struct RmCacheEnt **slot = res_cache_slot(c, e->type, e->ID);
+    struct RmCacheEnt *o = *slot;
+    if (o && !o->pinned) {
+        // take it out of the LRU list
+        res_cache_unlink(c, o);
+        c->bytes -= o->size;
+        c->entries--;
+    } else if (o == NULL) {
+        if (c->entries + c->pinned >= c->numBuckets) res_cache_grow(c);
+        slot = res_cache_slot(c, e->type, e->ID);
+        e->hnext = *slot;
+        *slot = e;
+        e->cached = 1;
+        o = e;
+        e = NULL;
+    }
+    if (!o->pinned) {
+        o->pinned = 1;
+        c->pinnedBytes += o->size;
+        c->pinned++;
+    }
+    __atomic_store_n(&t->pinned[ref - t->list], 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&rp->cacheLock);
+    res_free(e);
+}
+
+void res_cache_put (RFILE *rp, struct RmCacheEnt *e) {
+    pthread_mutex_lock(&rp->cacheLock);
+    int dead = --e->refs == 0 && !e->cached;
+    pthread_mutex_unlock(&rp->cacheLock);
+    if (dead) res_free(e);
+}
+
+void* res_cache_read (RFILE *rp, struct RmType *t, struct RmResRef *ref, void *buf, size_t start, size_t size, size_t *read, size_t *remain) {
+    if (buf != NULL && size == 0) efail(EINVAL);
+    if (start > ref->size) efail(EINVAL);
+    if (size == 0 || start + size > ref->size) size = ref->size - start;
+    
+    // too big for the cache or it was disabled, unless it was preloaded
+    struct RmCache *c = __atomic_load_n(&rp->cache, __ATOMIC_ACQUIRE);
+    size_t budget = __atomic_load_n(&c->budget, __ATOMIC_RELAXED);
+    if ((budget == 0 || ref->size > budget) && !res_ref_pinned(t, ref)) {
+        if (ref->flags.fl.compressed) return res_read_dcmp(rp, ref, buf, start, size, read, remain);
+        return res_read_raw(rp, ref, buf, start, size, read, remain);
+    }
+    struct RmCacheEnt *e = res_cache_get(rp, t->type, ref);
+    if (e == NULL) return NULL;
+    
+    void *out = buf ? buf : malloc(size ? size : 1);
+    if (out) memcpy(out, e->data + start, size);
+    res_cache_put(rp, e);
+    if (out == NULL) efail(ENOMEM);
+    if (read) *read = size;
+    if (remain) *remain = ref->size - (size + start);
+    return out;
+}
+
+static struct RmCacheEnt ** res_cache_slot (struct RmCache *c, uint32_t type, int16_t ID) {
+    // returns the matching entry's link in its chain, or the chain's terminating NULL
+    uint32_t h = (type * 31 + (uint16_t)ID) * 2654435761u;
+    struct RmCacheEnt **slot = &c->buckets[h & (c->numBuckets - 1)];
+    while (*slot && ((*slot)->type != type || (*slot)->ID != ID)) slot = &(*slot)->hnext;
+    return slot;
+}
+
+static void res_cache_unlink (struct RmCache *c, struct RmCacheEnt *e) {
+    if (e->prev) e->prev->next = e->next;
+    else c->head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else c->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void res_cache_trim (struct RmCache *c) {
+    while (c->bytes > c->budget && c->tail) {
+        struct RmCacheEnt *e = c->tail;
+        res_cache_unlink(c, e);
+        *res_cache_slot(c, e->type, e->ID) = e->hnext;
+        e->hnext = NULL;
+        e->cached = 0;
+        c->bytes -= e->size;
+        c->entries--;
+        c->evictions++;
+        // entries still in use are freed on their last release
+        if (e->refs == 0) res_free(e);
+    }
+}
+
+static int res_cache_grow (struct RmCache *c) {
+    size_t numBuckets = 2 * c->numBuckets;
+    struct RmCacheEnt **buckets = res_malloc(numBuckets * sizeof(struct RmCacheEnt*));
+    if (buckets == NULL) return -1;
+    bzero(buckets, numBuckets * sizeof(struct RmCacheEnt*));
+    struct RmCacheEnt **old = c->buckets;
+    size_t oldBuckets = c->numBuckets;
+    c->buckets = buckets;
+    c->numBuckets = numBuckets;
+    for(size_t i=0; i < oldBuckets; i++) {
+        struct RmCacheEnt *e = old[i];
+        while (e) {
+            struct RmCacheEnt *next = e->hnext;
+            struct RmCacheEnt **slot = res_cache_slot(c, e->type, e->ID);
+            e->hnext = *slot;
+            *slot = e;
+            e = next;
+        }
+    }
+    res_free(old);
+    return 0;
+}
@@ -0,0 +1,175 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// listing many files at once
+
+#define _DEFAULT_SOURCE // sysconf
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "res.h"
+#include "libres_internal.h"
+
+static void* res_catalog_worker (void *arg);
+static int res_catalog_take (struct RmCatWorker *w, size_t *index);
+static int res_catalog_steal (struct RmCatWorker *w);
+static int res_catalog_file (struct RmCatalog *cat, const char *path);
+
+int res_catalog (const char * const *paths, size_t count, int threads, int mode, res_catalog_func func, void *ctx) {
+    if (func == NULL) eret(EINVAL, -1);
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0) threads = 1;
+    if ((size_t)threads > count) threads = count ? (int)count : 1;
+    
+    struct RmCatalog cat;
+    bzero(&cat, sizeof cat);
+    cat.paths = paths;
+    cat.mode = mode;
+    cat.func = func;
+    cat.ctx = ctx;
+    cat.numWorkers = threads;
+    cat.workers = res_malloc(threads * sizeof(struct RmCatWorker));
+    pthread_t *tids = res_malloc(threads * sizeof(pthread_t));
+    if (cat.workers == NULL || tids == NULL) {
+        res_free(cat.workers);
+        res_free(tids);
+        eret(ENOMEM, -1);
+    }
+    pthread_mutex_init(&cat.outLock, NULL);
+    
+    // deal out contiguous ranges, idle workers steal half of someone else's
+    for(int i=0; i < threads; i++) {
+        struct RmCatWorker *w = &cat.workers[i];
+        pthread_mutex_init(&w->lock, NULL);
+        w->next = count * i / threads;
+        w->end = count * (i+1) / threads;
+        w->cat = &cat;
+    }
+    // a worker that fails to start leaves its range for the others to steal
+    int started = 1;
+    for(int i=1; i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, res_catalog_worker, &cat.workers[i])) break;
+        started++;
+    }
+    res_catalog_worker(&cat.workers[0]);
+    for(int i=1; i < started; i++) pthread_join(tids[i], NULL);
+    
+    for(int i=0; i < threads; i++) pthread_mutex_destroy(&cat.workers[i].lock);
+    pthread_mutex_destroy(&cat.outLock);
+    res_free(cat.workers);
+    res_free(tids);
+    if (cat.stop) eret(ECANCELED, -1);
+    return 0;
+}
+
+#if 0
+#pragma mark -
+#pragma mark Private Functions
+#endif
+
+static void* res_catalog_worker (void *arg) {
+    struct RmCatWorker *w = arg;
+    struct RmCatalog *cat = w->cat;
+    size_t index;
+    while (!__atomic_load_n(&cat->stop, __ATOMIC_RELAXED)) {
+        if (res_catalog_take(w, &index)) {
+            if (res_catalog_steal(w)) break;
+            continue;
+        }
+        if (res_catalog_file(cat, cat->paths[index])) __atomic_store_n(&cat->stop, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static int res_catalog_take (struct RmCatWorker *w, size_t *index) {
+    pthread_mutex_lock(&w->lock);
+    int empty = w->next >= w->end;
+    if (!empty) *index = w->next++;
+    pthread_mutex_unlock(&w->lock);
+    return empty;
+}
+
+static int res_catalog_steal (struct RmCatWorker *w) {
+    // take the back half of the fullest worker
+    struct RmCatalog *cat = w->cat;
+    for(;;) {
+        struct RmCatWorker *victim = NULL;
+        size_t most = 0;
+        for(int i=0; i < cat->numWorkers; i++) {
+            struct RmCatWorker *v = &cat->workers[i];
+            pthread_mutex_lock(&v->lock);
+            size_t left = v->end > v->next ? v->end - v->next : 0;
+            pthread_mutex_unlock(&v->lock);
+            if (v != w && left > most) {
+                most = left;
+                victim = v;
+            }
+        }
+        if (victim == NULL) return -1;
+        
+        // it may have moved on since, only ever lock one worker at a time
+        pthread_mutex_lock(&victim->lock);
+        size_t left = victim->end > victim->next ? victim->end - victim->next : 0;
+        size_t start = victim->end - left / 2, end = victim->end;
+        if (left == 1) start = victim->next;
+        if (left) victim->end = start;
+        pthread_mutex_unlock(&victim->lock);
+        if (left == 0) continue;
+        
+        pthread_mutex_lock(&w->lock);
+        w->next = start;
+        w->end = end;
+        pthread_mutex_unlock(&w->lock);
+        return 0;
+    }
+}
+
+static int res_catalog_file (struct RmCatalog *cat, const char *path) {
+    RFILE *rp = res_open(path, cat->mode);
+    ResCatEntry *entries = NULL;
+    size_t count = 0;
+    int error = rp ? 0 : (errno ? errno : EINVAL);
+    
+    if (rp) {
+        for(size_t i=0; i < rp->numTypes; i++) count += rp->types[i].count;
+        entries = res_malloc(count * sizeof(ResCatEntry) + 1);
+        if (entries == NULL) error = ENOMEM;
+    }
+    for(size_t i=0, n=0; error == 0 && i < rp->numTypes; i++) {
+        struct RmType *t = res_type_load(rp, &rp->types[i]);
+        if (t == NULL) {
+            error = errno;
+            break;
+        }
+        for(size_t j=0; j < t->count; j++, n++) {
+            entries[n].type = t->type;
+            res_ref_attr(t, &t->list[j], &entries[n].attr);
+        }
+    }
+    if (error) count = 0;
+    
+    pthread_mutex_lock(&cat->outLock);
+    int r = __atomic_load_n(&cat->stop, __ATOMIC_RELAXED) ? 1 : cat->func(cat->ctx, path, entries, count, error);
+    pthread_mutex_unlock(&cat->outLock);
+    res_free(entries);
+    if (rp) res_close(rp);
+    return r;
+}
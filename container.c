@@ -0,0 +1,180 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// resource forks inside AppleSingle, AppleDouble and MacBinary files
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "res.h"
+#include "libres_internal.h"
+#ifdef __linux__
+#include <sys/xattr.h>
+#endif
+
+static int res_container_find (const uint8_t *head, size_t headSize, size_t fileSize, size_t *offset, size_t *length);
+static int res_container_apple (const uint8_t *head, size_t headSize, size_t fileSize, size_t *offset, size_t *length);
+static int res_container_macbinary (const uint8_t *head, size_t headSize, size_t fileSize, size_t *offset, size_t *length);
+static uint16_t res_crc16 (const uint8_t *data, size_t size);
+static uint32_t res_get32 (const uint8_t *p);
+
+RFILE* res_open_container (const char *path, int mode) {
+    // map it only once the fork is found
+    if (mode & ~(RES_MODE_MMAP|RES_MODE_LAZY|RES_MODE_PRELOAD)) efail(EINVAL);
+    RFILE *rp = res_open_path(path, mode & ~RES_MODE_MMAP);
+    if (rp == NULL) return NULL;
+    
+    uint8_t head[kContainerHeadSize];
+    size_t headSize = rp->size < sizeof head ? rp->size : sizeof head;
+    size_t offset, length;
+    if (res_bread(rp, head, 0, headSize) == NULL) ecfail(errno, rp);
+    if (res_container_find(head, headSize, rp->size, &offset, &length)) ecfail(errno, rp);
+    
+    if (mode & RES_MODE_MMAP) {
+        // map up to the end of the fork, the mapping has to start at the beginning of a page
+        if (length == 0) ecfail(EINVAL, rp);
+        void *map = mmap(NULL, offset + length, PROT_READ, MAP_PRIVATE, rp->fd, 0);
+        if (map == MAP_FAILED) ecfail(errno, rp);
+        rp->buf = map + offset;
+        rp->mode = mode;
+        close(rp->fd);
+        rp->fd = -1;
+    }
+    rp->base = offset;
+    rp->size = length;
+    return res_load(rp);
+}
+
+RFILE* res_open_container_mem (void *buf, size_t size, int copy, int mode) {
+    if (buf == NULL) return NULL;
+    if (mode & ~(RES_MODE_LAZY|RES_MODE_PRELOAD)) efail(EINVAL);
+    size_t offset, length;
+    if (res_container_find(buf, size < kContainerHeadSize ? size : kContainerHeadSize, size, &offset, &length)) return NULL;
+    if (copy) return res_open_mem_mode(buf + offset, length, 1, mode);
+    
+    // the fork stays where it is, the whole buffer is freed on closing
+    RFILE *rp = res_new(mode);
+    if (rp == NULL) return NULL;
+    rp->buf = buf + offset;
+    rp->base = offset;
+    rp->size = length;
+    return res_load(rp);
+}
+
+RFILE* res_open_xattr (const char *path, int mode) {
+    if (path == NULL) efail(EINVAL);
+    if (mode & ~(RES_MODE_MMAP|RES_MODE_LAZY|RES_MODE_PRELOAD)) efail(EINVAL);
+#if defined(__APPLE__)
+    // the attribute is the fork, it can be read in place
+    char *forkPath = malloc(strlen(path) + sizeof "/..namedfork/rsrc");
+    if (forkPath == NULL) efail(ENOMEM);
+    sprintf(forkPath, "%s/..namedfork/rsrc", path);
+    RFILE *rp = res_open(forkPath, mode);
+    int err = errno;
+    free(forkPath);
+    errno = err;
+    return rp;
+#elif defined(__linux__)
+    // attributes can only be read whole
+    ssize_t size = getxattr(path, kResourceForkXattr, NULL, 0);
+    if (size == -1) return NULL;
+    if (size == 0) efail(EINVAL);
+    void *buf = malloc((size_t)size);
+    if (buf == NULL) efail(ENOMEM);
+    size = getxattr(path, kResourceForkXattr, buf, (size_t)size);
+    if (size <= 0) {
+        int err = size ? errno : EINVAL;
+        free(buf);
+        efail(err);
+    }
+    return res_open_mem_mode(buf, (size_t)size, 0, mode & ~RES_MODE_MMAP);
+#else
+    efail(ENOTSUP);
+#endif
+}
+
+#if 0
+#pragma mark -
+#pragma mark Private Functions
+#endif
+
+static int res_container_find (const uint8_t *head, size_t headSize, size_t fileSize, size_t *offset, size_t *length) {
+    if (headSize >= 4 && (res_get32(head) == kAppleSingleMagic || res_get32(head) == kAppleDoubleMagic))
+        return res_container_apple(head, headSize, fileSize, offset, length);
+    if (res_container_macbinary(head, headSize, fileSize, offset, length) == 0) return 0;
+    
+    // anything else could be a bare fork
+    *offset = 0;
+    *length = fileSize;
+    return 0;
+}
+
+static int res_container_apple (const uint8_t *head, size_t headSize, size_t fileSize, size_t *offset, size_t *length) {
+    // magic, version, 16 bytes of filler, then 12-byte entries: ID, offset, length
+    if (headSize < 26) eret(EINVAL, -1);
+    size_t numEntries = (size_t)head[24] << 8 | head[25];
+    if (26 + 12 * numEntries > headSize) eret(EINVAL, -1);
+    for(size_t i=0; i < numEntries; i++) {
+        const uint8_t *e = head + 26 + 12 * i;
+        if (res_get32(e) != kAppleEntryResourceFork) continue;
+        size_t o = res_get32(e+4), l = res_get32(e+8);
+        if (o > fileSize || l > fileSize - o) eret(EINVAL, -1);
+        *offset = o;
+        *length = l;
+        return 0;
+    }
+    eret(ENOENT, -1);
+}
+
+static int res_container_macbinary (const uint8_t *head, size_t headSize, size_t fileSize, size_t *offset, size_t *length) {
+    // 128-byte header, then the data fork and the resource fork, each padded to 128 bytes
+    if (headSize < kMacBinaryHeaderSize) return -1;
+    if (head[0] != 0 || head[74] != 0 || head[82] != 0 || head[1] < 1 || head[1] > 63) return -1;
+    
+    // MacBinary II and III have a checksum, MacBinary I has nothing but zeroes after the dates
+    if (res_crc16(head, 124) != ((uint16_t)head[124] << 8 | head[125])) {
+        for(int i=99; i < 126; i++) if (head[i]) return -1;
+    }
+    size_t dataLength = res_get32(head+83);
+    size_t rsrcLength = res_get32(head+87);
+    size_t secondary = (size_t)head[120] << 8 | head[121];
+    size_t o = kMacBinaryHeaderSize + ((secondary + 127) & ~(size_t)127) + ((dataLength + 127) & ~(size_t)127);
+    if (dataLength > 0x7FFFFFFF || rsrcLength > 0x7FFFFFFF || o > fileSize || rsrcLength > fileSize - o) return -1;
+    // no fork to open, likely a bare fork with its data 64K or more in, which looks like MacBinary I
+    if (rsrcLength == 0) return -1;
+    *offset = o;
+    *length = rsrcLength;
+    return 0;
+}
+
+static uint16_t res_crc16 (const uint8_t *data, size_t size) {
+    // CRC-CCITT, as in XMODEM
+    uint16_t crc = 0;
+    for(size_t i=0; i < size; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for(int b=0; b < 8; b++) crc = crc & 0x8000 ? (uint16_t)(crc << 1 ^ 0x1021) : (uint16_t)(crc << 1);
+    }
+    return crc;
+}
+
+static uint32_t res_get32 (const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
@@ -0,0 +1,650 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// decompressors for 'dcmp' 0, 1 and 2 compressed resources
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <arpa/inet.h>
+#include "res.h"
+#include "libres_internal.h"
+
+// constant words for 'dcmp' 0 codes 0x4B-0xFD
+static const uint8_t res_dcmp0_table[0xFE - 0x4B][2] = {
+    {0x00,0x00}, {0x4E,0xBA}, {0x00,0x08}, {0x4E,0x75}, {0x00,0x0C}, {0x4E,0xAD}, {0x20,0x53}, {0x2F,0x0B},
+    {0x61,0x00}, {0x00,0x10}, {0x70,0x00}, {0x2F,0x00}, {0x48,0x6E}, {0x20,0x50}, {0x20,0x6E}, {0x2F,0x2E},
+    {0xFF,0xFC}, {0x48,0xE7}, {0x3F,0x3C}, {0x00,0x04}, {0xFF,0xF8}, {0x2F,0x0C}, {0x20,0x06}, {0x4E,0xED},
+    {0x4E,0x56}, {0x20,0x68}, {0x4E,0x5E}, {0x00,0x01}, {0x58,0x8F}, {0x4F,0xEF}, {0x00,0x02}, {0x00,0x18},
+    {0x60,0x00}, {0xFF,0xFF}, {0x50,0x8F}, {0x4E,0x90}, {0x00,0x06}, {0x26,0x6E}, {0x00,0x14}, {0xFF,0xF4},
+    {0x4C,0xEE}, {0x00,0x0A}, {0x00,0x0E}, {0x41,0xEE}, {0x4C,0xDF}, {0x48,0xC0}, {0xFF,0xF0}, {0x2D,0x40},
+    {0x00,0x12}, {0x30,0x2E}, {0x70,0x01}, {0x2F,0x28}, {0x20,0x54}, {0x67,0x00}, {0x00,0x20}, {0x00,0x1C},
+    {0x20,0x5F}, {0x18,0x00}, {0x26,0x6F}, {0x48,0x78}, {0x00,0x16}, {0x41,0xFA}, {0x30,0x3C}, {0x28,0x40},
+    {0x72,0x00}, {0x28,0x6E}, {0x20,0x0C}, {0x66,0x00}, {0x20,0x6B}, {0x2F,0x07}, {0x55,0x8F}, {0x00,0x28},
+    {0xFF,0xFE}, {0xFF,0xEC}, {0x22,0xD8}, {0x20,0x0B}, {0x00,0x0F}, {0x59,0x8F}, {0x2F,0x3C}, {0xFF,0x00},
+    {0x01,0x18}, {0x81,0xE1}, {0x4A,0x00}, {0x4E,0xB0}, {0xFF,0xE8}, {0x48,0xC7}, {0x00,0x03}, {0x00,0x22},
+    {0x00,0x07}, {0x00,0x1A}, {0x67,0x06}, {0x67,0x08}, {0x4E,0xF9}, {0x00,0x24}, {0x20,0x78}, {0x08,0x00},
+    {0x66,0x04}, {0x00,0x2A}, {0x4E,0xD0}, {0x30,0x28}, {0x26,0x5F}, {0x67,0x04}, {0x00,0x30}, {0x43,0xEE},
+    {0x3F,0x00}, {0x20,0x1F}, {0x00,0x1E}, {0xFF,0xF6}, {0x20,0x2E}, {0x42,0xA7}, {0x20,0x07}, {0xFF,0xFA},
+    {0x60,0x02}, {0x3D,0x40}, {0x0C,0x40}, {0x66,0x06}, {0x00,0x26}, {0x2D,0x48}, {0x2F,0x01}, {0x70,0xFF},
+    {0x60,0x04}, {0x18,0x80}, {0x4A,0x40}, {0x00,0x40}, {0x00,0x2C}, {0x2F,0x08}, {0x00,0x11}, {0xFF,0xE4},
+    {0x21,0x40}, {0x26,0x40}, {0xFF,0xF2}, {0x42,0x6E}, {0x4E,0xB9}, {0x3D,0x7C}, {0x00,0x38}, {0x00,0x0D},
+    {0x60,0x06}, {0x42,0x2E}, {0x20,0x3C}, {0x67,0x0C}, {0x2D,0x68}, {0x66,0x08}, {0x4A,0x2E}, {0x4A,0xAE},
+    {0x00,0x2E}, {0x48,0x40}, {0x22,0x5F}, {0x22,0x00}, {0x67,0x0A}, {0x30,0x07}, {0x42,0x67}, {0x00,0x32},
+    {0x20,0x28}, {0x00,0x09}, {0x48,0x7A}, {0x02,0x00}, {0x2F,0x2B}, {0x00,0x05}, {0x22,0x6E}, {0x67,0x02},
+    {0xE5,0x80}, {0x67,0x0E}, {0x66,0x0A}, {0x00,0x50}, {0x3E,0x00}, {0x66,0x0C}, {0x2E,0x00}, {0xFF,0xEE},
+    {0x20,0x6D}, {0x20,0x40}, {0xFF,0xE0}, {0x53,0x40}, {0x60,0x08}, {0x04,0x80}, {0x00,0x68}, {0x0B,0x7C},
+    {0x44,0x00}, {0x41,0xE8}, {0x48,0x41},
+};
+// constant words for 'dcmp' 1 codes 0xD5-0xFD
+static const uint8_t res_dcmp1_table[0xFE - 0xD5][2] = {
+    {0x00,0x00}, {0x00,0x01}, {0x00,0x02}, {0x00,0x03}, {0x2E,0x01}, {0x3E,0x01}, {0x01,0x01}, {0x1E,0x01},
+    {0xFF,0xFF}, {0x0E,0x01}, {0x31,0x00}, {0x11,0x12}, {0x01,0x07}, {0x33,0x32}, {0x12,0x39}, {0xED,0x10},
+    {0x01,0x27}, {0x23,0x22}, {0x01,0x37}, {0x07,0x06}, {0x01,0x17}, {0x01,0x23}, {0x00,0xFF}, {0x00,0x2F},
+    {0x07,0x0E}, {0xFD,0x3C}, {0x01,0x35}, {0x01,0x15}, {0x01,0x02}, {0x00,0x07}, {0x00,0x3E}, {0x05,0xD5},
+    {0x02,0x01}, {0x06,0x07}, {0x07,0x08}, {0x30,0x01}, {0x01,0x33}, {0x00,0x10}, {0x17,0x16}, {0x37,0x3E},
+    {0x36,0x37},
+};
+// default word table for 'dcmp' 2
+static const uint8_t res_dcmp2_table[0x100][2] = {
+    {0x00,0x00}, {0x00,0x08}, {0x4E,0xBA}, {0x20,0x6E}, {0x4E,0x75}, {0x00,0x0C}, {0x00,0x04}, {0x70,0x00},
+    {0x00,0x10}, {0x00,0x02}, {0x48,0x6E}, {0xFF,0xFC}, {0x60,0x00}, {0x00,0x01}, {0x48,0xE7}, {0x2F,0x2E},
+    {0x4E,0x56}, {0x00,0x06}, {0x4E,0x5E}, {0x2F,0x00}, {0x61,0x00}, {0xFF,0xF8}, {0x2F,0x0B}, {0xFF,0xFF},
+    {0x00,0x14}, {0x00,0x0A}, {0x00,0x18}, {0x20,0x5F}, {0x00,0x0E}, {0x20,0x50}, {0x3F,0x3C}, {0xFF,0xF4},
+    {0x4C,0xEE}, {0x30,0x2E}, {0x67,0x00}, {0x4C,0xDF}, {0x26,0x6E}, {0x00,0x12}, {0x00,0x1C}, {0x42,0x67},
+    {0xFF,0xF0}, {0x30,0x3C}, {0x2F,0x0C}, {0x00,0x03}, {0x4E,0xD0}, {0x00,0x20}, {0x70,0x01}, {0x00,0x16},
+    {0x2D,0x40}, {0x48,0xC0}, {0x20,0x78}, {0x72,0x00}, {0x58,0x8F}, {0x66,0x00}, {0x4F,0xEF}, {0x42,0xA7},
+    {0x67,0x06}, {0xFF,0xFA}, {0x55,0x8F}, {0x28,0x6E}, {0x3F,0x00}, {0xFF,0xFE}, {0x2F,0x3C}, {0x67,0x04},
+    {0x59,0x8F}, {0x20,0x6B}, {0x00,0x24}, {0x20,0x1F}, {0x41,0xFA}, {0x81,0xE1}, {0x66,0x04}, {0x67,0x08},
+    {0x00,0x1A}, {0x4E,0xB9}, {0x50,0x8F}, {0x20,0x2E}, {0x00,0x07}, {0x4E,0xB0}, {0xFF,0xF2}, {0x3D,0x40},
+    {0x00,0x1E}, {0x20,0x68}, {0x66,0x06}, {0xFF,0xF6}, {0x4E,0xF9}, {0x08,0x00}, {0x0C,0x40}, {0x3D,0x7C},
+    {0xFF,0xEC}, {0x00,0x05}, {0x20,0x3C}, {0xFF,0xE8}, {0xDE,0xFC}, {0x4A,0x2E}, {0x00,0x30}, {0x00,0x28},
+    {0x2F,0x08}, {0x20,0x0B}, {0x60,0x02}, {0x42,0x6E}, {0x2D,0x48}, {0x20,0x53}, {0x20,0x40}, {0x18,0x00},
+    {0x60,0x04}, {0x41,0xEE}, {0x2F,0x28}, {0x2F,0x01}, {0x67,0x0A}, {0x48,0x40}, {0x20,0x07}, {0x66,0x08},
+    {0x01,0x18}, {0x2F,0x07}, {0x30,0x28}, {0x3F,0x2E}, {0x30,0x2B}, {0x22,0x6E}, {0x2F,0x2B}, {0x00,0x2C},
+    {0x67,0x0C}, {0x22,0x5F}, {0x60,0x06}, {0x00,0xFF}, {0x30,0x07}, {0xFF,0xEE}, {0x53,0x40}, {0x00,0x40},
+    {0xFF,0xE4}, {0x4A,0x40}, {0x66,0x0A}, {0x00,0x0F}, {0x4E,0xAD}, {0x70,0xFF}, {0x22,0xD8}, {0x48,0x6B},
+    {0x00,0x22}, {0x20,0x4B}, {0x67,0x0E}, {0x4A,0xAE}, {0x4E,0x90}, {0xFF,0xE0}, {0xFF,0xC0}, {0x00,0x2A},
+    {0x27,0x40}, {0x67,0x02}, {0x51,0xC8}, {0x02,0xB6}, {0x48,0x7A}, {0x22,0x78}, {0xB0,0x6E}, {0xFF,0xE6},
+    {0x00,0x09}, {0x32,0x2E}, {0x3E,0x00}, {0x48,0x41}, {0xFF,0xEA}, {0x43,0xEE}, {0x4E,0x71}, {0x74,0x00},
+    {0x2F,0x2C}, {0x20,0x6C}, {0x00,0x3C}, {0x00,0x26}, {0x00,0x50}, {0x18,0x80}, {0x30,0x1F}, {0x22,0x00},
+    {0x66,0x0C}, {0xFF,0xDA}, {0x00,0x38}, {0x66,0x02}, {0x30,0x2C}, {0x20,0x0C}, {0x2D,0x6E}, {0x42,0x40},
+    {0xFF,0xE2}, {0xA9,0xF0}, {0xFF,0x00}, {0x37,0x7C}, {0xE5,0x80}, {0xFF,0xDC}, {0x48,0x68}, {0x59,0x4F},
+    {0x00,0x34}, {0x3E,0x1F}, {0x60,0x08}, {0x2F,0x06}, {0xFF,0xDE}, {0x60,0x0A}, {0x70,0x02}, {0x00,0x32},
+    {0xFF,0xCC}, {0x00,0x80}, {0x22,0x51}, {0x10,0x1F}, {0x31,0x7C}, {0xA0,0x29}, {0xFF,0xD8}, {0x52,0x40},
+    {0x01,0x00}, {0x67,0x10}, {0xA0,0x23}, {0xFF,0xCE}, {0xFF,0xD4}, {0x20,0x06}, {0x48,0x78}, {0x00,0x2E},
+    {0x50,0x4F}, {0x43,0xFA}, {0x67,0x12}, {0x76,0x00}, {0x41,0xE8}, {0x4A,0x6E}, {0x20,0xD9}, {0x00,0x5A},
+    {0x7F,0xFF}, {0x51,0xCA}, {0x00,0x5C}, {0x2E,0x00}, {0x02,0x40}, {0x48,0xC7}, {0x67,0x14}, {0x0C,0x80},
+    {0x2E,0x9F}, {0xFF,0xD6}, {0x80,0x00}, {0x10,0x00}, {0x48,0x42}, {0x4A,0x6B}, {0xFF,0xD2}, {0x00,0x48},
+    {0x4A,0x47}, {0x4E,0xD1}, {0x20,0x6F}, {0x00,0x41}, {0x60,0x0C}, {0x2A,0x78}, {0x42,0x2E}, {0x32,0x00},
+    {0x65,0x74}, {0x67,0x16}, {0x00,0x44}, {0x48,0x6D}, {0x20,0x08}, {0x48,0x6C}, {0x0B,0x7C}, {0x26,0x40},
+    {0x04,0x00}, {0x00,0x68}, {0x20,0x6D}, {0x00,0x0D}, {0x2A,0x40}, {0x00,0x0B}, {0x00,0x3E}, {0x02,0x20},
+};
+
+// output window for a decoding run
+struct RmDcmpOut {
+    uint8_t     *buf;
+    size_t      start;
+    size_t      end;
+};
+
+static int res_dcmp_emit (struct RmDcmp *d, struct RmDcmpOut *o, const uint8_t *src, size_t len);
+static int res_dcmp_fill (struct RmDcmp *d, struct RmDcmpOut *o, const uint8_t *unit, size_t unitLen, size_t count);
+static int res_dcmp_varint (struct RmDcmp *d, int32_t *v);
+static int res_dcmp_literal (struct RmDcmp *d, struct RmDcmpOut *o, size_t len, int remember);
+static int res_dcmp_backref (struct RmDcmp *d, struct RmDcmpOut *o, size_t ind);
+static int res_dcmp0_step (struct RmDcmp *d, struct RmDcmpOut *o);
+static int res_dcmp1_step (struct RmDcmp *d, struct RmDcmpOut *o);
+static int res_dcmp2_step (struct RmDcmp *d, struct RmDcmpOut *o);
+static int res_dcmp_mark (struct RmDcmp *d);
+static void res_dcmp_saved_free (struct RmDcmpSaved *s);
+
+int res_checkpoint (RFILE *rp, size_t interval) {
+    if (rp == NULL) eret(EBADF, -1);
+    __atomic_store_n(&rp->dcmpInterval, interval, __ATOMIC_RELAXED);
+    if (interval == 0) res_dcmp_forget(rp);
+    return 0;
+}
+
+int res_dcmp_init (struct RmDcmp *d, const void *data, size_t length) {
+    bzero(d, sizeof(struct RmDcmp));
+    struct RfCmpHdr hdr;
+    if (length < kCompressedHeaderSize) eret(EILSEQ, -1);
+    memcpy(&hdr, data, sizeof hdr);
+    if (ntohl(hdr.tag) != kCompressedResourceTag) eret(EILSEQ, -1);
+    
+    // header length is the top half of the flags
+    uint32_t flags = ntohl(hdr.flags);
+    size_t hdrLength = flags >> 16;
+    if (hdrLength < kCompressedHeaderSize || hdrLength > length) eret(EILSEQ, -1);
+    if (flags == kCompressedResourceFlg0)
+        d->dcmp = ntohs(hdr.u.v0.dcmp);
+    else if (flags == kCompressedResourceFlg1)
+        d->dcmp = ntohs(hdr.u.v1.dcmp);
+    else eret(ENOSYS, -1);
+    d->in = data + hdrLength;
+    d->inLength = length - hdrLength;
+    d->outLength = ntohl(hdr.size);
+    
+    switch (d->dcmp) {
+        case 0:
+            if (flags != kCompressedResourceFlg1) eret(ENOSYS, -1);
+            d->table = res_dcmp0_table;
+            d->tableSize = sizeof res_dcmp0_table / 2;
+            break;
+        case 1:
+            if (flags != kCompressedResourceFlg1) eret(ENOSYS, -1);
+            d->table = res_dcmp1_table;
+            d->tableSize = sizeof res_dcmp1_table / 2;
+            break;
+        case 2: {
+            // parameters follow the decompressor ID
+            if (flags != kCompressedResourceFlg0) eret(ENOSYS, -1);
+            const uint8_t *params = data + sizeof hdr;
+            d->tagged = (params[1] & kDCMP2Tagged) != 0;
+            if (params[1] & kDCMP2CustomTable) {
+                d->tableSize = (size_t)params[0] + 1;
+                if (d->inLength < 2 * d->tableSize) eret(EILSEQ, -1);
+                d->table = (const uint8_t (*)[2])d->in;
+                d->in += 2 * d->tableSize;
+                d->inLength -= 2 * d->tableSize;
+            } else {
+                d->table = res_dcmp2_table;
+                d->tableSize = sizeof res_dcmp2_table / 2;
+            }
+            break;
+        }
+        default:
+            eret(ENOSYS, -1);
+    }
+    return 0;
+}
+
+int res_dcmp_run (struct RmDcmp *d, void *buf, size_t start, size_t end) {
+    struct RmDcmpOut o = {buf, start, end};
+    if (end > d->outLength) eret(EFAULT, -1);
+    if (start < d->st.outPos) eret(EINVAL, -1);
+    
+    int (*step)(struct RmDcmp*, struct RmDcmpOut*) = res_dcmp2_step;
+    if (d->dcmp == 0) step = res_dcmp0_step;
+    else if (d->dcmp == 1) step = res_dcmp1_step;
+    
+    size_t from = d->st.outPos;
+    int r = 0;
+    while (d->st.outPos < end) {
+        struct RmDcmpState saved = d->st;
+        r = step(d, &o);
+        if (r) break;
+        if (d->st.outPos > end) {
+            // the last code ran past the window, it will be replayed by the next run
+            d->st = saved;
+            break;
+        }
+        if (d->interval && d->st.outPos < d->outLength && d->st.outPos >= (d->numMarks ? d->marks[d->numMarks-1].outPos : 0) + d->interval && res_dcmp_mark(d))
+            d->interval = 0; // keep going without them
+    }
+    if (d->rp) res_stat_add(d->rp, bytesDecoded, d->st.outPos - from);
+    if (r < 0) return -1;
+    if (r > 0) eret(EILSEQ, -1); // data ended early
+    return 0;
+}
+
+void res_dcmp_free (struct RmDcmp *d) {
+    res_free(d->lits);
+    res_free(d->marks);
+    d->lits = NULL;
+    d->marks = NULL;
+    d->numMarks = 0;
+}
+
+void res_dcmp_restore (RFILE *rp, struct RmResRef *ref, struct RmDcmp *d, size_t start) {
+    // untagged 'dcmp' 2 skips ahead without decoding
+    d->interval = __atomic_load_n(&rp->dcmpInterval, __ATOMIC_RELAXED);
+    if (d->interval == 0 || (d->dcmp == 2 && !d->tagged)) {
+        d->interval = 0;
+        return;
+    }
+    
+    pthread_mutex_lock(&rp->dcmpLock);
+    struct RmDcmpSaved **sp = &rp->dcmpSaved;
+    while (*sp && (*sp)->ref != ref) sp = &(*sp)->next;
+    struct RmDcmpSaved *s = *sp;
+    if (s == NULL) {
+        pthread_mutex_unlock(&rp->dcmpLock);
+        return;
+    }
+    *sp = s->next;
+    s->next = rp->dcmpSaved;
+    rp->dcmpSaved = s;
+    
+    // last checkpoint at or before start
+    size_t lo = 0, hi = s->numMarks;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (s->marks[mid].outPos <= start) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == 0 || s->marks[lo-1].outPos <= d->st.outPos) {
+        pthread_mutex_unlock(&rp->dcmpLock);
+        return;
+    }
+    
+    // take the checkpoints up to it, and the literals they can refer to
+    struct RmDcmpState *mark = &s->marks[lo-1];
+    size_t litSlots = mark->numLits > 64 ? mark->numLits : 64;
+    size_t markSlots = s->markSlots;
+    struct RmDcmpLit *lits = res_file_malloc(rp, litSlots * sizeof(struct RmDcmpLit));
+    struct RmDcmpState *marks = res_file_malloc(rp, markSlots * sizeof(struct RmDcmpState));
+    if (lits == NULL || marks == NULL) {
+        pthread_mutex_unlock(&rp->dcmpLock);
+        res_free(lits);
+        res_free(marks);
+        return;
+    }
+    if (mark->numLits) memcpy(lits, s->lits, mark->numLits * sizeof(struct RmDcmpLit));
+    memcpy(marks, s->marks, lo * sizeof(struct RmDcmpState));
+    d->st = *mark;
+    pthread_mutex_unlock(&rp->dcmpLock);
+    
+    res_dcmp_free(d);
+    d->lits = lits;
+    d->litSlots = litSlots;
+    d->marks = marks;
+    d->numMarks = lo;
+    d->markSlots = markSlots;
+}
+
+void res_dcmp_save (RFILE *rp, struct RmResRef *ref, struct RmDcmp *d) {
+    if (d->numMarks == 0) return;
+    pthread_mutex_lock(&rp->dcmpLock);
+    struct RmDcmpSaved **sp = &rp->dcmpSaved;
+    size_t count = 0;
+    while (*sp && (*sp)->ref != ref) {
+        sp = &(*sp)->next;
+        count++;
+    }
+    struct RmDcmpSaved *s = *sp;
+    if (s && s->marks[s->numMarks-1].outPos >= d->marks[d->numMarks-1].outPos) {
+        // nothing new
+        pthread_mutex_unlock(&rp->dcmpLock);
+        return;
+    }
+    if (s) *sp = s->next;
+    else {
+        s = res_file_malloc(rp, sizeof(struct RmDcmpSaved));
+        if (s == NULL) {
+            pthread_mutex_unlock(&rp->dcmpLock);
+            return;
+        }
+        bzero(s, sizeof(struct RmDcmpSaved));
+        s->ref = ref;
+        // drop the least recently used
+        if (count >= kDcmpSavedMax) {
+            struct RmDcmpSaved **last = &rp->dcmpSaved;
+            while ((*last)->next) last = &(*last)->next;
+            res_dcmp_saved_free(*last);
+            *last = NULL;
+        }
+    }
+    s->next = rp->dcmpSaved;
+    rp->dcmpSaved = s;
+    
+    // the decompressor is done with them
+    res_free(s->lits);
+    res_free(s->marks);
+    s->lits = d->lits;
+    s->litSlots = d->litSlots;
+    s->marks = d->marks;
+    s->numMarks = d->numMarks;
+    s->markSlots = d->markSlots;
+    pthread_mutex_unlock(&rp->dcmpLock);
+    d->lits = NULL;
+    d->marks = NULL;
+    d->numMarks = 0;
+}
+
+void res_dcmp_forget (RFILE *rp) {
+    pthread_mutex_lock(&rp->dcmpLock);
+    struct RmDcmpSaved *s = rp->dcmpSaved;
+    rp->dcmpSaved = NULL;
+    pthread_mutex_unlock(&rp->dcmpLock);
+    while (s) {
+        struct RmDcmpSaved *next = s->next;
+        res_dcmp_saved_free(s);
+        s = next;
+    }
+}
+
+#if 0
+#pragma mark -
+#pragma mark Checkpoints
+#endif
+
+static int res_dcmp_mark (struct RmDcmp *d) {
+    if (d->numMarks == d->markSlots) {
+        size_t slots = d->markSlots ? 2 * d->markSlots : 16;
+        struct RmDcmpState *marks = res_file_malloc(d->rp, slots * sizeof(struct RmDcmpState));
+        if (marks == NULL) eret(ENOMEM, -1);
+        if (d->marks) memcpy(marks, d->marks, d->numMarks * sizeof(struct RmDcmpState));
+        res_free(d->marks);
+        d->marks = marks;
+        d->markSlots = slots;
+    }
+    d->marks[d->numMarks++] = d->st;
+    return 0;
+}
+
+static void res_dcmp_saved_free (struct RmDcmpSaved *s) {
+    res_free(s->lits);
+    res_free(s->marks);
+    res_free(s);
+}
+
+#if 0
+#pragma mark -
+#pragma mark Output
+#endif
+
+static int res_dcmp_emit (struct RmDcmp *d, struct RmDcmpOut *o, const uint8_t *src, size_t len) {
+    size_t pos = d->st.outPos;
+    if (len > d->outLength - pos) eret(EILSEQ, -1);
+    d->st.outPos += len;
+    
+    // copy the part that falls in the window
+    size_t a = pos > o->start ? pos : o->start;
+    size_t b = pos+len < o->end ? pos+len : o->end;
+    if (a < b) memcpy(o->buf + (a - o->start), src + (a - pos), b - a);
+    return 0;
+}
+
+static int res_dcmp_fill (struct RmDcmp *d, struct RmDcmpOut *o, const uint8_t *unit, size_t unitLen, size_t count) {
+    size_t pos = d->st.outPos;
+    if (count > (d->outLength - pos) / unitLen) eret(EILSEQ, -1);
+    size_t len = count * unitLen;
+    d->st.outPos += len;
+    
+    size_t a = pos > o->start ? pos : o->start;
+    size_t b = pos+len < o->end ? pos+len : o->end;
+    if (a >= b) return 0;
+    if (unitLen == 1) memset(o->buf + (a - o->start), unit[0], b - a);
+    else for(size_t i=a; i < b; i++) o->buf[i - o->start] = unit[(i - pos) % unitLen];
+    return 0;
+}
+
+#if 0
+#pragma mark -
+#pragma mark 'dcmp' 0 and 1
+#endif
+
+static int res_dcmp_varint (struct RmDcmp *d, int32_t *v) {
+    const uint8_t *p = d->in + d->st.inPos;
+    size_t left = d->inLength - d->st.inPos;
+    if (left < 1) eret(EILSEQ, -1);
+    if (p[0] == 0xFF) {
+        // 32-bit value follows
+        if (left < 5) eret(EILSEQ, -1);
+        *v = (int32_t)((uint32_t)p[1] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 8 | p[4]);
+        d->st.inPos += 5;
+    } else if (p[0] >= 0x80) {
+        // 16-bit value, biased by 0xC000
+        if (left < 2) eret(EILSEQ, -1);
+        *v = (int16_t)(((p[0] - 0xC0) & 0xFF) << 8 | p[1]);
+        d->st.inPos += 2;
+    } else {
+        *v = p[0];
+        d->st.inPos += 1;
+    }
+    return 0;
+}
+
+static int res_dcmp_literal (struct RmDcmp *d, struct RmDcmpOut *o, size_t len, int remember) {
+    if (len > d->inLength - d->st.inPos) eret(EILSEQ, -1);
+    if (remember) {
+        // literals are remembered by their position in the input
+        if (d->st.numLits == d->litSlots) {
+            size_t slots = d->litSlots ? 2 * d->litSlots : 64;
+            struct RmDcmpLit *lits = res_file_malloc(d->rp, slots * sizeof(struct RmDcmpLit));
+            if (lits == NULL) eret(ENOMEM, -1);
+            if (d->lits) memcpy(lits, d->lits, d->litSlots * sizeof(struct RmDcmpLit));
+            res_free(d->lits);
+            d->lits = lits;
+            d->litSlots = slots;
+        }
+        d->lits[d->st.numLits].offset = (uint32_t)d->st.inPos;
+        d->lits[d->st.numLits].length = (uint32_t)len;
+        d->st.numLits++;
+    }
+    const uint8_t *src = d->in + d->st.inPos;
+    d->st.inPos += len;
+    return res_dcmp_emit(d, o, src, len);
+}
+
+static int res_dcmp_backref (struct RmDcmp *d, struct RmDcmpOut *o, size_t ind) {
+    if (ind >= d->st.numLits) eret(EILSEQ, -1);
+    return res_dcmp_emit(d, o, d->in + d->lits[ind].offset, d->lits[ind].length);
+}
+
+static int res_dcmp0_step (struct RmDcmp *d, struct RmDcmpOut *o) {
+    const uint8_t *in = d->in;
+    size_t left = d->inLength - d->st.inPos;
+    if (left < 1) return 1;
+    uint8_t code = in[d->st.inPos++];
+    left--;
+    
+    if (code < 0x20) {
+        // literal words, remembered if bit 4 is set
+        size_t count = code & 0x0F;
+        if (count == 0) {
+            if (left < 1) eret(EILSEQ, -1);
+            count = in[d->st.inPos++];
+        }
+        return res_dcmp_literal(d, o, 2 * count, code & 0x10);
+    } else if (code < 0x22) {
+        if (left < 1) eret(EILSEQ, -1);
+        size_t ind = 0x28 + ((code - 0x20) << 8 | in[d->st.inPos++]);
+        return res_dcmp_backref(d, o, ind);
+    } else if (code == 0x22) {
+        if (left < 2) eret(EILSEQ, -1);
+        size_t ind = 0x28 + (in[d->st.inPos] << 8 | in[d->st.inPos+1]);
+        d->st.inPos += 2;
+        return res_dcmp_backref(d, o, ind);
+    } else if (code < 0x4B) {
+        return res_dcmp_backref(d, o, code - 0x23);
+    } else if (code < 0xFE) {
+        return res_dcmp_emit(d, o, d->table[code - 0x4B], 2);
+    } else if (code == 0xFF) {
+        // end of data
+        return 1;
+    }
+    
+    // extended codes
+    if (left < 1) eret(EILSEQ, -1);
+    uint8_t ext = in[d->st.inPos++];
+    int32_t a, b, count;
+    uint8_t word[8];
+    switch (ext) {
+        case 0x00: {
+            // segment loader jump table entries: address, move.w #seg,-(sp), _LoadSeg
+            if (res_dcmp_varint(d, &a) || res_dcmp_varint(d, &count)) return -1;
+            if (count <= 0) eret(EILSEQ, -1);
+            word[2] = 0x3F; word[3] = 0x3C;
+            word[4] = (a >> 8) & 0xFF; word[5] = a & 0xFF;
+            word[6] = 0xA9; word[7] = 0xF0;
+            // the first entry's address comes from previous codes
+            if (res_dcmp_emit(d, o, word+2, 6)) return -1;
+            if (res_dcmp_varint(d, &b)) return -1;
+            uint16_t addr = (uint16_t)b;
+            for(int32_t i=0; i < count; i++) {
+                if (i) {
+                    // deltas are stored 6 higher than they are
+                    if (res_dcmp_varint(d, &b)) return -1;
+                    addr += (uint16_t)(b - 6);
+                }
+                word[0] = addr >> 8; word[1] = addr & 0xFF;
+                if (res_dcmp_emit(d, o, word, 8)) return -1;
+            }
+            return 0;
+        }
+        case 0x02:
+        case 0x03:
+            // repeat a byte or word
+            if (res_dcmp_varint(d, &a) || res_dcmp_varint(d, &count)) return -1;
+            if (count < 0) eret(EILSEQ, -1);
+            word[0] = (a >> 8) & 0xFF;
+            word[1] = a & 0xFF;
+            if (ext == 0x02) return res_dcmp_fill(d, o, word+1, 1, (size_t)count+1);
+            return res_dcmp_fill(d, o, word, 2, (size_t)count+1);
+        case 0x04:
+            // delta-encoded words, with 8-bit deltas
+            if (res_dcmp_varint(d, &a) || res_dcmp_varint(d, &count)) return -1;
+            if (count < 0 || count > d->inLength - d->st.inPos) eret(EILSEQ, -1);
+            for(int32_t i=0; i <= count; i++) {
+                if (i) a += (int8_t)in[d->st.inPos++];
+                word[0] = (a >> 8) & 0xFF;
+                word[1] = a & 0xFF;
+                if (res_dcmp_emit(d, o, word, 2)) return -1;
+            }
+            return 0;
+        case 0x06:
+            // delta-encoded longs, with variable length deltas
+            if (res_dcmp_varint(d, &a) || res_dcmp_varint(d, &count)) return -1;
+            if (count < 0) eret(EILSEQ, -1);
+            uint32_t v = (uint32_t)a;
+            for(int32_t i=0; i <= count; i++) {
+                if (i) {
+                    if (res_dcmp_varint(d, &b)) return -1;
+                    v += (uint32_t)b;
+                }
+                word[0] = v >> 24; word[1] = (v >> 16) & 0xFF;
+                word[2] = (v >> 8) & 0xFF; word[3] = v & 0xFF;
+                if (res_dcmp_emit(d, o, word, 4)) return -1;
+            }
+            return 0;
+    }
+    eret(EILSEQ, -1);
+}
+
+static int res_dcmp1_step (struct RmDcmp *d, struct RmDcmpOut *o) {
+    const uint8_t *in = d->in;
+    size_t left = d->inLength - d->st.inPos;
+    if (left < 1) return 1;
+    uint8_t code = in[d->st.inPos++];
+    left--;
+    
+    if (code < 0x20) {
+        // literal bytes, remembered if bit 4 is set
+        return res_dcmp_literal(d, o, (code & 0x0F) + 1, code & 0x10);
+    } else if (code < 0xD0) {
+        return res_dcmp_backref(d, o, code - 0x20);
+    } else if (code < 0xD2) {
+        // long literal, remembered if bit 0 is set
+        if (left < 1) eret(EILSEQ, -1);
+        size_t count = in[d->st.inPos++];
+        return res_dcmp_literal(d, o, count, code & 0x01);
+    } else if (code == 0xD2) {
+        if (left < 1) eret(EILSEQ, -1);
+        return res_dcmp_backref(d, o, 0xB0 + in[d->st.inPos++]);
+    } else if (code >= 0xD5 && code < 0xFE) {
+        return res_dcmp_emit(d, o, d->table[code - 0xD5], 2);
+    } else if (code == 0xFF) {
+        // end of data
+        return 1;
+    } else if (code == 0xFE) {
+        // extended codes, only byte repeat exists
+        if (left < 1 || in[d->st.inPos++] != 0x02) eret(EILSEQ, -1);
+        int32_t a, count;
+        if (res_dcmp_varint(d, &a) || res_dcmp_varint(d, &count)) return -1;
+        if (count < 0) eret(EILSEQ, -1);
+        uint8_t byte = a & 0xFF;
+        return res_dcmp_fill(d, o, &byte, 1, (size_t)count+1);
+    }
+    eret(EILSEQ, -1);
+}
+
+#if 0
+#pragma mark -
+#pragma mark 'dcmp' 2
+#endif
+
+static int res_dcmp2_step (struct RmDcmp *d, struct RmDcmpOut *o) {
+    const uint8_t *in = d->in;
+    struct RmDcmpState *st = &d->st;
+    size_t left = d->inLength - st->inPos;
+    if (left < 1) return 1;
+    
+    // odd-sized output ends with a single literal byte instead of a tag or index
+    if (left == 1 && st->tagBits == 0 && (d->outLength & 1))
+        return res_dcmp_emit(d, o, &in[st->inPos++], 1);
+    
+    if (!d->tagged) {
+        // every input byte is a table index, expand whole runs in place
+        size_t words = left - (d->outLength & 1);
+        if (st->outPos < o->start) {
+            size_t skip = (o->start - st->outPos) / 2;
+            if (skip > words) skip = words;
+            if (skip) {
+                st->inPos += skip;
+                st->outPos += 2 * skip;
+                return 0;
+            }
+        }
+        size_t room = (o->end - st->outPos) / 2;
+        if (words > room) words = room;
+        if (words > (d->outLength - st->outPos) / 2) eret(EILSEQ, -1);
+        if (words && st->outPos >= o->start) {
+            uint8_t *dst = o->buf + (st->outPos - o->start);
+            const uint8_t *src = in + st->inPos;
+            if (d->tableSize < 0x100) {
+                for(size_t i=0; i < words; i++)
+                    if (src[i] >= d->tableSize) eret(EILSEQ, -1);
+            }
+            for(size_t i=0; i < words; i++) {
+                dst[2*i]   = d->table[src[i]][0];
+                dst[2*i+1] = d->table[src[i]][1];
+            }
+            st->inPos += words;
+            st->outPos += 2 * words;
+            return 0;
+        }
+        // a word straddling the window edge
+        uint8_t ind = in[st->inPos++];
+        if (ind >= d->tableSize) eret(EILSEQ, -1);
+        return res_dcmp_emit(d, o, d->table[ind], 2);
+    }
+    
+    // each tag bit selects a table index (1) or a literal word (0) for the next 8 items
+    if (st->tagBits == 0) {
+        st->tag = in[st->inPos++];
+        st->tagBits = 8;
+        if (--left == 0) return 1;
+    }
+    int isRef = st->tag & 0x80;
+    st->tag <<= 1;
+    st->tagBits--;
+    if (isRef) {
+        uint8_t ind = in[st->inPos++];
+        if (ind >= d->tableSize) eret(EILSEQ, -1);
+        return res_dcmp_emit(d, o, d->table[ind], 2);
+    }
+    // the literal is cut short at the end of the data
+    size_t len = left < 2 ? left : 2;
+    const uint8_t *src = in + st->inPos;
+    st->inPos += len;
+    return res_dcmp_emit(d, o, src, len);
+}
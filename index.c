@@ -0,0 +1,219 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// saved maps
+
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "res.h"
+#include "libres_internal.h"
+
+#define align8(n) (((n) + 7) & ~(size_t)7)
+
+static size_t res_index_pool_size (struct RmType *t);
+static int res_index_pad (FILE *fp, size_t *pos, size_t to);
+
+RFILE* res_open_indexed (const char *path, const char *indexPath, int mode) {
+    RFILE* rp = res_open_path(path, mode);
+    if (rp == NULL) return NULL;
+    uint64_t start = res_nanotime();
+    if (res_index_load(rp, indexPath) == 0) {
+        res_stat_add(rp, loadTime, res_nanotime() - start);
+        if (rp->mode & RES_MODE_PRELOAD) res_preload(rp, NULL, 0, 0);
+        errno = 0;
+        return rp;
+    }
+    
+    // missing or stale, parse the map and save it for next time
+    rp = res_load(rp);
+    if (rp && res_index_save(rp, indexPath)) errno = 0;
+    return rp;
+}
+
+int res_index_save (RFILE *rp, const char *indexPath) {
+    // only files opened by path have a modification time
+    if (rp->fd == -1 && (rp->mode & RES_MODE_MMAP) == 0) eret(ENOTSUP, -1);
+    // nor can forks inside containers be opened with it
+    if (rp->base) eret(ENOTSUP, -1);
+    for(size_t i=0; i < rp->numTypes; i++)
+        if (res_type_load(rp, &rp->types[i]) == NULL) return -1;
+    
+    struct RmIndexHdr hdr;
+    bzero(&hdr, sizeof hdr);
+    hdr.magic = kIndexMagic;
+    hdr.version = kIndexVersion;
+    hdr.refSize = sizeof(struct RmResRef);
+    hdr.fileSize = rp->size;
+    hdr.mtime[0] = rp->mtime[0];
+    hdr.mtime[1] = rp->mtime[1];
+    hdr.dataOffset = rp->dataOffset;
+    hdr.numTypes = (uint32_t)rp->numTypes;
+    hdr.attributes = rp->attributes;
+    
+    // lay out ref lists, ID columns and name pools after the types
+    struct RmIndexType *types = res_file_malloc(rp, rp->numTypes * sizeof(struct RmIndexType) + 1);
+    if (types == NULL) eret(ENOMEM, -1);
+    bzero(types, rp->numTypes * sizeof(struct RmIndexType));
+    size_t end = sizeof hdr + rp->numTypes * sizeof(struct RmIndexType);
+    for(size_t i=0; i < rp->numTypes; i++) {
+        struct RmType *t = &rp->types[i];
+        types[i].type = t->type;
+        types[i].count = (uint32_t)t->count;
+        types[i].list = end = align8(end);
+        end += t->count * sizeof(struct RmResRef);
+        types[i].ids = end;
+        end += t->count * sizeof(int16_t);
+        types[i].names = end;
+        types[i].namesSize = res_index_pool_size(t);
+        end += types[i].namesSize;
+    }
+    
+    // write next to the index and move it in place, readers never see half of one,
+    // and concurrent writers each have their own
+    size_t tmpLength = strlen(indexPath) + sizeof ".XXXXXX";
+    char *tmpPath = res_malloc(tmpLength);
+    if (tmpPath == NULL) {
+        res_free(types);
+        eret(ENOMEM, -1);
+    }
+    snprintf(tmpPath, tmpLength, "%s.XXXXXX", indexPath);
+    int fd = mkstemp(tmpPath);
+    if (fd == -1) {
+        int err = errno;
+        res_free(tmpPath);
+        res_free(types);
+        eret(err, -1);
+    }
+    FILE *fp = fchmod(fd, 0644) == 0 ? fdopen(fd, "wb") : NULL;
+    int err = fp ? 0 : errno;
+    if (fp == NULL) close(fd);
+    size_t pos = 0;
+    if (err == 0 && fwrite(&hdr, sizeof hdr, 1, fp) != 1) err = EIO;
+    if (err == 0 && rp->numTypes && fwrite(types, sizeof(struct RmIndexType), rp->numTypes, fp) != rp->numTypes) err = EIO;
+    pos = sizeof hdr + rp->numTypes * sizeof(struct RmIndexType);
+    for(size_t i=0; err == 0 && i < rp->numTypes; i++) {
+        struct RmType *t = &rp->types[i];
+        if (res_index_pad(fp, &pos, types[i].list) ||
+            fwrite(t->list, sizeof(struct RmResRef), t->count, fp) != t->count ||
+            fwrite(t->ids, sizeof(int16_t), t->count, fp) != t->count ||
+            (types[i].namesSize && fwrite(t->names, types[i].namesSize, 1, fp) != 1))
+            err = EIO;
+        pos = types[i].names + types[i].namesSize;
+    }
+    if (fp && fclose(fp) && err == 0) err = errno;
+    if (err == 0 && rename(tmpPath, indexPath)) err = errno;
+    if (err) unlink(tmpPath);
+    res_free(tmpPath);
+    res_free(types);
+    if (err) eret(err, -1);
+    return 0;
+}
+
+#if 0
+#pragma mark -
+#pragma mark Private Functions
+#endif
+
+int res_index_load (RFILE *rp, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct RmIndexHdr)) {
+        close(fd);
+        eret(EINVAL, -1);
+    }
+    size_t size = (size_t)st.st_size;
+    void *index = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (index == MAP_FAILED) return -1;
+    
+    // check it belongs to this file
+    const struct RmIndexHdr *hdr = index;
+    const struct RmIndexType *types = index + sizeof(struct RmIndexHdr);
+    if (hdr->magic != kIndexMagic || hdr->version != kIndexVersion || hdr->refSize != sizeof(struct RmResRef)) goto invalid;
+    if (hdr->fileSize != rp->size || hdr->mtime[0] != rp->mtime[0] || hdr->mtime[1] != rp->mtime[1]) goto invalid;
+    if (hdr->numTypes > (size - sizeof(struct RmIndexHdr)) / sizeof(struct RmIndexType)) goto invalid;
+    
+    // and that it can't send lookups outside of it, or astray: the searches need sorted
+    // types and ID columns that match the ref lists
+    for(size_t i=0; i < hdr->numTypes; i++) {
+        const struct RmIndexType *it = &types[i];
+        if (i && it->type <= types[i-1].type) goto invalid;
+        if (it->count > 0x10000 || it->list % 4 || it->list > size || it->count * sizeof(struct RmResRef) > size - it->list) goto invalid;
+        if (it->ids % 2 || it->ids > size || it->count * sizeof(int16_t) > size - it->ids) goto invalid;
+        if (it->names > size || it->namesSize > size - it->names) goto invalid;
+        if (it->namesSize && ((const char*)index)[it->names + it->namesSize - 1]) goto invalid;
+        const struct RmResRef *list = index + it->list;
+        const int16_t *ids = index + it->ids;
+        for(size_t j=0; j < it->count; j++) {
+            if (list[j].name != kNoName && list[j].name >= it->namesSize) goto invalid;
+            if (ids[j] != list[j].ID || (j && ids[j] < ids[j-1])) goto invalid;
+        }
+    }
+    
+    rp->numTypes = hdr->numTypes;
+    rp->types = res_arena_alloc(rp, rp->numTypes * sizeof(struct RmType) + 1);
+    rp->typeCodes = res_arena_alloc(rp, rp->numTypes * sizeof(uint32_t) + 1);
+    if (rp->types == NULL || rp->typeCodes == NULL) {
+        munmap(index, size);
+        eret(ENOMEM, -1);
+    }
+    for(size_t i=0; i < rp->numTypes; i++) {
+        struct RmType *t = &rp->types[i];
+        t->type = rp->typeCodes[i] = types[i].type;
+        t->count = types[i].count;
+        t->list = index + types[i].list;
+        t->ids = index + types[i].ids;
+        t->names = types[i].namesSize ? index + types[i].names : NULL;
+        t->loaded = 1;
+    }
+    rp->dataOffset = (size_t)hdr->dataOffset;
+    rp->attributes = hdr->attributes;
+    rp->index = index;
+    rp->indexSize = size;
+    return 0;
+    
+invalid:
+    munmap(index, size);
+    eret(EINVAL, -1);
+}
+
+static size_t res_index_pool_size (struct RmType *t) {
+    // pools are written in order, the last name ends it
+    size_t size = 0;
+    for(size_t j=0; j < t->count; j++) {
+        if (t->list[j].name == kNoName) continue;
+        size_t end = t->list[j].name + strlen(t->names + t->list[j].name) + 1;
+        if (end > size) size = end;
+    }
+    return size;
+}
+
+static int res_index_pad (FILE *fp, size_t *pos, size_t to) {
+    for(; *pos < to; (*pos)++)
+        if (fputc(0, fp) == EOF) return -1;
+    return 0;
+}
@@ -1,46 +1,359 @@
 // libres internal header
 #include <stdio.h>
 #include <stdint.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "res.h"
 
 #define kCompressedResourceTag      0xA89F6572
 #define kCompressedResourceFlg0     0x00120901
 #define kCompressedResourceFlg1     0x00120801
 #define kDCMPInvalidFlags           0xD5DC
+#define kCompressedHeaderSize       18
+#define kDCMP2CustomTable           0x01
+#define kDCMP2Tagged                0x02
+#define kSweepBlockSize             0x10000
+#define kArenaChunkSize             0x4000
+#define kArenaAlign                 sizeof(void*)
+#define kNameIndexMin               16
+#define kNoName                     0xFFFFFFFF
+#define kSearchScanMax              64      // columns up to this length are scanned, not bisected
+#define kCacheBuckets               64
+#define kPoolBuckets                64      // shared handles, by inode
+#define kBatchMaxGap                0x1000  // unwanted bytes worth reading to merge two reads
+#define kBatchMaxIov                64
+#define kAsyncRingSize              64      // io_uring entries
+#define kPreloadMaxGap              0x10000   // unwanted bytes worth reading when preloading
+#define kPreloadMaxSpan             0x100000  // largest single read when preloading
+#define kWriterBufSize              0x10000
+#define kWriterDataOffset           256     // header and system area
+#define kStreamChunkSize            0x10000
+#define kSearchDataChunk            0x100000  // data searched at a time
+#define kSearchDataMaxGap           0x10000   // unwanted bytes worth reading when searching
+#define kDcmpSavedMax               16      // resources keeping decompressor checkpoints
+#define kContainerHeadSize          0x1000  // read to find the fork in a container
+#define kAppleSingleMagic           0x00051600
+#define kAppleDoubleMagic           0x00051607
+#define kAppleEntryResourceFork     2
+#define kMacBinaryHeaderSize        128
+#define kResourceForkXattr          "user.com.apple.ResourceFork" // macOS attributes land in the user namespace
+#define kReadAheadBlockSize         0x10000 // RES_MODE_READAHEAD defaults
+#define kReadAheadBlocks            16
+#define kIndexMagic                 0x6C726978  // 'lrix', in host order
+#define kIndexVersion               1
 
 #define efail(n) {errno = n; return NULL;}
-#define effail(n, m) {errno = n; free(m); return NULL;}
+#define effail(n, m) {errno = n; res_free(m); return NULL;}
 #define eret(n, r) {errno = n; return r;}
 #define egoto(n, l) {errno = n; goto l;}
+#define ecfail(n, rp) {int err = n; res_close(rp); errno = err; return NULL;}
+#define res_stat_add(rp, field, n) __atomic_fetch_add(&(rp)->stats.field, (n), __ATOMIC_RELAXED)
 
 // in-memory structures
 struct RFILE {
-    FILE            *fp;    // file
+    int             fd;     // file, -1 if not used
     void            *buf;   // memory
     void            *fpriv; // functions
     res_seek_func   seek;   // functions
     res_read_func   read;   // functions
+    res_read_at_func readAt; // positional functions
     size_t          size;
+    size_t          base;   // offset of the fork in the file or memory, for containers
+    int64_t         mtime[2];   // seconds, nanoseconds, if opened by path
+    uint64_t        dev;        // if opened by path
+    uint64_t        ino;
+    int             mode;   // RES_MODE_* flags
     size_t          dataOffset;
     uint16_t        attributes;
+    struct RfMap    *map;   // raw map, kept until all ref lists are loaded
+    size_t          mapLength;
     size_t          numTypes;
     struct RmType   *types;
+    uint32_t        *typeCodes; // types[i].type, for searching
+    struct RmChunk  *arena; // types, ref lists and names
+    struct RmCache  *cache; // read resources, NULL if disabled
+    void            *index; // mapped index holding ref lists and names
+    size_t          indexSize;
+    ResStats        stats;
+    res_trace_func  trace;
+    void            *traceCtx;
+    pthread_t       preloader;  // background res_preload
+    int             preloading; // 1 while claimed by res_preload, 2 when the background one is done
+    int             preloadStop;
+    struct RmBlocks *blocks;    // block cache for read functions, NULL if disabled
+    size_t          dcmpInterval;   // output bytes between decompressor checkpoints, 0 if disabled
+    struct RmDcmpSaved *dcmpSaved;  // most recently used first
+    int             pooled;     // shared by res_open, see res_pool
+    unsigned int    poolRefs;   // users, 0 while idle
+    RFILE           *poolNext;  // hash chain
+    RFILE           *idlePrev;  // more recently used idle handle
+    RFILE           *idleNext;  // less recently used idle handle
+    pthread_mutex_t ioLock;     // seek+read functions
+    pthread_mutex_t mapLock;    // lazy loading, name indexes
+    pthread_mutex_t cacheLock;
+    pthread_mutex_t dcmpLock;   // saved checkpoints
+    pthread_mutex_t traceLock;  // trace and traceCtx, changed together
+};
+
+struct RmChunk {
+    struct RmChunk  *next;
+    size_t          size;
+    size_t          used;
+    uint8_t         data[] __attribute__ ((aligned (sizeof(void*))));
 };
 
 struct RmType {
     uint32_t        type;
     size_t          count;
-    struct RmResRef *list;
+    uint16_t        refOffset;  // ref list offset from type list
+    int             loaded;     // list is complete
+    struct RmResRef *list;      // NULL until loaded
+    int16_t         *ids;       // IDs of list, for searching
+    char            *names;     // name pool, NUL-terminated
+    size_t          nameSlots;
+    uint32_t        *nameIndex; // name hash table, built on first named lookup
+    uint8_t         *pinned;    // 1 for refs preloaded into the cache, by index in list, NULL if none
 };
 
 struct RmResRef {
-    int16_t     ID;
-    RFlags      flags;
+    uint32_t    offset; // offset from data section
     uint32_t    size;   // logical size (uncompressed)
     uint32_t    psize;  // physical size
-    uint32_t    offset; // offset from data section
+    uint32_t    name;   // offset in the type's name pool, or kNoName
+    int16_t     ID;
     int16_t     dcmp;   // decompressor ID
-    char*       name;
+    RFlags      flags;
+};
+
+// cached resource, shared by everyone holding a reference
+struct RmCacheEnt {
+    uint32_t            type;
+    int16_t             ID;
+    int                 cached; // reachable from the cache
+    int                 pinned; // preloaded, not in the LRU list
+    unsigned int        refs;
+    size_t              size;
+    struct RmCacheEnt   *hnext; // hash chain
+    struct RmCacheEnt   *prev;  // more recently used
+    struct RmCacheEnt   *next;  // less recently used
+    uint8_t             data[] __attribute__ ((aligned (sizeof(void*))));
+};
+
+struct RmCache {
+    size_t              budget; // bytes
+    size_t              bytes;
+    size_t              entries;
+    size_t              numBuckets;
+    struct RmCacheEnt   **buckets;
+    struct RmCacheEnt   *head;  // most recently used
+    struct RmCacheEnt   *tail;  // least recently used
+    size_t              pinned; // preloaded entries, not counted in bytes or entries
+    size_t              pinnedBytes;
+    uint64_t            hits;
+    uint64_t            misses;
+    uint64_t            evictions;
+};
+
+// decompressor state, can be saved and restored between runs
+struct RmDcmpState {
+    size_t          inPos;
+    size_t          outPos;
+    size_t          numLits;
+    uint8_t         tag;        // 'dcmp' 2 tag byte being consumed
+    uint8_t         tagBits;    // items left under tag
+};
+
+// 'dcmp' 0/1 remembered literal, as a slice of the input
+struct RmDcmpLit {
+    uint32_t        offset;
+    uint32_t        length;
+};
+
+struct RmDcmp {
+    const uint8_t       *in;        // compressed data after the header
+    size_t              inLength;
+    size_t              outLength;  // logical size
+    int16_t             dcmp;       // decompressor ID
+    const uint8_t       (*table)[2];
+    size_t              tableSize;
+    int                 tagged;     // 'dcmp' 2 tagged format
+    RFILE               *rp;        // for counting, may be NULL
+    struct RmDcmpLit    *lits;
+    size_t              litSlots;
+    struct RmDcmpState  st;
+    size_t              interval;   // output bytes between checkpoints, 0 to not take any
+    struct RmDcmpState  *marks;     // checkpoints, by output position
+    size_t              numMarks;
+    size_t              markSlots;
+};
+
+// checkpoints kept after decompressing a resource, with the literals they refer to
+struct RmDcmpSaved {
+    struct RmResRef     *ref;
+    struct RmDcmpSaved  *next;
+    struct RmDcmpLit    *lits;
+    size_t              litSlots;
+    struct RmDcmpState  *marks;
+    size_t              numMarks;
+    size_t              markSlots;
+};
+
+// block read through the read functions
+struct RmBlock {
+    size_t          offset;     // in file, SIZE_MAX if unused
+    size_t          length;     // shorter than a block at the end of the file
+    uint64_t        used;       // clock of the last use
+    uint8_t         *data;
+};
+
+struct RmBlocks {
+    size_t          blockSize;
+    size_t          numBlocks;
+    size_t          maxRun;     // most blocks fetched by one call
+    size_t          ahead;      // blocks to fetch on the next miss
+    size_t          next;       // where the last read ended
+    uint64_t        clock;
+    uint8_t         *data;
+    uint8_t         *stage;     // runs are fetched here, then copied to their blocks
+    struct RmBlock  blocks[];
+};
+
+// resource in file order, for res_refs_measure and res_search_data
+struct RmSweep {
+    uint32_t        type;
+    struct RmResRef *ref;
+};
+
+// resource being read by a stream
+struct RSTREAM {
+    RFILE           *rp;
+    size_t          offset;     // data in file
+    size_t          psize;      // physical size
+    size_t          size;       // logical size
+    size_t          pos;
+    int             compressed;
+    struct RmResRef *ref;
+    void            *in;        // compressed data, if the file isn't in memory
+    struct RmDcmp   d;
+    void            *chunk;     // for res_stream_next
+};
+
+// index file header, followed by the types
+struct RmIndexHdr {
+    uint32_t        magic;
+    uint16_t        version;
+    uint16_t        refSize;    // sizeof(struct RmResRef)
+    uint64_t        fileSize;
+    int64_t         mtime[2];
+    uint64_t        dataOffset;
+    uint32_t        numTypes;
+    uint16_t        attributes;
+    uint16_t        reserved;
+};
+
+// index file type, offsets are from the start of the index
+struct RmIndexType {
+    uint32_t        type;
+    uint32_t        count;
+    uint64_t        list;
+    uint64_t        ids;
+    uint64_t        names;
+    uint64_t        namesSize;
+};
+
+// res_catalog worker, owns the paths in [next, end)
+struct RmCatWorker {
+    pthread_mutex_t     lock;
+    size_t              next;
+    size_t              end;
+    struct RmCatalog    *cat;
+};
+
+struct RmCatalog {
+    const char * const  *paths;
+    int                 mode;
+    res_catalog_func    func;
+    void                *ctx;
+    pthread_mutex_t     outLock;
+    int                 stop;
+    int                 numWorkers;
+    struct RmCatWorker  *workers;
+};
+
+// asynchronous reads, requests are linked through their next field
+struct RmRing;
+struct RQUEUE {
+    pthread_mutex_t lock;
+    pthread_cond_t  work;       // requests for the threads
+    pthread_cond_t  done;       // completions, and the queue going idle
+    ResAsyncReq     *head;      // waiting for a thread
+    ResAsyncReq     *tail;
+    ResAsyncReq     *doneHead;  // waiting for res_queue_poll
+    ResAsyncReq     *doneTail;
+    size_t          pending;    // submitted and not completed
+    int             stop;
+    int             numThreads;
+    pthread_t       *threads;
+    int             notify[2];  // read, write; readable while doneHead is set
+    struct RmRing   *ring;      // io_uring, NULL if unavailable
+};
+
+// background res_preload
+struct RmPreload {
+    RFILE           *rp;
+    size_t          numTypes;
+    uint32_t        types[];
+};
+
+// resource read by res_preload
+struct RmPreloadEnt {
+    size_t          offset; // in file
+    struct RmType   *t;
+    struct RmResRef *ref;
+};
+
+// resource added to a writer, its data comes from one of the sources
+struct RmWriterEnt {
+    uint32_t            type;
+    int16_t             ID;
+    RFlags              flags;
+    uint32_t            name;       // offset in the name pool, or kNoName
+    size_t              size;
+    const void          *data;      // memory
+    int                 owned;      // data is our copy
+    res_read_at_func    read;       // function
+    void                *priv;
+    RFILE               *rp;        // stored data in another file
+    size_t              offset;
+    size_t              dataOffset; // in the data section, set when writing
+};
+
+struct RWRITER {
+    struct RmWriterEnt  *ents;
+    size_t              numEnts;
+    size_t              entSlots;
+    uint8_t             *names;     // name list, pascal strings
+    size_t              namesSize;
+    size_t              nameSlots;
+};
+
+// res_writer_write destination, small pieces are gathered in buf
+struct RmWriterOut {
+    int                 fd;         // -1 for memory
+    uint8_t             *mem;
+    size_t              pos;
+    uint8_t             *buf;
+    size_t              used;
+};
+
+// pending read in res_read_many
+struct RmBatchEnt {
+    size_t          offset; // in file
+    size_t          size;
+    ResReadReq      *req;
+    int             owned;  // buf allocated by us
 };
 
 
@@ -114,13 +427,112 @@ struct __attribute__ ((__packed__)) RfCmpHdr {
 };
 
 // private functions
+RFILE* res_new (int mode);
+RFILE* res_open_path (const char *path, int mode);
+RFILE* res_pool_find (const char *path, int mode);
+RFILE* res_pool_add (RFILE *rp);
+int res_pool_release (RFILE *rp);
+int res_index_load (RFILE *rp, const char *path);
 void* res_bread (RFILE *rp, void *buf, size_t offset, size_t count);
+int res_funcs_read (RFILE *rp, void *buf, size_t offset, size_t count, size_t *calls);
 uint32_t res_szread (RFILE *rp, size_t offset);
 RFILE* res_load (RFILE *rp);
+struct RmType * res_type_load (RFILE *rp, struct RmType *t);
+int res_types_load (RFILE *rp, struct RmType *types, size_t numTypes);
+int res_refs_measure (RFILE *rp, struct RmSweep *sweep, size_t count);
+int res_sweep_compar (const struct RmSweep *, const struct RmSweep *);
 int res_ref_compar (const struct RmResRef *, const struct RmResRef *);
 int res_type_compar (const struct RmType *, const struct RmType *);
 struct RmType * res_type_find (RFILE *rp, uint32_t type);
 struct RmResRef * res_ref_find (RFILE *rp, struct RmType *type, int16_t ID);
 struct RmResRef * res_ref_find_named (RFILE *rp, struct RmType *type, const char *name);
-int res_ref_name_compar (const struct RmResRef * a, const struct RmResRef * b);
+int res_name_index (RFILE *rp, struct RmType *type);
+uint32_t res_name_hash (const char *name);
+ResAttr* res_ref_attr (struct RmType *t, struct RmResRef *ref, ResAttr *buf);
+void* res_read_ref (RFILE *rp, struct RmType *t, struct RmResRef *ref, void *buf, size_t start, size_t size, size_t *read, size_t *remain);
+void* res_malloc (size_t size);
+void* res_file_malloc (RFILE *rp, size_t size);
+uint64_t res_nanotime (void);
+void res_read_done (RFILE *rp, size_t offset, size_t count, size_t calls, uint64_t start);
+void res_free (void *ptr);
+int res_arena_reserve (RFILE *rp, size_t size);
+void* res_arena_alloc (RFILE *rp, size_t size);
+void res_arena_free (RFILE *rp);
+void res_cache_close (RFILE *rp);
+struct RmCache * res_cache_create (RFILE *rp);
+struct RmCacheEnt * res_cache_get (RFILE *rp, uint32_t type, struct RmResRef *ref);
+void res_cache_pin (RFILE *rp, struct RmType *t, struct RmResRef *ref, struct RmCacheEnt *e);
+void res_cache_put (RFILE *rp, struct RmCacheEnt *e);
+void* res_cache_read (RFILE *rp, struct RmType *t, struct RmResRef *ref, void *buf, size_t start, size_t size, size_t *read, size_t *remain);
+void* res_read_dcmp (RFILE *rp, struct RmResRef *ref, void *buf, size_t start, size_t size, size_t *read, size_t *remain);
+int res_dcmp_init (struct RmDcmp *d, const void *data, size_t length);
+int res_dcmp_run (struct RmDcmp *d, void *buf, size_t start, size_t end);
+void res_dcmp_free (struct RmDcmp *d);
+void res_dcmp_restore (RFILE *rp, struct RmResRef *ref, struct RmDcmp *d, size_t start);
+void res_dcmp_save (RFILE *rp, struct RmResRef *ref, struct RmDcmp *d);
+void res_dcmp_forget (RFILE *rp);
+int res_blocks_read (RFILE *rp, void *buf, size_t offset, size_t count, size_t *calls);
+void res_blocks_free (struct RmBlocks *b);
 void* res_read_raw (RFILE *rp, struct RmResRef *ref, void *buf, size_t start, size_t size, size_t *read, size_t *remain);
+
+static inline const char* res_ref_name (struct RmType *t, struct RmResRef *ref) {
+    return ref->name == kNoName ? NULL : t->names + ref->name;
+}
+
+// whether a resource was preloaded into the cache, without locking it
+static inline int res_ref_pinned (struct RmType *t, struct RmResRef *ref) {
+    uint8_t *pinned = __atomic_load_n(&t->pinned, __ATOMIC_ACQUIRE);
+    return pinned && __atomic_load_n(&pinned[ref - t->list], __ATOMIC_RELAXED);
+}
+
+// whether reads of a resource go through the cache, a disabled one keeps only what was preloaded
+static inline int res_cache_wants (RFILE *rp, struct RmType *t, struct RmResRef *ref) {
+    struct RmCache *c = __atomic_load_n(&rp->cache, __ATOMIC_ACQUIRE);
+    if (c == NULL) return 0;
+    size_t budget = __atomic_load_n(&c->budget, __ATOMIC_RELAXED);
+    return (budget && ref->size <= budget) || res_ref_pinned(t, ref);
+}
+
+// sorted column searches, return the index of the first match or n
+static inline size_t res_search16 (const int16_t *a, size_t n, int16_t key) {
+    if (n <= kSearchScanMax) {
+        size_t i = 0;
+#ifdef __SSE2__
+        __m128i k = _mm_set1_epi16(key);
+        for(; i + 8 <= n; i += 8) {
+            int m = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(a+i)), k));
+            if (m) return i + __builtin_ctz(m) / 2;
+        }
+#endif
+        for(; i < n; i++) if (a[i] == key) return i;
+        return n;
+    }
+    
+    // branchless lower bound
+    const int16_t *base = a;
+    for(size_t len = n; len > 1; len -= len / 2)
+        base += (base[len/2 - 1] < key) * (len / 2);
+    base += (*base < key);
+    return (base < a+n && *base == key) ? (size_t)(base - a) : n;
+}
+
+static inline size_t res_search32 (const uint32_t *a, size_t n, uint32_t key) {
+    if (n <= kSearchScanMax) {
+        size_t i = 0;
+#ifdef __SSE2__
+        __m128i k = _mm_set1_epi32((int)key);
+        for(; i + 4 <= n; i += 4) {
+            int m = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(a+i)), k));
+            if (m) return i + __builtin_ctz(m) / 4;
+        }
+#endif
+        for(; i < n; i++) if (a[i] == key) return i;
+        return n;
+    }
+    
+    const uint32_t *base = a;
+    for(size_t len = n; len > 1; len -= len / 2)
+        base += (base[len/2 - 1] < key) * (len / 2);
+    base += (*base < key);
+    return (base < a+n && *base == key) ? (size_t)(base - a) : n;
+}
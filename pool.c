@@ -0,0 +1,193 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// handles shared between res_open calls on the same file
+
+#define _DEFAULT_SOURCE // st_mtim
+#include <errno.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "res.h"
+#include "libres_internal.h"
+
+// open files by device and inode, and the idle ones by last use
+static struct {
+    pthread_mutex_t lock;
+    int             enabled;
+    size_t          maxIdle;
+    size_t          numIdle;
+    RFILE           *buckets[kPoolBuckets];
+    RFILE           *head;  // most recently used idle handle
+    RFILE           *tail;  // least recently used idle handle
+} res_pool_state = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static int res_pool_match (RFILE *rp, uint64_t dev, uint64_t ino, size_t size, const int64_t *mtime, int mode);
+static void res_pool_unlink (RFILE *rp);
+static void res_pool_unidle (RFILE *rp);
+static RFILE* res_pool_trim (size_t maxIdle);
+static void res_pool_close (RFILE *evicted);
+
+int res_pool (int enable, size_t maxIdle) {
+    pthread_mutex_lock(&res_pool_state.lock);
+    __atomic_store_n(&res_pool_state.enabled, enable, __ATOMIC_RELAXED);
+    res_pool_state.maxIdle = enable ? maxIdle : 0;
+    RFILE *evicted = res_pool_trim(res_pool_state.maxIdle);
+    pthread_mutex_unlock(&res_pool_state.lock);
+    res_pool_close(evicted);
+    return 0;
+}
+
+RFILE* res_pool_find (const char *path, int mode) {
+    // errors are left for opening to report
+    if (!__atomic_load_n(&res_pool_state.enabled, __ATOMIC_RELAXED)) return NULL;
+    struct stat st;
+    if (stat(path, &st) == -1) return NULL;
+    int64_t mtime[2] = {(int64_t)st.st_mtime,
+#ifdef __APPLE__
+        (int64_t)st.st_mtimespec.tv_nsec};
+#else
+        (int64_t)st.st_mtim.tv_nsec};
+#endif
+    
+    pthread_mutex_lock(&res_pool_state.lock);
+    RFILE *rp = NULL, *evicted = NULL;
+    if (res_pool_state.enabled) {
+        RFILE **slot = &res_pool_state.buckets[(uint64_t)st.st_ino % kPoolBuckets];
+        while (*slot) {
+            RFILE *p = *slot;
+            if (res_pool_match(p, (uint64_t)st.st_dev, (uint64_t)st.st_ino, (size_t)st.st_size, mtime, mode)) {
+                rp = p;
+                break;
+            }
+            if (p->poolRefs == 0 && p->dev == (uint64_t)st.st_dev && p->ino == (uint64_t)st.st_ino &&
+                (p->size != (size_t)st.st_size || p->mtime[0] != mtime[0] || p->mtime[1] != mtime[1])) {
+                // the file changed since this one was opened
+                res_pool_unidle(p);
+                *slot = p->poolNext;
+                p->pooled = 0;
+                p->idleNext = evicted;
+                evicted = p;
+                continue;
+            }
+            slot = &p->poolNext;
+        }
+    }
+    if (rp && rp->poolRefs++ == 0) res_pool_unidle(rp);
+    pthread_mutex_unlock(&res_pool_state.lock);
+    res_pool_close(evicted);
+    return rp;
+}
+
+RFILE* res_pool_add (RFILE *rp) {
+    pthread_mutex_lock(&res_pool_state.lock);
+    if (!res_pool_state.enabled) {
+        pthread_mutex_unlock(&res_pool_state.lock);
+        return rp;
+    }
+    
+    // another thread may have opened it meanwhile
+    RFILE **bucket = &res_pool_state.buckets[rp->ino % kPoolBuckets];
+    for(RFILE *p = *bucket; p; p = p->poolNext) {
+        if (!res_pool_match(p, rp->dev, rp->ino, rp->size, rp->mtime, rp->mode)) continue;
+        if (p->poolRefs++ == 0) res_pool_unidle(p);
+        pthread_mutex_unlock(&res_pool_state.lock);
+        res_close(rp);
+        return p;
+    }
+    rp->pooled = 1;
+    rp->poolRefs = 1;
+    rp->poolNext = *bucket;
+    *bucket = rp;
+    pthread_mutex_unlock(&res_pool_state.lock);
+    return rp;
+}
+
+int res_pool_release (RFILE *rp) {
+    pthread_mutex_lock(&res_pool_state.lock);
+    if (--rp->poolRefs) {
+        pthread_mutex_unlock(&res_pool_state.lock);
+        return 1;
+    }
+    if (res_pool_state.maxIdle == 0) {
+        res_pool_unlink(rp);
+        pthread_mutex_unlock(&res_pool_state.lock);
+        return 0;
+    }
+    
+    // keep it for later opens
+    rp->idlePrev = NULL;
+    rp->idleNext = res_pool_state.head;
+    if (res_pool_state.head) res_pool_state.head->idlePrev = rp;
+    else res_pool_state.tail = rp;
+    res_pool_state.head = rp;
+    res_pool_state.numIdle++;
+    RFILE *evicted = res_pool_trim(res_pool_state.maxIdle);
+    pthread_mutex_unlock(&res_pool_state.lock);
+    res_pool_close(evicted);
+    return 1;
+}
+
+#if 0
+#pragma mark -
+#pragma mark Private Functions
+#endif
+
+static int res_pool_match (RFILE *rp, uint64_t dev, uint64_t ino, size_t size, const int64_t *mtime, int mode) {
+    return rp->dev == dev && rp->ino == ino && rp->size == size && rp->mode == mode &&
+        rp->mtime[0] == mtime[0] && rp->mtime[1] == mtime[1];
+}
+
+static void res_pool_unlink (RFILE *rp) {
+    // called with the pool locked
+    RFILE **slot = &res_pool_state.buckets[rp->ino % kPoolBuckets];
+    while (*slot != rp) slot = &(*slot)->poolNext;
+    *slot = rp->poolNext;
+    rp->pooled = 0;
+}
+
+static void res_pool_unidle (RFILE *rp) {
+    // called with the pool locked
+    if (rp->idlePrev) rp->idlePrev->idleNext = rp->idleNext;
+    else res_pool_state.head = rp->idleNext;
+    if (rp->idleNext) rp->idleNext->idlePrev = rp->idlePrev;
+    else res_pool_state.tail = rp->idlePrev;
+    rp->idlePrev = rp->idleNext = NULL;
+    res_pool_state.numIdle--;
+}
+
+static RFILE* res_pool_trim (size_t maxIdle) {
+    // called with the pool locked, returns the handles to close chained by idleNext
+    RFILE *evicted = NULL;
+    while (res_pool_state.numIdle > maxIdle) {
+        RFILE *rp = res_pool_state.tail;
+        res_pool_unidle(rp);
+        res_pool_unlink(rp);
+        rp->idleNext = evicted;
+        evicted = rp;
+    }
+    return evicted;
+}
+
+static void res_pool_close (RFILE *evicted) {
+    while (evicted) {
+        RFILE *next = evicted->idleNext;
+        res_close(evicted);
+        evicted = next;
+    }
+}
@@ -0,0 +1,174 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// reading resources ahead of use
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include "res.h"
+#include "libres_internal.h"
+
+static void* res_preload_thread (void *arg);
+static int res_preload_run (RFILE *rp, const uint32_t *types, size_t numTypes);
+static int res_preload_ent (RFILE *rp, struct RmPreloadEnt *ent, const void *data);
+static int res_preload_compar (const struct RmPreloadEnt *a, const struct RmPreloadEnt *b);
+static int res_preload_release (RFILE *rp, int r);
+
+int res_preload (RFILE *rp, const uint32_t *types, size_t numTypes, int background) {
+    if (rp == NULL) eret(EBADF, -1);
+    if (types == NULL && numTypes) eret(EINVAL, -1);
+    
+    // one preload at a time, shared handles can have several callers
+    int state = __atomic_load_n(&rp->preloading, __ATOMIC_ACQUIRE);
+    do {
+        if (state == 1) eret(EBUSY, -1);
+    } while (!__atomic_compare_exchange_n(&rp->preloading, &state, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    if (state == 2) pthread_join(rp->preloader, NULL); // the last one finished
+    
+    // preloaded resources live in the cache, even without a budget
+    if (res_cache_create(rp) == NULL) return res_preload_release(rp, -1);
+    if (!background) return res_preload_release(rp, res_preload_run(rp, types, numTypes));
+    
+    struct RmPreload *p = res_file_malloc(rp, sizeof(struct RmPreload) + numTypes * sizeof(uint32_t));
+    if (p == NULL) {
+        errno = ENOMEM;
+        return res_preload_release(rp, -1);
+    }
+    p->rp = rp;
+    p->numTypes = numTypes;
+    if (numTypes) memcpy(p->types, types, numTypes * sizeof(uint32_t));
+    __atomic_store_n(&rp->preloadStop, 0, __ATOMIC_RELAXED);
+    int err = pthread_create(&rp->preloader, NULL, res_preload_thread, p);
+    if (err) {
+        res_free(p);
+        errno = err;
+        return res_preload_release(rp, -1);
+    }
+    return 0;
+}
+
+#if 0
+#pragma mark -
+#pragma mark Private Functions
+#endif
+
+static void* res_preload_thread (void *arg) {
+    struct RmPreload *p = arg;
+    RFILE *rp = p->rp;
+    res_preload_run(rp, p->types, p->numTypes);
+    res_free(p);
+    __atomic_store_n(&rp->preloading, 2, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static int res_preload_run (RFILE *rp, const uint32_t *types, size_t numTypes) {
+    // find the resources, lazy files have to load every type to see their flags
+    size_t count = 0;
+    for(size_t i=0; i < rp->numTypes; i++) {
+        if (res_type_load(rp, &rp->types[i]) == NULL) return -1;
+        count += rp->types[i].count;
+    }
+    struct RmPreloadEnt *ents = res_file_malloc(rp, count * sizeof(struct RmPreloadEnt) + 1);
+    if (ents == NULL) eret(ENOMEM, -1);
+    size_t numEnts = 0;
+    for(size_t i=0; i < rp->numTypes; i++) {
+        struct RmType *t = &rp->types[i];
+        int all = 0;
+        for(size_t j=0; j < numTypes && !all; j++) all = types[j] == t->type;
+        for(size_t j=0; j < t->count; j++) {
+            struct RmResRef *ref = &t->list[j];
+            if (!all && !ref->flags.fl.preload) continue;
+            // files in memory only need decompressing
+            if (rp->buf && !ref->flags.fl.compressed) continue;
+            size_t offset = ref->offset + rp->dataOffset + 4;
+            if (offset + ref->psize > rp->size) continue;
+            ents[numEnts].offset = offset;
+            ents[numEnts].t = t;
+            ents[numEnts].ref = ref;
+            numEnts++;
+        }
+    }
+    qsort(ents, numEnts, sizeof(struct RmPreloadEnt), (int(*)(const void*, const void*))res_preload_compar);
+    
+    // one pass through the file, neighbouring resources share a read
+    int done = 0;
+    for(size_t i=0, j; i < numEnts; i = j) {
+        if (__atomic_load_n(&rp->preloadStop, __ATOMIC_RELAXED)) break;
+        size_t start = ents[i].offset, end = start + ents[i].ref->psize;
+        for(j = i+1; j < numEnts; j++) {
+            size_t next = ents[j].offset + ents[j].ref->psize;
+            if (ents[j].offset > end + kPreloadMaxGap || next - start > kPreloadMaxSpan) break;
+            if (next > end) end = next;
+        }
+        
+        const uint8_t *data;
+        void *tmp = NULL;
+        if (rp->buf) data = rp->buf + start;
+        else {
+            data = tmp = res_file_malloc(rp, end - start + 1);
+            if (tmp == NULL || res_bread(rp, tmp, start, end - start) == NULL) {
+                // leave them to be read normally
+                res_free(tmp);
+                continue;
+            }
+        }
+        for(size_t k=i; k < j; k++)
+            if (res_preload_ent(rp, &ents[k], data + ents[k].offset - start) == 0) done++;
+        res_free(tmp);
+    }
+    res_free(ents);
+    return done;
+}
+
+static int res_preload_ent (RFILE *rp, struct RmPreloadEnt *ent, const void *data) {
+    struct RmResRef *ref = ent->ref;
+    struct RmCacheEnt *e = res_file_malloc(rp, sizeof(struct RmCacheEnt) + ref->size);
+    if (e == NULL) eret(ENOMEM, -1);
+    bzero(e, sizeof(struct RmCacheEnt));
+    e->type = ent->t->type;
+    e->ID = ref->ID;
+    e->size = ref->size;
+    
+    if (ref->flags.fl.compressed) {
+        struct RmDcmp d;
+        int err = res_dcmp_init(&d, data, ref->psize);
+        d.rp = rp;
+        if (err == 0) err = res_dcmp_run(&d, e->data, 0, ref->size);
+        res_dcmp_free(&d);
+        if (err) {
+            res_free(e);
+            return -1;
+        }
+    } else memcpy(e->data, data, ref->size);
+    res_cache_pin(rp, ent->t, ref, e);
+    return 0;
+}
+
+static int res_preload_release (RFILE *rp, int r) {
+    // let the next res_preload run
+    __atomic_store_n(&rp->preloading, 0, __ATOMIC_RELEASE);
+    return r;
+}
+
+static int res_preload_compar (const struct RmPreloadEnt *a, const struct RmPreloadEnt *b) {
+    if (a->offset == b->offset) return 0;
+    return a->offset < b->offset ? -1 : 1;
+}
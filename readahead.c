@@ -0,0 +1,148 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// block cache in front of read functions
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include "res.h"
+#include "libres_internal.h"
+
+static struct RmBlock * res_blocks_find (struct RmBlocks *b, size_t offset);
+static struct RmBlock * res_blocks_fill (RFILE *rp, struct RmBlocks *b, size_t offset, size_t end, size_t *calls);
+
+int res_readahead (RFILE *rp, size_t blockSize, size_t numBlocks) {
+    if (rp == NULL) eret(EBADF, -1);
+    if (rp->buf || rp->fd != -1) eret(ENOTSUP, -1);
+    if (blockSize && numBlocks < 2) eret(EINVAL, -1);
+    
+    struct RmBlocks *b = NULL;
+    if (blockSize) {
+        if (numBlocks > SIZE_MAX / 2 / blockSize) eret(EINVAL, -1);
+        b = res_file_malloc(rp, sizeof(struct RmBlocks) + numBlocks * sizeof(struct RmBlock));
+        if (b == NULL) eret(ENOMEM, -1);
+        bzero(b, sizeof(struct RmBlocks));
+        b->blockSize = blockSize;
+        b->numBlocks = numBlocks;
+        b->maxRun = numBlocks / 2;
+        b->ahead = 1;
+        // block data, then room for the longest run
+        b->data = res_file_malloc(rp, (numBlocks + b->maxRun) * blockSize);
+        if (b->data == NULL) {
+            res_free(b);
+            eret(ENOMEM, -1);
+        }
+        for(size_t i=0; i < numBlocks; i++) {
+            b->blocks[i].offset = SIZE_MAX;
+            b->blocks[i].length = 0;
+            b->blocks[i].used = 0;
+            b->blocks[i].data = b->data + i * blockSize;
+        }
+        b->stage = b->data + numBlocks * blockSize;
+    }
+    
+    pthread_mutex_lock(&rp->ioLock);
+    struct RmBlocks *old = rp->blocks;
+    __atomic_store_n(&rp->blocks, b, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&rp->ioLock);
+    res_blocks_free(old);
+    return 0;
+}
+
+int res_blocks_read (RFILE *rp, void *buf, size_t offset, size_t count, size_t *calls) {
+    pthread_mutex_lock(&rp->ioLock);
+    struct RmBlocks *b = rp->blocks;
+    if (b == NULL || count > b->maxRun * b->blockSize) {
+        // disabled meanwhile, or too big to gain anything from it
+        int err = res_funcs_read(rp, buf, offset, count, calls);
+        if (b) b->next = offset + count;
+        pthread_mutex_unlock(&rp->ioLock);
+        return err;
+    }
+    
+    // reads picking up where the last one ended double the read-ahead, others reset it
+    if (offset >= b->next && offset - b->next <= b->blockSize) {
+        if (b->ahead < b->maxRun) b->ahead *= 2;
+        if (b->ahead > b->maxRun) b->ahead = b->maxRun;
+    } else b->ahead = 1;
+    b->next = offset + count;
+    
+    size_t end = offset + count;
+    for(size_t pos = offset; pos < end;) {
+        size_t blockOffset = pos - pos % b->blockSize;
+        struct RmBlock *blk = res_blocks_find(b, blockOffset);
+        if (blk == NULL) blk = res_blocks_fill(rp, b, blockOffset, end, calls);
+        if (blk == NULL) {
+            pthread_mutex_unlock(&rp->ioLock);
+            return -1;
+        }
+        blk->used = ++b->clock;
+        size_t n = (end < blockOffset + blk->length ? end : blockOffset + blk->length) - pos;
+        memcpy(buf + (pos - offset), blk->data + (pos - blockOffset), n);
+        pos += n;
+    }
+    pthread_mutex_unlock(&rp->ioLock);
+    return 0;
+}
+
+void res_blocks_free (struct RmBlocks *b) {
+    if (b == NULL) return;
+    res_free(b->data);
+    res_free(b);
+}
+
+#if 0
+#pragma mark -
+#pragma mark Private Functions
+#endif
+
+static struct RmBlock * res_blocks_find (struct RmBlocks *b, size_t offset) {
+    for(size_t i=0; i < b->numBlocks; i++)
+        if (b->blocks[i].offset == offset) return &b->blocks[i];
+    return NULL;
+}
+
+static struct RmBlock * res_blocks_fill (RFILE *rp, struct RmBlocks *b, size_t offset, size_t end, size_t *calls) {
+    // the blocks the read needs, or the read-ahead if it's longer, up to the next cached block
+    size_t run = (end - offset + b->blockSize - 1) / b->blockSize;
+    if (run < b->ahead) run = b->ahead;
+    if (run > b->maxRun) run = b->maxRun;
+    size_t numBlocks = 1;
+    while (numBlocks < run && offset + numBlocks * b->blockSize < rp->size && res_blocks_find(b, offset + numBlocks * b->blockSize) == NULL) numBlocks++;
+    size_t length = numBlocks * b->blockSize;
+    if (length > rp->size - offset) length = rp->size - offset;
+    if (res_funcs_read(rp, b->stage, offset, length, calls)) return NULL;
+    
+    // replace the least recently used blocks
+    struct RmBlock *first = NULL;
+    for(size_t i=0; i < numBlocks; i++) {
+        struct RmBlock *blk = &b->blocks[0];
+        for(size_t j=1; j < b->numBlocks; j++)
+            if (b->blocks[j].used < blk->used) blk = &b->blocks[j];
+        blk->offset = offset + i * b->blockSize;
+        blk->length = length - i * b->blockSize < b->blockSize ? length - i * b->blockSize : b->blockSize;
+        blk->used = ++b->clock;
+        memcpy(blk->data, b->stage + i * b->blockSize, blk->length);
+        if (i == 0) first = blk;
+    }
+    return first;
+}
@@ -18,49 +18,68 @@
  */
 // http://developer.apple.com/documentation/mac/MoreToolbox/MoreToolbox-99.html
 
+#define _DEFAULT_SOURCE // pread
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
-#include <search.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include "res.h"
 #include "libres_internal.h"
 
 const char * libres_id = "libres 1.0.1 (C)2008-2016 namedfork.net";
 
-RFILE* res_open (const char *path, int mode) {
-    if (mode != 0) efail(EINVAL);
-    RFILE* rp = malloc(sizeof(RFILE));
-    if (rp == NULL) efail(ENOMEM);
-    bzero(rp, sizeof(RFILE));
-    
-    // open
-    rp->fp = fopen(path, "r");
-    if (rp->fp == NULL) {
-        free(rp);
-        return NULL;
+static void* res_default_alloc (void *ctx, size_t size) {
+    return malloc(size);
+}
+
+static void res_default_free (void *ctx, void *ptr) {
+    free(ptr);
+}
+
+static res_alloc_func res_alloc_hook = res_default_alloc;
+static res_free_func res_free_hook = res_default_free;
+static void *res_alloc_ctx = NULL;
+
+void res_set_allocator (void *ctx, res_alloc_func allocf, res_free_func freef) {
+    if (allocf == NULL || freef == NULL) {
+        allocf = res_default_alloc;
+        freef = res_default_free;
     }
-    
-    // get size
-    errno = 0;
-    fseek(rp->fp, 0, SEEK_END);
-    rp->size = ftell(rp->fp);
-    if (errno) effail(errno, rp);
-    
-    rp->buf = NULL;
-    return res_load(rp);
+    res_alloc_ctx = ctx;
+    res_alloc_hook = allocf;
+    res_free_hook = freef;
+}
+
+RFILE* res_open (const char *path, int mode) {
+    RFILE* rp = res_pool_find(path, mode);
+    if (rp) return rp;
+    rp = res_open_path(path, mode);
+    if (rp == NULL) return NULL;
+    rp = res_load(rp);
+    if (rp == NULL) return NULL;
+    return res_pool_add(rp);
 }
 
 RFILE* res_open_mem (void *buf, size_t size, int copy) {
+    return res_open_mem_mode(buf, size, copy, 0);
+}
+
+RFILE* res_open_mem_mode (void *buf, size_t size, int copy, int mode) {
     if (buf == NULL) return NULL;
-    RFILE* rp = malloc(sizeof(RFILE));
-    if (rp == NULL) efail(ENOMEM);
-    bzero(rp, sizeof(RFILE));
+    if (mode & ~(RES_MODE_LAZY|RES_MODE_PRELOAD)) efail(EINVAL);
+    RFILE* rp = res_new(mode);
+    if (rp == NULL) return NULL;
     rp->size = size;
     if (copy) {
         rp->buf = malloc(size);
-        if (rp == NULL) effail(ENOMEM, rp);
+        if (rp->buf == NULL) ecfail(ENOMEM, rp);
         memcpy(rp->buf, buf, size);
     } else rp->buf = buf;
     
@@ -68,36 +87,59 @@ RFILE* res_open_mem (void *buf, size_t size, int copy) {
 }
 
 RFILE* res_open_funcs (void *priv, res_seek_func seekf, res_read_func readf) {
-    RFILE* rp = malloc(sizeof(RFILE));
-    if (rp == NULL) efail(ENOMEM);
-    bzero(rp, sizeof(RFILE));
+    return res_open_funcs_mode(priv, seekf, readf, 0);
+}
+
+RFILE* res_open_funcs_mode (void *priv, res_seek_func seekf, res_read_func readf, int mode) {
+    if (mode & ~(RES_MODE_LAZY|RES_MODE_PRELOAD|RES_MODE_READAHEAD)) efail(EINVAL);
+    RFILE* rp = res_new(mode);
+    if (rp == NULL) return NULL;
     rp->seek = seekf;
     rp->read = readf;
     rp->fpriv = priv;
     rp->size = rp->seek(priv, 0, SEEK_END);
+    res_stat_add(rp, seeks, 1);
+    if ((mode & RES_MODE_READAHEAD) && res_readahead(rp, kReadAheadBlockSize, kReadAheadBlocks)) ecfail(errno, rp);
+    return res_load(rp);
+}
+
+RFILE* res_open_funcs_at (void *priv, size_t size, res_read_at_func readf, int mode) {
+    if (mode & ~(RES_MODE_LAZY|RES_MODE_PRELOAD|RES_MODE_READAHEAD)) efail(EINVAL);
+    RFILE* rp = res_new(mode);
+    if (rp == NULL) return NULL;
+    rp->readAt = readf;
+    rp->fpriv = priv;
+    rp->size = size;
+    if ((mode & RES_MODE_READAHEAD) && res_readahead(rp, kReadAheadBlockSize, kReadAheadBlocks)) ecfail(errno, rp);
     return res_load(rp);
 }
 
 int res_close (RFILE* rp) {
     if (rp == NULL) eret(EBADF, EOF);
-    if (rp->buf) free(rp->buf);
-    if (rp->fp) fclose(rp->fp);
-    
-    // free list
-    if (rp->types) {
-        for(int i=0; i < rp->numTypes; i++) {
-            struct RmType *t = &rp->types[i];
-            if (t->list == NULL) continue;
-            for(int j=0; j < t->count; j++) {
-                struct RmResRef *r = &t->list[j];
-                if (r->name) free(r->name);
-            }
-            free(t->list);
-        }
-        free(rp->types);
+    if (rp->pooled && res_pool_release(rp)) return 0;
+    if (__atomic_load_n(&rp->preloading, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&rp->preloadStop, 1, __ATOMIC_RELAXED);
+        pthread_join(rp->preloader, NULL);
     }
+    if (rp->buf && (rp->mode & RES_MODE_MMAP)) munmap(rp->buf - rp->base, rp->base + rp->size);
+    else if (rp->buf) free(rp->buf - rp->base);
+    if (rp->fd != -1) close(rp->fd);
+    if (rp->index) munmap(rp->index, rp->indexSize);
+    
+    res_cache_close(rp);
+    res_dcmp_forget(rp);
+    res_blocks_free(rp->blocks);
+    
+    // names, ref lists and types all live in the arena
+    res_arena_free(rp);
+    if (rp->map) res_free(rp->map);
     
-    free(rp);
+    pthread_mutex_destroy(&rp->ioLock);
+    pthread_mutex_destroy(&rp->mapLock);
+    pthread_mutex_destroy(&rp->cacheLock);
+    pthread_mutex_destroy(&rp->dcmpLock);
+    pthread_mutex_destroy(&rp->traceLock);
+    res_free(rp);
     return 0;
 }
 
@@ -113,16 +155,14 @@ uint32_t* res_types (RFILE *rp, uint32_t *buf, size_t start, size_t size, size_t
     if (read) *read = size;
     if (remain) *remain = rp->numTypes - (size + start);
     
-    for(size_t i=0; i < size; i++)
-        buf[i] = rp->types[start+i].type;
-    
+    memcpy(buf, rp->typeCodes + start, size * sizeof(uint32_t));
     return buf;
 }
 
 size_t res_count (RFILE *rp, uint32_t type) {
-    struct RmType *t = res_type_find(rp, type);
-    if (t == NULL) return 0;
-    return t->count;
+    size_t i = res_search32(rp->typeCodes, rp->numTypes, type);
+    if (i == rp->numTypes) return 0;
+    return rp->types[i].count;
 }
 
 ResAttr* res_list (RFILE *rp, uint32_t type, ResAttr *buf, size_t start, size_t size, size_t *read, size_t *remain) {
@@ -139,7 +179,7 @@ ResAttr* res_list (RFILE *rp, uint32_t type, ResAttr *buf, size_t start, size_t
         buf[i].ID    = t->list[start+i].ID;
         buf[i].flags = t->list[start+i].flags;
         buf[i].size  = t->list[start+i].size;
-        buf[i].name  = t->list[start+i].name;
+        buf[i].name  = res_ref_name(t, &t->list[start+i]);
     }
     
     return buf;
@@ -148,57 +188,147 @@ ResAttr* res_list (RFILE *rp, uint32_t type, ResAttr *buf, size_t start, size_t
 ResAttr* res_attr (RFILE *rp, uint32_t type, int16_t ID, ResAttr *buf) {
     struct RmType *t = res_type_find(rp, type);
     if (t == NULL) efail(ENOENT);
-    struct RmResRef *ref = res_ref_find(rp, t, ID);
-    if (ref == NULL) efail(ENOENT);
-    if (buf == NULL) buf = malloc(sizeof(ResAttr));
-    if (buf == NULL) efail(ENOMEM);
-    
-    buf->ID    = ref->ID;
-    buf->flags = ref->flags;
-    buf->size  = ref->size;
-    buf->name  = ref->name;
-    
-    return buf;
+    return res_ref_attr(t, res_ref_find(rp, t, ID), buf);
 }
 
 ResAttr* res_attr_named (RFILE *rp, uint32_t type, const char *name, ResAttr *buf) {
-    struct RmResRef *ref = res_ref_find_named(rp, res_type_find(rp, type), name);
-    if (ref == NULL) efail(ENOENT);
-    return res_attr(rp, type, ref->ID, buf);
+    struct RmType *t = res_type_find(rp, type);
+    if (t == NULL) efail(ENOENT);
+    return res_ref_attr(t, res_ref_find_named(rp, t, name), buf);
+}
+
+int res_next (RFILE *rp, ResIter *it, uint32_t *type, ResAttr *attr) {
+    if (it == NULL || attr == NULL) eret(EINVAL, -1);
+    while (it->type < rp->numTypes) {
+        struct RmType *t = res_type_load(rp, &rp->types[it->type]);
+        if (t == NULL) return -1;
+        if (it->index < t->count) {
+            if (type) *type = t->type;
+            res_ref_attr(t, &t->list[it->index++], attr);
+            return 1;
+        }
+        it->type++;
+        it->index = 0;
+    }
+    return 0;
+}
+
+int res_visit (RFILE *rp, int flags, res_visit_func func, void *ctx) {
+    static const uint8_t empty[1]; // data of empty resources
+    if (func == NULL || (flags & ~RES_VISIT_DATA)) eret(EINVAL, -1);
+    void *scratch = NULL;
+    size_t scratchSize = 0;
+    int r = 0;
+    for(size_t i=0; i < rp->numTypes && r == 0; i++) {
+        struct RmType *t = res_type_load(rp, &rp->types[i]);
+        if (t == NULL) {
+            r = -1;
+            break;
+        }
+        for(size_t j=0; j < t->count && r == 0; j++) {
+            struct RmResRef *ref = &t->list[j];
+            ResAttr attr;
+            res_ref_attr(t, ref, &attr);
+            const void *data = NULL;
+            size_t rstart = ref->offset + rp->dataOffset + 4;
+            if (flags & RES_VISIT_DATA) {
+                if (rstart + ref->psize > rp->size) errno = EFAULT;
+                else if (rp->buf && !ref->flags.fl.compressed) data = rp->buf + rstart;
+                else if (ref->size == 0) data = empty;
+                else {
+                    // read everything else into one buffer, grown as needed
+                    if (ref->size > scratchSize) {
+                        size_t grow = scratchSize * 2 > ref->size ? scratchSize * 2 : ref->size;
+                        if (scratch) res_free(scratch);
+                        scratch = res_file_malloc(rp, grow);
+                        scratchSize = scratch ? grow : 0;
+                    }
+                    if (scratch == NULL) errno = ENOMEM;
+                    else data = res_read_ref(rp, t, ref, scratch, 0, ref->size, NULL, NULL);
+                }
+            }
+            r = func(ctx, t->type, &attr, data, data ? attr.size : 0);
+        }
+    }
+    int saved = errno;
+    if (scratch) res_free(scratch);
+    errno = saved;
+    return r;
 }
 
 void* res_read (RFILE *rp, uint32_t type, int16_t ID, void *buf, size_t start, size_t size, size_t *read, size_t *remain) {
     struct RmType *t = res_type_find(rp, type);
     if (t == NULL) efail(ENOENT);
-    struct RmResRef *ref = res_ref_find(rp, t, ID);
-    if (ref == NULL) efail(ENOENT);
-    
-    if (ref->flags.fl.compressed) efail(ENOSYS);
-    return res_read_raw(rp, ref, buf, start, size, read, remain);
+    return res_read_ref(rp, t, res_ref_find(rp, t, ID), buf, start, size, read, remain);
 }
 
 void* res_read_named (RFILE *rp, uint32_t type, const char *name, void *buf, size_t start, size_t size, size_t *read, size_t *remain) {
-    struct RmResRef *ref = res_ref_find_named(rp, res_type_find(rp, type), name);
-    if (ref == NULL) efail(ENOENT);
-    return res_read(rp, type, ref->ID, buf, start, size, read, remain);
+    struct RmType *t = res_type_find(rp, type);
+    return res_read_ref(rp, t, res_ref_find_named(rp, t, name), buf, start, size, read, remain);
 }
 
 void* res_read_ind (RFILE *rp, uint32_t type, int16_t ind, void *buf, size_t start, size_t size, size_t *read, size_t *remain) {
     struct RmType *t = res_type_find(rp, type);
     if (t == NULL) efail(ENOENT);
     if (ind >= t->count || ind < 0) efail(ENOENT);
-    struct RmResRef *ref = &t->list[ind];
+    res_stat_add(rp, lookupsByIndex, 1);
+    return res_read_ref(rp, t, &t->list[ind], buf, start, size, read, remain);
+}
+
+const void* res_read_ptr (RFILE *rp, uint32_t type, int16_t ID, size_t *size) {
+    struct RmType *t = res_type_find(rp, type);
+    if (t == NULL) efail(ENOENT);
+    struct RmResRef *ref = res_ref_find(rp, t, ID);
     if (ref == NULL) efail(ENOENT);
     
+    // only memory-backed files can lend out their data
+    if (rp->buf == NULL) efail(ENOTSUP);
     if (ref->flags.fl.compressed) efail(ENOSYS);
-    return res_read_raw(rp, ref, buf, start, size, read, remain);
+    size_t rstart = ref->offset + rp->dataOffset + 4;
+    if (rstart+ref->psize > rp->size) efail(EFAULT);
+    if (size) *size = ref->psize;
+    return rp->buf + rstart;
+}
+
+int res_locate (RFILE *rp, uint32_t type, int16_t ID, size_t *offset, size_t *size) {
+    struct RmType *t = res_type_find(rp, type);
+    if (t == NULL) eret(ENOENT, -1);
+    struct RmResRef *ref = res_ref_find(rp, t, ID);
+    if (ref == NULL) eret(ENOENT, -1);
+    size_t rstart = ref->offset + rp->dataOffset + 4;
+    if (rstart+ref->psize > rp->size) eret(EFAULT, -1);
+    if (offset) *offset = rp->base + rstart;
+    if (size) *size = ref->psize;
+    return 0;
+}
+
+ResStats* res_stats (RFILE *rp, ResStats *buf) {
+    if (rp == NULL) efail(EBADF);
+    if (buf == NULL) buf = malloc(sizeof(ResStats));
+    if (buf == NULL) efail(ENOMEM);
+    
+    // counters are updated without locking, copy them one at a time
+    const uint64_t *src = (const uint64_t*)&rp->stats;
+    uint64_t *dst = (uint64_t*)buf;
+    for(size_t i=0; i < sizeof(ResStats) / sizeof(uint64_t); i++)
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    return buf;
+}
+
+void res_set_trace (RFILE *rp, res_trace_func func, void *ctx) {
+    if (rp == NULL) return;
+    pthread_mutex_lock(&rp->traceLock);
+    rp->traceCtx = ctx;
+    __atomic_store_n(&rp->trace, func, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&rp->traceLock);
 }
 
 void res_printdir (RFILE *rp) {
     for(int i=0; i < rp->numTypes; i++) {
-        struct RmType *t = &rp->types[i];
+        struct RmType *t = res_type_load(rp, &rp->types[i]);
+        if (t == NULL) continue;
         for(int j=0; j < t->count; j++)
-        printf("%c%c%c%c %hd (%ub) %s\n", TYPECHARS(t->type), t->list[j].ID, t->list[j].size, t->list[j].name?t->list[j].name:"");
+        printf("%c%c%c%c %hd (%ub) %s\n", TYPECHARS(t->type), t->list[j].ID, t->list[j].size, t->list[j].name != kNoName ? t->names + t->list[j].name : "");
     }
 }
 
@@ -227,24 +357,146 @@ void res_printattr (const ResAttr *attr, uint32_t type) {
 #pragma mark Private Functions
 #endif
 
+RFILE* res_open_path (const char *path, int mode) {
+    // open the file, without reading the map
+    if (mode & ~(RES_MODE_MMAP|RES_MODE_LAZY|RES_MODE_PRELOAD)) efail(EINVAL);
+    RFILE* rp = res_new(mode);
+    if (rp == NULL) return NULL;
+    
+    // open
+    rp->fd = open(path, O_RDONLY);
+    if (rp->fd == -1) ecfail(errno, rp);
+    
+    // get size
+    struct stat st;
+    if (fstat(rp->fd, &st) == -1) ecfail(errno, rp);
+    rp->size = (size_t)st.st_size;
+    rp->dev = (uint64_t)st.st_dev;
+    rp->ino = (uint64_t)st.st_ino;
+    rp->mtime[0] = (int64_t)st.st_mtime;
+#ifdef __APPLE__
+    rp->mtime[1] = (int64_t)st.st_mtimespec.tv_nsec;
+#else
+    rp->mtime[1] = (int64_t)st.st_mtim.tv_nsec;
+#endif
+    
+    if (mode & RES_MODE_MMAP) {
+        // the mapping outlives the descriptor
+        if (rp->size == 0) ecfail(EINVAL, rp);
+        rp->buf = mmap(NULL, rp->size, PROT_READ, MAP_PRIVATE, rp->fd, 0);
+        if (rp->buf == MAP_FAILED) {
+            rp->buf = NULL;
+            ecfail(errno, rp);
+        }
+        close(rp->fd);
+        rp->fd = -1;
+    }
+    return rp;
+}
+
+RFILE* res_new (int mode) {
+    RFILE* rp = res_malloc(sizeof(RFILE));
+    if (rp == NULL) efail(ENOMEM);
+    bzero(rp, sizeof(RFILE));
+    rp->stats.allocs = 1;
+    rp->stats.allocBytes = sizeof(RFILE);
+    rp->mode = mode;
+    rp->fd = -1;
+    pthread_mutex_init(&rp->ioLock, NULL);
+    pthread_mutex_init(&rp->mapLock, NULL);
+    pthread_mutex_init(&rp->cacheLock, NULL);
+    pthread_mutex_init(&rp->dcmpLock, NULL);
+    pthread_mutex_init(&rp->traceLock, NULL);
+    return rp;
+}
+
 void* res_bread (RFILE *rp, void *buf, size_t offset, size_t count) {
     if (offset+count > rp->size) efail(EFAULT);
-    if (buf == NULL) buf = malloc(count);
+    void *mem = NULL;
+    if (buf == NULL) buf = mem = malloc(count);
     if (buf == NULL) efail(ENOMEM);
     
-    if (rp->buf)
+    // only time reads someone is watching
+    uint64_t start = __atomic_load_n(&rp->trace, __ATOMIC_RELAXED) ? res_nanotime() : 0;
+    size_t calls = 1;
+    if (rp->buf) {
         // memory
         memcpy(buf, rp->buf+offset, count);
-    else if (rp->fp) {
-        // file pointer
-        fseek(rp->fp, offset, SEEK_SET);
-        fread(buf, 1, count, rp->fp);
+        calls = 0;
+    } else if (rp->fd != -1) {
+        // file descriptor, positional reads don't share a file offset
+        calls = 0;
+        for(size_t done = 0; done < count;) {
+            ssize_t r = pread(rp->fd, buf+done, count-done, (off_t)(rp->base+offset+done));
+            calls++;
+            if (r == -1 && errno == EINTR) continue;
+            if (r <= 0) egoto(r ? errno : EFAULT, error);
+            done += r;
+        }
+    } else if (__atomic_load_n(&rp->blocks, __ATOMIC_RELAXED)) {
+        // functions, through the block cache
+        calls = 0;
+        if (res_blocks_read(rp, buf, offset, count, &calls)) goto error;
+    } else if (rp->readAt) {
+        // positional functions
+        calls = 0;
+        if (res_funcs_read(rp, buf, offset, count, &calls)) goto error;
     } else {
-        // functions
-        rp->seek(rp->fpriv, (long)offset, (int)SEEK_SET);
-        rp->read(rp->fpriv, buf, (unsigned long)count);
+        // functions, seek and read must not be interleaved
+        calls = 0;
+        pthread_mutex_lock(&rp->ioLock);
+        int err = res_funcs_read(rp, buf, offset, count, &calls);
+        pthread_mutex_unlock(&rp->ioLock);
+        if (err) goto error;
     }
+    res_read_done(rp, offset, count, calls, start);
     return buf;
+    
+error:
+    res_stat_add(rp, calls, calls);
+    if (mem) {
+        int err = errno;
+        free(mem);
+        errno = err;
+    }
+    return NULL;
+}
+
+int res_funcs_read (RFILE *rp, void *buf, size_t offset, size_t count, size_t *calls) {
+    // seek and read functions need ioLock held, short reads are continued
+    if (rp->readAt == NULL) {
+        rp->seek(rp->fpriv, (long)offset, (int)SEEK_SET);
+        res_stat_add(rp, seeks, 1);
+    }
+    for(size_t done = 0; done < count;) {
+        unsigned long r;
+        if (rp->readAt) r = rp->readAt(rp->fpriv, buf+done, (unsigned long)(count-done), (unsigned long)(offset+done));
+        else r = rp->read(rp->fpriv, buf+done, (unsigned long)(count-done));
+        (*calls)++;
+        if (r == 0 || r > count-done) eret(EIO, -1);
+        done += r;
+    }
+    return 0;
+}
+
+void res_read_done (RFILE *rp, size_t offset, size_t count, size_t calls, uint64_t start) {
+    res_stat_add(rp, reads, 1);
+    res_stat_add(rp, bytesRead, count);
+    res_stat_add(rp, calls, calls);
+    if (start == 0 || __atomic_load_n(&rp->trace, __ATOMIC_RELAXED) == NULL) return;
+    
+    // the hook and its context as a pair, another user of the handle may be changing them
+    pthread_mutex_lock(&rp->traceLock);
+    res_trace_func trace = rp->trace;
+    void *ctx = rp->traceCtx;
+    pthread_mutex_unlock(&rp->traceLock);
+    if (trace) trace(ctx, rp, offset, count, res_nanotime() - start);
+}
+
+uint64_t res_nanotime (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
 }
 
 uint32_t res_szread (RFILE *rp, size_t offset) {
@@ -256,33 +508,114 @@ uint32_t res_szread (RFILE *rp, size_t offset) {
 void* res_read_raw (RFILE *rp, struct RmResRef *ref, void *buf, size_t start, size_t size, size_t *read, size_t *remain) {
     if (ref == NULL) efail(ENOENT);
     if (buf != NULL && size == 0) efail(EINVAL);
+    if (start > ref->psize) efail(EINVAL);
     if (size == 0 || start + size > ref->psize) size = ref->psize - start;
     size_t rstart = start + ref->offset + rp->dataOffset + 4;
     if (rstart+size > rp->size) efail(EFAULT);
-    if (buf == NULL) buf = malloc(ref->psize);
+    void *mem = NULL;
+    if (buf == NULL) buf = mem = malloc(size ? size : 1);
     if (buf == NULL) efail(ENOMEM);
+    if (res_bread(rp, buf, rstart, size) == NULL) {
+        int err = errno;
+        free(mem);
+        efail(err);
+    }
     if (read) *read = size;
     if (remain) *remain = ref->psize - (size + start);
+    return buf;
+}
+
+void* res_read_ref (RFILE *rp, struct RmType *t, struct RmResRef *ref, void *buf, size_t start, size_t size, size_t *read, size_t *remain) {
+    if (ref == NULL) efail(ENOENT);
+    if (res_cache_wants(rp, t, ref)) return res_cache_read(rp, t, ref, buf, start, size, read, remain);
+    if (ref->flags.fl.compressed) return res_read_dcmp(rp, ref, buf, start, size, read, remain);
+    return res_read_raw(rp, ref, buf, start, size, read, remain);
+}
+
+void* res_read_dcmp (RFILE *rp, struct RmResRef *ref, void *buf, size_t start, size_t size, size_t *read, size_t *remain) {
+    if (buf != NULL && size == 0) efail(EINVAL);
+    if (start > ref->size) efail(EINVAL);
+    if (size == 0 || start + size > ref->size) size = ref->size - start;
+    size_t rstart = ref->offset + rp->dataOffset + 4;
+    if (rstart+ref->psize > rp->size) efail(EFAULT);
+    
+    // decompress straight from memory when possible
+    const void *data;
+    void *tmp = NULL;
+    if (rp->buf) data = rp->buf + rstart;
+    else {
+        data = tmp = res_file_malloc(rp, ref->psize);
+        if (tmp == NULL) efail(ENOMEM);
+        if (res_bread(rp, tmp, rstart, ref->psize) == NULL) effail(errno, tmp);
+    }
+    
+    struct RmDcmp d;
+    void *out = buf;
+    int err = res_dcmp_init(&d, data, ref->psize);
+    d.rp = rp;
+    if (err == 0 && out == NULL) {
+        out = malloc(size ? size : 1);
+        if (out == NULL) {
+            errno = ENOMEM;
+            err = -1;
+        }
+    }
+    if (err == 0) {
+        res_dcmp_restore(rp, ref, &d, start);
+        err = res_dcmp_run(&d, out, start, start + size);
+        if (err == 0) res_dcmp_save(rp, ref, &d);
+    }
+    
+    int saved = errno;
+    res_dcmp_free(&d);
+    res_free(tmp);
+    if (err) {
+        if (out != buf) free(out);
+        efail(saved);
+    }
+    if (read) *read = size;
+    if (remain) *remain = ref->size - (size + start);
+    return out;
+}
+
+ResAttr* res_ref_attr (struct RmType *t, struct RmResRef *ref, ResAttr *buf) {
+    if (ref == NULL) efail(ENOENT);
+    if (buf == NULL) buf = malloc(sizeof(ResAttr));
+    if (buf == NULL) efail(ENOMEM);
+    
+    buf->ID    = ref->ID;
+    buf->flags = ref->flags;
+    buf->size  = ref->size;
+    buf->name  = res_ref_name(t, ref);
     
-    return res_bread(rp, buf, rstart, size);
+    return buf;
 }
 
 RFILE* res_load (RFILE *rp) {
+    uint64_t start = res_nanotime();
+    
     // read header
     struct RfHdr hdr;
-    res_bread(rp, &hdr, 0, sizeof(struct RfHdr));
+    if (rp->size < sizeof hdr || res_bread(rp, &hdr, 0, sizeof hdr) == NULL) egoto(EINVAL, error);
     rp->dataOffset = ntohl(hdr.dataOffset);
     
-    // read map
-    struct RfMap *map = res_bread(rp, NULL, (size_t)ntohl(hdr.mapOffset), (size_t)ntohl(hdr.mapLength));
-    if (map == NULL) egoto(EINVAL, error);
+    // read map, anything it points to has to be inside of it
+    size_t mapOffset = ntohl(hdr.mapOffset);
+    rp->mapLength = ntohl(hdr.mapLength);
+    if (mapOffset > rp->size || rp->mapLength > rp->size - mapOffset || rp->mapLength < sizeof(struct RfMap) + 2) egoto(EINVAL, error);
+    struct RfMap *map = res_file_malloc(rp, rp->mapLength);
+    if (map == NULL) egoto(ENOMEM, error);
+    rp->map = map;
+    if (res_bread(rp, map, mapOffset, rp->mapLength) == NULL) egoto(EINVAL, error);
     rp->attributes = ntohs(map->attributes);
-    struct RfTypeList *types = ((void*)map)+ntohs(map->typeListOffset);
-    uint8_t *names = ((void*)map)+ntohs(map->nameListOffset);
+    size_t typeListOffset = ntohs(map->typeListOffset);
+    if (typeListOffset + 2 > rp->mapLength) egoto(EINVAL, error);
+    struct RfTypeList *types = ((void*)map)+typeListOffset;
     
     // read types
     rp->numTypes = 1+(int16_t)ntohs(types->count);
-    rp->types = calloc(rp->numTypes, sizeof(struct RmType));
+    if (typeListOffset + 2 + rp->numTypes * sizeof(struct RfTypeEntry) > rp->mapLength) egoto(EINVAL, error);
+    rp->types = res_arena_alloc(rp, rp->numTypes * sizeof(struct RmType));
     if (rp->types == NULL) egoto(ENOMEM, error);
     bzero(rp->types, sizeof(struct RmType) * rp->numTypes);
     
@@ -290,72 +623,220 @@ RFILE* res_load (RFILE *rp) {
         struct RmType *t = &rp->types[i];
         t->type = ntohl(types->entry[i].type);
         t->count = 1+(size_t)ntohs(types->entry[i].count);
-        t->list = calloc(t->count, sizeof(struct RmResRef));
-        if (t->list == NULL) egoto(ENOMEM, error);
-        bzero(t->list, t->count * sizeof(struct RmResRef));
+        t->refOffset = ntohs(types->entry[i].offset);
+    }
+    
+    // keep type list sorted
+    // types are sorted alphabetically in files, we need them sorted numerically
+    qsort(rp->types, rp->numTypes, sizeof(struct RmType), (int(*)(const void*, const void*))res_type_compar);
+    rp->typeCodes = res_arena_alloc(rp, rp->numTypes * sizeof(uint32_t));
+    if (rp->typeCodes == NULL) egoto(ENOMEM, error);
+    for(int i=0; i < rp->numTypes; i++) rp->typeCodes[i] = rp->types[i].type;
+    
+    // lazy files parse ref lists on first use, and need the map until then
+    if ((rp->mode & RES_MODE_LAZY) == 0) {
+        if (res_types_load(rp, rp->types, rp->numTypes)) goto error;
+        rp->map = NULL;
+        res_free(map);
+    }
+    
+    res_stat_add(rp, loadTime, res_nanotime() - start);
+    
+    // failing to preload only makes reads slower
+    if (rp->mode & RES_MODE_PRELOAD) res_preload(rp, NULL, 0, 0);
+    errno = 0;
+    return rp;
+error:
+    res_close(rp);
+    return NULL;
+}
+
+struct RmType * res_type_load (RFILE *rp, struct RmType *t) {
+    if (__atomic_load_n(&t->loaded, __ATOMIC_ACQUIRE)) return t;
+    
+    // lazy files load types on demand, one thread at a time
+    pthread_mutex_lock(&rp->mapLock);
+    int err = 0;
+    uint64_t start = res_nanotime();
+    if (!t->loaded) err = res_types_load(rp, t, 1);
+    res_stat_add(rp, loadTime, res_nanotime() - start);
+    pthread_mutex_unlock(&rp->mapLock);
+    return err ? NULL : t;
+}
+
+int res_types_load (RFILE *rp, struct RmType *types, size_t numTypes) {
+    struct RfMap *map = rp->map;
+    struct RfTypeList *typeList = ((void*)map)+ntohs(map->typeListOffset);
+    uint8_t *names = ((void*)map)+ntohs(map->nameListOffset);
+    struct RmSweep *sweep = NULL;
+    size_t total = 0, poolSize = 0;
+    
+    size_t typeListOffset = ntohs(map->typeListOffset), nameListOffset = ntohs(map->nameListOffset);
+    
+    // size ref lists, ID columns and name pools, so they fit in one arena chunk
+    for(int i=0; i < numTypes; i++) {
+        struct RmType *t = &types[i];
+        struct RfRefEntry *ent = ((void*)typeList)+t->refOffset;
+        if (typeListOffset + t->refOffset + t->count * sizeof(struct RfRefEntry) > rp->mapLength) egoto(EINVAL, error);
+        total += t->count;
+        for(int j=0; j < t->count; j++) {
+            size_t nameOffset = ntohs(ent[j].nameOffset);
+            if (nameOffset == 0xFFFF) continue;
+            if (nameListOffset + nameOffset >= rp->mapLength || nameListOffset + nameOffset + names[nameOffset] >= rp->mapLength) egoto(EINVAL, error);
+            poolSize += names[nameOffset]+1;
+        }
+    }
+    if (res_arena_reserve(rp, total * (sizeof(struct RmResRef) + sizeof(int16_t)) + 3 * numTypes * kArenaAlign + poolSize)) egoto(ENOMEM, error);
+    
+    for(int i=0; i < numTypes; i++) {
+        struct RmType *t = &types[i];
+        struct RfRefEntry *ent = ((void*)typeList)+t->refOffset;
+        size_t typePool = 0;
+        for(int j=0; j < t->count; j++) {
+            uint16_t nameOffset = ntohs(ent[j].nameOffset);
+            if (nameOffset != 0xFFFF) typePool += names[nameOffset]+1;
+        }
+        t->list = res_arena_alloc(rp, t->count * sizeof(struct RmResRef));
+        t->ids = res_arena_alloc(rp, t->count * sizeof(int16_t));
+        t->names = typePool ? res_arena_alloc(rp, typePool) : NULL;
+        if (t->list == NULL || t->ids == NULL || (typePool && t->names == NULL)) egoto(ENOMEM, error);
         
         // read resource refs & names
-        int refsNeedSort = 0;
-        struct RfRefEntry *ent = ((void*)types)+ntohs(types->entry[i].offset);
+        typePool = 0;
         for(int j=0; j < t->count; j++) {
             t->list[j].ID = ntohs(ent[j].ID);
-            if (j && (t->list[j].ID < t->list[j-1].ID)) refsNeedSort = 1;
             t->list[j].flags.b = ent[j].attributes;
             t->list[j].offset = ((ent[j].offHi << 16) | ntohs(ent[j].offLo));
-            t->list[j].psize = res_szread(rp, rp->dataOffset+t->list[j].offset);
             
             uint16_t nameOffset = ntohs(ent[j].nameOffset);
-            if (nameOffset == 0xFFFF) t->list[j].name = NULL;
+            if (nameOffset == 0xFFFF) t->list[j].name = kNoName;
             else {
-                t->list[j].name = malloc(names[nameOffset]+1);
-                if (t->list[j].name == NULL) egoto(ENOMEM, error);
-                t->list[j].name[names[nameOffset]] = '\0';
-                memcpy(t->list[j].name, &names[nameOffset+1], names[nameOffset]);
+                // pool is zeroed, names come out terminated
+                t->list[j].name = (uint32_t)typePool;
+                memcpy(t->names + typePool, &names[nameOffset+1], names[nameOffset]);
+                typePool += names[nameOffset]+1;
             }
-            
-            // find logical size
-            if (t->list[j].flags.fl.compressed) {
-                struct RfCmpHdr cmpHdr;
-                if (res_read_raw(rp, &t->list[j], &cmpHdr, 0, sizeof cmpHdr, NULL, NULL) == NULL)
-                    goto notCompressed;
-                if (ntohl(cmpHdr.tag) != kCompressedResourceTag)
-                    goto notCompressed;
-                t->list[j].size = ntohl(cmpHdr.size);
-                
-                if (ntohl(cmpHdr.flags) == kCompressedResourceFlg0)
-                    t->list[j].dcmp = ntohs(cmpHdr.u.v0.dcmp);
-                else if (ntohl(cmpHdr.flags) == kCompressedResourceFlg1)
-                    t->list[j].dcmp = ntohs(cmpHdr.u.v1.dcmp);
-                else {
-                    t->list[j].dcmp = kDCMPInvalidFlags;
-                    fprintf(stderr, "libres: %c%c%c%c %hd: unknown compression flags\n", TYPECHARS(t->type), t->list[j].ID);
-                }
+        }
+    }
+    
+    // read sizes of all new refs in one pass over the data section
+    sweep = res_file_malloc(rp, total * sizeof(struct RmSweep));
+    if (sweep == NULL && total) egoto(ENOMEM, error);
+    total = 0;
+    for(int i=0; i < numTypes; i++) {
+        struct RmType *t = &types[i];
+        for(int j=0; j < t->count; j++) {
+            sweep[total].type = t->type;
+            sweep[total].ref = &t->list[j];
+            total++;
+        }
+    }
+    if (res_refs_measure(rp, sweep, total)) goto error;
+    res_free(sweep);
+    
+    // keep ref lists sorted
+    // they are normally sorted by ID already, so it's rarely needed
+    for(int i=0; i < numTypes; i++) {
+        struct RmType *t = &types[i];
+        for(int j=1; j < t->count; j++) {
+            if (t->list[j].ID >= t->list[j-1].ID) continue;
+            qsort(t->list, t->count, sizeof(struct RmResRef), (int(*)(const void*, const void*))res_ref_compar);
+            break;
+        }
+        for(int j=0; j < t->count; j++) t->ids[j] = t->list[j].ID;
+        __atomic_store_n(&t->loaded, 1, __ATOMIC_RELEASE);
+    }
+    return 0;
+error:
+    // anything allocated so far stays in the arena until the file is closed
+    res_free(sweep);
+    for(int i=0; i < numTypes; i++) types[i].list = NULL;
+    return -1;
+}
+
+static inline size_t res_ref_prefix (struct RmResRef *ref) {
+    // bytes needed to measure a resource: the length, and the header of compressed ones
+    return 4 + (ref->flags.fl.compressed ? sizeof(struct RfCmpHdr) : 0);
+}
+
+int res_refs_measure (RFILE *rp, struct RmSweep *sweep, size_t count) {
+    // visit refs in file order, so file-backed reads turn into a few sequential blocks
+    qsort(sweep, count, sizeof(struct RmSweep), (int(*)(const void*, const void*))res_sweep_compar);
+    uint8_t *block = NULL;
+    size_t blockStart = 0, blockLength = 0;
+    if (rp->buf == NULL && count) {
+        block = res_file_malloc(rp, kSweepBlockSize);
+        if (block == NULL) eret(ENOMEM, -1);
+    }
+    
+    for(size_t i=0; i < count; i++) {
+        struct RmResRef *ref = sweep[i].ref;
+        size_t pos = rp->dataOffset + ref->offset;
+        size_t need = res_ref_prefix(ref);
+        const uint8_t *p = NULL;
+        if (rp->buf && pos + need <= rp->size) {
+            p = rp->buf + pos;
+        } else if (rp->buf == NULL && pos >= blockStart && pos + need <= blockStart + blockLength) {
+            p = block + (pos - blockStart);
+        } else if (rp->buf == NULL && pos + need <= rp->size) {
+            // only as far as the last prefix that fits in a block, so sparse forks don't read their data
+            size_t end = pos + need;
+            for(size_t j=i+1; j < count; j++) {
+                size_t next = rp->dataOffset + sweep[j].ref->offset + res_ref_prefix(sweep[j].ref);
+                if (next - pos > kSweepBlockSize) break;
+                if (next <= rp->size && next > end) end = next;
             }
+            blockStart = pos;
+            blockLength = end - pos;
+            if (res_bread(rp, block, blockStart, blockLength)) p = block;
+            else blockLength = 0;
+        } else if (pos + 4 <= rp->size) {
+            // compressed header doesn't fit, fall back to the length alone
+            ref->psize = res_szread(rp, pos);
+        }
+        
+        if (p) {
+            uint32_t length;
+            memcpy(&length, p, sizeof length);
+            ref->psize = ntohl(length);
+        }
+        
+        // find logical size
+        if (ref->flags.fl.compressed) {
+            struct RfCmpHdr cmpHdr;
+            if (p == NULL || ref->psize < sizeof cmpHdr)
+                goto notCompressed;
+            memcpy(&cmpHdr, p+4, sizeof cmpHdr);
+            if (ntohl(cmpHdr.tag) != kCompressedResourceTag)
+                goto notCompressed;
+            ref->size = ntohl(cmpHdr.size);
             
-            // resource not compressed, logical size = physical size
-            if (t->list[j].flags.fl.compressed == 0) {
-                notCompressed:
-                t->list[j].flags.fl.compressed = 0;
-                t->list[j].size = t->list[j].psize;
+            if (ntohl(cmpHdr.flags) == kCompressedResourceFlg0)
+                ref->dcmp = ntohs(cmpHdr.u.v0.dcmp);
+            else if (ntohl(cmpHdr.flags) == kCompressedResourceFlg1)
+                ref->dcmp = ntohs(cmpHdr.u.v1.dcmp);
+            else {
+                ref->dcmp = kDCMPInvalidFlags;
+                fprintf(stderr, "libres: %c%c%c%c %hd: unknown compression flags\n", TYPECHARS(sweep[i].type), ref->ID);
             }
         }
         
-        // keep ref list sorted
-        // they are normally sorted by ID already, so it's rarely needed
-        if (refsNeedSort) qsort(t->list, t->count, sizeof(struct RmResRef), (int(*)(const void*, const void*))res_ref_compar);
+        // resource not compressed, logical size = physical size
+        if (ref->flags.fl.compressed == 0) {
+            notCompressed:
+            ref->flags.fl.compressed = 0;
+            ref->size = ref->psize;
+        }
     }
     
-    // keep type list sorted
-    // types are sorted alphabetically in files, we need them sorted numerically
-    qsort(rp->types, rp->numTypes, sizeof(struct RmType), (int(*)(const void*, const void*))res_type_compar);
-    
-    errno = 0;
-    free(map);
-    return rp;
-error:
-    free(map);
-    res_close(rp);
-    return NULL;
+    res_free(block);
+    return 0;
+}
+
+int res_sweep_compar (const struct RmSweep * a, const struct RmSweep * b) {
+    if (a->ref->offset == b->ref->offset) return 0;
+    if (a->ref->offset < b->ref->offset) return -1;
+    return 1;
 }
 
 int res_ref_compar (const struct RmResRef * a, const struct RmResRef * b) {
@@ -370,27 +851,129 @@ int res_type_compar (const struct RmType * a, const struct RmType * b) {
 }
 
 struct RmType * res_type_find (RFILE *rp, uint32_t type) {
-    struct RmType key;
-    key.type = type;
-    return bsearch(&key, rp->types, rp->numTypes, sizeof(struct RmType), (int(*)(const void*, const void*))res_type_compar);
+    size_t i = res_search32(rp->typeCodes, rp->numTypes, type);
+    if (i == rp->numTypes) return NULL;
+    return res_type_load(rp, &rp->types[i]);
 }
 
 struct RmResRef * res_ref_find (RFILE *rp, struct RmType *type, int16_t ID) {
-    struct RmResRef key;
     if (type == NULL) return NULL;
-    key.ID = ID;
-    return bsearch(&key, type->list, type->count, sizeof(struct RmResRef), (int(*)(const void*, const void*))res_ref_compar);
+    res_stat_add(rp, lookupsByID, 1);
+    size_t i = res_search16(type->ids, type->count, ID);
+    if (i == type->count) return NULL;
+    return &type->list[i];
 }
 
 struct RmResRef * res_ref_find_named (RFILE *rp, struct RmType *type, const char *name) {
-    struct RmResRef key;
-    if (type == NULL) return NULL;
-    key.name = (char*)name;
-    size_t count = type->count;
-    return lfind(&key, type->list, &count, sizeof(struct RmResRef), (int(*)(const void*, const void*))res_ref_name_compar);
+    if (type == NULL || name == NULL) return NULL;
+    res_stat_add(rp, lookupsByName, 1);
+    
+    // short lists aren't worth hashing
+    if (type->count < kNameIndexMin) {
+        for(size_t j=0; j < type->count; j++)
+            if (type->list[j].name != kNoName && strcmp(type->names + type->list[j].name, name) == 0) return &type->list[j];
+        return NULL;
+    }
+    
+    uint32_t *index = __atomic_load_n(&type->nameIndex, __ATOMIC_ACQUIRE);
+    if (index == NULL) {
+        pthread_mutex_lock(&rp->mapLock);
+        if (type->nameIndex == NULL) res_name_index(rp, type);
+        index = type->nameIndex;
+        pthread_mutex_unlock(&rp->mapLock);
+        if (index == NULL) return NULL;
+    }
+    res_stat_add(rp, lookupsHashed, 1);
+    size_t mask = type->nameSlots - 1;
+    for(size_t i = res_name_hash(name) & mask; index[i]; i = (i+1) & mask) {
+        struct RmResRef *ref = &type->list[index[i]-1];
+        if (strcmp(type->names + ref->name, name) == 0) return ref;
+    }
+    return NULL;
 }
 
-int res_ref_name_compar (const struct RmResRef * a, const struct RmResRef * b) {
-    if (a->name == NULL || b->name == NULL) return 1;
-    return strcmp(a->name, b->name);
+int res_name_index (RFILE *rp, struct RmType *type) {
+    // open addressing, at most half full; slots hold list index + 1
+    size_t slots = 1;
+    while (slots < 2 * type->count) slots <<= 1;
+    uint32_t *index = res_arena_alloc(rp, slots * sizeof(uint32_t));
+    if (index == NULL) eret(ENOMEM, -1);
+    
+    // insert in list order, so duplicate names resolve to the first one like a linear search
+    size_t mask = slots - 1;
+    for(size_t j=0; j < type->count; j++) {
+        if (type->list[j].name == kNoName) continue;
+        size_t i = res_name_hash(type->names + type->list[j].name) & mask;
+        while (index[i]) i = (i+1) & mask;
+        index[i] = (uint32_t)j+1;
+    }
+    
+    // publish the index last, lookups don't take the lock
+    type->nameSlots = slots;
+    __atomic_store_n(&type->nameIndex, index, __ATOMIC_RELEASE);
+    return 0;
+}
+
+uint32_t res_name_hash (const char *name) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for(const uint8_t *p = (const uint8_t*)name; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void* res_malloc (size_t size) {
+    return res_alloc_hook(res_alloc_ctx, size);
+}
+
+void* res_file_malloc (RFILE *rp, size_t size) {
+    if (rp) {
+        res_stat_add(rp, allocs, 1);
+        res_stat_add(rp, allocBytes, size);
+    }
+    return res_malloc(size);
+}
+
+void res_free (void *ptr) {
+    if (ptr) res_free_hook(res_alloc_ctx, ptr);
+}
+
+int res_arena_reserve (RFILE *rp, size_t size) {
+    struct RmChunk *c = rp->arena;
+    if (c && c->size - c->used >= size) return 0;
+    
+    // start a new chunk, big enough for the whole reservation
+    size_t csize = kArenaChunkSize;
+    if (size > csize) csize = size;
+    c = res_file_malloc(rp, sizeof(struct RmChunk) + csize);
+    if (c == NULL) eret(ENOMEM, -1);
+    c->next = rp->arena;
+    c->size = csize;
+    c->used = 0;
+    rp->arena = c;
+    return 0;
+}
+
+void* res_arena_alloc (RFILE *rp, size_t size) {
+    struct RmChunk *c = rp->arena;
+    size_t pad = c ? (kArenaAlign - c->used % kArenaAlign) % kArenaAlign : 0;
+    if (res_arena_reserve(rp, pad + size)) return NULL;
+    if (c != rp->arena) pad = 0;
+    c = rp->arena;
+    void *p = c->data + c->used + pad;
+    c->used += pad + size;
+    bzero(p, size);
+    return p;
+}
+
+void res_arena_free (RFILE *rp) {
+    struct RmChunk *c = rp->arena;
+    while (c) {
+        struct RmChunk *next = c->next;
+        res_free(c);
+        c = next;
+    }
+    rp->arena = NULL;
 }
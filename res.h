@@ -27,8 +27,26 @@
 
 extern const char * libres_id;
 
+// res_open modes
+#define RES_MODE_MMAP   0x1 // map the file instead of reading it, enables res_read_ptr
+#define RES_MODE_LAZY   0x2 // parse each type's resource list the first time it's used
+#define RES_MODE_PRELOAD 0x4 // read resources with the preload attribute when opening, see res_preload
+#define RES_MODE_READAHEAD 0x8 // read files opened with functions in blocks, see res_readahead
+
+/*
+    Thread safety:
+    An open RFILE can be used from several threads at once for lookups and reads
+    (res_typecount, res_types, res_count, res_list, res_attr*, res_read*, res_acquire,
+    res_release, res_cache_stats). Opening and closing a file, res_cache and
+    res_set_allocator must not run concurrently with other calls on the same file.
+    Reads through res_open_funcs are serialized, since seek and read share a position;
+    use res_open_funcs_at to read in parallel.
+ */
+
 // in-memory structures
 typedef struct RFILE RFILE;
+typedef struct RSTREAM RSTREAM;
+typedef struct RWRITER RWRITER;
 
 typedef union __attribute__ ((__packed__)) {
     struct {
@@ -55,14 +73,39 @@ typedef struct ResAttr ResAttr;
 
 typedef unsigned long (*res_seek_func)(void *, long, int);
 typedef unsigned long (*res_read_func)(void *, void *, unsigned long);
+typedef unsigned long (*res_read_at_func)(void *, void *, unsigned long, unsigned long); // priv, buf, count, offset
+typedef void* (*res_alloc_func)(void *ctx, size_t size);
+typedef void (*res_free_func)(void *ctx, void *ptr);
+
+/**
+    Route libres' internal allocations through a custom allocator
+    Buffers returned to the caller are still allocated with malloc.
+    Call before opening any files, NULL functions restore malloc/free.
+    @param ctx      passed to alloc and free
+ */
+void res_set_allocator (void *ctx, res_alloc_func alloc, res_free_func free);
 
 /**
     @param path     path to file
-    @param mode     reserved, set to 0
+    @param mode     0 or RES_MODE_* flags
     @returns        reference to open file or NULL
  */
 RFILE* res_open (const char *path, int mode);
 
+/**
+    Share handles between res_open calls on the same file
+    While enabled, res_open returns the handle already open for a file with the same device, inode,
+    size, modification time and mode, instead of parsing it again. res_close only closes a shared
+    handle when its last user does, so other threads may keep using it meanwhile. Up to maxIdle
+    handles nobody uses are kept open for later calls, the least recently used ones are closed first.
+    Shared handles share their settings, such as res_cache, res_checkpoint, res_set_trace and
+    res_preload, and only one res_preload runs on a handle at a time.
+    @param enable   1 to share handles, 0 to stop sharing them and close the idle ones
+    @param maxIdle  unused handles to keep open
+    @returns        0
+ */
+int res_pool (int enable, size_t maxIdle);
+
 /**
     @param buf      resource buffer
     @param size     size of buf
@@ -71,6 +114,53 @@ RFILE* res_open (const char *path, int mode);
  */
 RFILE* res_open_mem (void *buf, size_t size, int copy);
 RFILE* res_open_funcs (void *priv, res_seek_func seek, res_read_func read);
+
+/// same as above, with RES_MODE_LAZY, RES_MODE_PRELOAD or 0 as mode, and RES_MODE_READAHEAD for functions
+RFILE* res_open_mem_mode (void *buf, size_t size, int copy, int mode);
+RFILE* res_open_funcs_mode (void *priv, res_seek_func seek, res_read_func read, int mode);
+
+/**
+    Open a file using a saved index instead of parsing its map
+    The index is written if it's missing or doesn't match the file.
+    @param indexPath    path to the index
+    @returns            reference to open file or NULL
+ */
+RFILE* res_open_indexed (const char *path, const char *indexPath, int mode);
+
+/**
+    Save the parsed map of a file opened with res_open to an index
+    The index is only valid for a file with the same size and modification time, and is specific to
+    the architecture that wrote it.
+    @returns        0 on success, -1 on error
+ */
+int res_index_save (RFILE *rp, const char *indexPath);
+
+/**
+    Open a file through a positional read function, which may be called from several threads at once
+    @param size     size of the file
+    @param mode     RES_MODE_LAZY, RES_MODE_PRELOAD, RES_MODE_READAHEAD or 0
+    @returns        reference to open file or NULL
+ */
+RFILE* res_open_funcs_at (void *priv, size_t size, res_read_at_func read, int mode);
+
+/**
+    Open the resource fork inside an AppleSingle, AppleDouble or MacBinary file
+    The fork is read in place, files that aren't containers are opened as bare forks.
+    @param mode     0 or RES_MODE_* flags
+    @returns        reference to open file or NULL; ENOENT if the container has no resource fork
+ */
+RFILE* res_open_container (const char *path, int mode);
+
+/// same as above, for a container in memory, copy works as in res_open_mem
+RFILE* res_open_container_mem (void *buf, size_t size, int copy, int mode);
+
+/**
+    Open the resource fork stored in a file's extended attribute
+    On macOS it's read in place through the named fork, elsewhere the com.apple.ResourceFork
+    attribute in the user namespace is read into memory.
+    @returns        reference to open file or NULL
+ */
+RFILE* res_open_xattr (const char *path, int mode);
 int res_close (RFILE *rp);
 
 /// number of resource types
@@ -107,8 +197,66 @@ ResAttr* res_attr (RFILE *rp, uint32_t type, int16_t ID, ResAttr *buf);
 /// get attributes for a resource (by name)
 ResAttr* res_attr_named (RFILE *rp, uint32_t type, const char *name, ResAttr *buf);
 
+/// position in a walk over all resources, zero it to start from the first one
+struct ResIter {
+    size_t      type;   // index in res_types
+    size_t      index;  // index in res_list
+};
+typedef struct ResIter ResIter;
+
+/**
+    Get the next resource, without allocating
+    Resources come in the same order as res_types and res_list.
+    @param it       position, advanced past the returned resource
+    @param type     returns type of the resource, if not NULL
+    @param attr     returns attributes of the resource
+    @returns        1 if a resource was returned, 0 at the end, -1 on error
+ */
+int res_next (RFILE *rp, ResIter *it, uint32_t *type, ResAttr *attr);
+
+#define RES_VISIT_DATA  0x1 // pass each resource's data to the visitor
+
+/// called for every resource by res_visit, returning non-zero stops the walk
+typedef int (*res_visit_func)(void *ctx, uint32_t type, const ResAttr *attr, const void *data, size_t size);
+
+/**
+    Call a function for every resource, in the same order as res_next
+    With RES_VISIT_DATA, data points into the file when it's in memory and the resource isn't compressed,
+    otherwise to a buffer reused between calls. It's only valid during the call.
+    Resources that can't be read are passed with NULL data and errno set.
+    @param flags    0 or RES_VISIT_DATA
+    @returns        0 after visiting every resource, what the visitor returned if it stopped, or -1 on error
+ */
+int res_visit (RFILE *rp, int flags, res_visit_func func, void *ctx);
+
+/// pattern found by res_search_data
+struct ResHit {
+    uint32_t    type;
+    int16_t     ID;
+    size_t      offset; // in the resource data, decompressed
+    int         error;  // errno if the resource couldn't be read, offset is then where it stopped
+};
+typedef struct ResHit ResHit;
+
+/// called for every match by res_search_data, returning non-zero stops the search
+typedef int (*res_hit_func)(void *ctx, const ResHit *hit);
+
+/**
+    Find a byte pattern in the data of resources
+    Resources are searched in the order they are stored, reading the data section sequentially
+    instead of each resource on its own. Compressed resources are searched decompressed.
+    Every match is reported, including overlapping ones. A resource that can't be read or decompressed
+    is reported once with error set, after any matches found before the failure, and the search goes on.
+    @param pattern  bytes to find, up to 512K
+    @param types    types to search, or NULL to search all of them
+    @param numTypes number of types
+    @returns        0 after searching every resource, what the function returned if it stopped, or -1 on error
+ */
+int res_search_data (RFILE *rp, const void *pattern, size_t length, const uint32_t *types, size_t numTypes, res_hit_func func, void *ctx);
+
 /**
     Read a resource
+    Compressed resources are decompressed, start and size refer to the decompressed data.
     @param buf      resource output or NULL
     @param size     size of buffer, ignored if buf is NULL
     @returns        buf (filled), or newly allocated resource
@@ -116,6 +264,273 @@ ResAttr* res_attr_named (RFILE *rp, uint32_t type, const char *name, ResAttr *bu
 void* res_read (RFILE *rp, uint32_t type, int16_t ID, void *buf, size_t start, size_t size, size_t *read, size_t *remain);
 void* res_read_named (RFILE *rp, uint32_t type, const char *name, void *buf, size_t start, size_t size, size_t *read, size_t *remain);
 
+/**
+    Get a resource without copying it
+    Only works on files opened with RES_MODE_MMAP or res_open_mem
+    @param size     returns size of the resource, if not NULL
+    @returns        pointer to the resource data, valid while the file is open
+ */
+const void* res_read_ptr (RFILE *rp, uint32_t type, int16_t ID, size_t *size);
+
+/**
+    Find a resource's data in the file, to copy it without reading it through libres
+    Compressed resources are stored compressed.
+    @param offset   returns offset of the data in the file, or in its container
+    @param size     returns size of the data in the file
+    @returns        0 on success, -1 on error
+ */
+int res_locate (RFILE *rp, uint32_t type, int16_t ID, size_t *offset, size_t *size);
+
+struct ResReadReq {
+    uint32_t    type;
+    int16_t     ID;
+    void        *buf;   // destination, NULL to allocate one
+    size_t      size;   // size of buf, returns bytes read
+    int         error;  // returns 0 or errno
+};
+typedef struct ResReadReq ResReadReq;
+
+/**
+    Read several resources at once
+    Resources are read in file order, neighbouring ones with a single read.
+    @param reqs     requests, buf and size work as in res_read from the start of the resource
+    @returns        number of requests read, failed ones have their error set
+ */
+size_t res_read_many (RFILE *rp, ResReadReq *reqs, size_t count);
+
+typedef struct RQUEUE RQUEUE;
+struct ResAsyncReq;
+typedef void (*res_async_func)(void *ctx, struct ResAsyncReq *req);
+
+struct ResAsyncReq {
+    uint32_t            type;
+    int16_t             ID;
+    void                *buf;   // destination, NULL to allocate one
+    size_t              start;
+    size_t              size;   // size of buf, 0 to read to the end; returns bytes read
+    int                 error;  // returns 0 or errno
+    res_async_func      func;   // called when done, NULL to post it to the queue
+    void                *ctx;
+    
+    // used by the queue while the request is pending
+    RFILE               *rp;
+    struct ResAsyncReq  *next;
+    size_t              offset; // in file
+    size_t              length;
+    size_t              done;
+    uint64_t            submitted;
+    int                 owned;
+};
+typedef struct ResAsyncReq ResAsyncReq;
+
+/**
+    Create a queue for asynchronous reads
+    Reads are done by a pool of threads, or by io_uring where the kernel has it.
+    @param threads  number of threads, 0 to use one per processor
+ */
+RQUEUE* res_queue_open (int threads);
+
+/**
+    Start reading a resource, works like res_read
+    The request must stay valid until it's done, and the file open.
+    @param req      request, completed through its callback or res_queue_poll
+    @returns        0 if the read was started, -1 and errno if it won't complete
+ */
+int res_read_async (RQUEUE *q, RFILE *rp, ResAsyncReq *req);
+
+/**
+    Get a completed request that had no callback
+    @param wait     wait for one if there are none
+    @returns        request, or NULL and errno EAGAIN if none are done, ENOENT if none are pending
+ */
+ResAsyncReq* res_queue_poll (RQUEUE *q, int wait);
+
+/// descriptor that's readable while res_queue_poll has requests, for poll/select/epoll
+int res_queue_fd (RQUEUE *q);
+
+/// wait for pending reads and free the queue
+int res_queue_close (RQUEUE *q);
+
+/**
+    Open a resource for reading in pieces
+    Memory use doesn't depend on the size of the resource, except for compressed resources
+    in files that aren't in memory, which keep their compressed data.
+    @returns        stream positioned at the start of the resource, or NULL
+ */
+RSTREAM* res_stream_open (RFILE *rp, uint32_t type, int16_t ID);
+
+/**
+    Read the next piece of a stream
+    @param read     returns bytes read, 0 at the end of the resource
+    @returns        buf, or NULL on error
+ */
+void* res_stream_read (RSTREAM *sp, void *buf, size_t size, size_t *read);
+
+/**
+    Get the next piece of a stream without copying it
+    Points into the file for uncompressed resources in memory, otherwise into a buffer owned by the stream.
+    @param size     returns size of the piece, 0 at the end of the resource
+    @returns        data valid until the next call on the stream, or NULL on error
+ */
+const void* res_stream_next (RSTREAM *sp, size_t *size);
+
+/// set the position in a stream, whence is SEEK_SET, SEEK_CUR or SEEK_END
+int res_stream_seek (RSTREAM *sp, long offset, int whence);
+size_t res_stream_tell (RSTREAM *sp);
+size_t res_stream_size (RSTREAM *sp);
+int res_stream_close (RSTREAM *sp);
+
+/**
+    Enable caching of read resources
+    Cached resources are served by res_read and res_acquire without reading the file again,
+    least recently used ones are dropped when the cache grows over budget.
+    @param budget   maximum bytes to keep cached, 0 disables the cache and empties it
+ */
+int res_cache (RFILE *rp, size_t budget);
+
+/**
+    Read a file opened with functions through a block cache
+    Small and adjacent reads are served from blocks fetched by a few large calls. Reads that continue
+    where the last one ended fetch more blocks at once, up to half of the cache.
+    RES_MODE_READAHEAD enables it when opening, with 16 blocks of 64K.
+    @param blockSize    bytes per block, 0 disables the cache
+    @param numBlocks    blocks to keep, at least 2
+    @returns            0 on success, -1 on error; ENOTSUP if the file isn't read through functions
+ */
+int res_readahead (RFILE *rp, size_t blockSize, size_t numBlocks);
+
+/**
+    Save decompressor state while decoding compressed resources
+    Later partial reads and stream seeks resume from the nearest checkpoint instead of
+    decoding from the start. Checkpoints are kept for the most recently read resources.
+    @param interval output bytes between checkpoints, 0 disables them and drops the saved ones
+ */
+int res_checkpoint (RFILE *rp, size_t interval);
+
+/**
+    Get a complete resource, shared with the cache
+    @param size     returns size of the resource, if not NULL
+    @returns        pointer to the resource data, valid until released or the file is closed
+ */
+const void* res_acquire (RFILE *rp, uint32_t type, int16_t ID, size_t *size);
+
+/// release data returned by res_acquire
+void res_release (RFILE *rp, const void *data);
+
+struct ResCacheStats {
+    uint64_t    hits;
+    uint64_t    misses;
+    uint64_t    evictions;
+    size_t      bytes;      // currently cached
+    size_t      entries;    // currently cached
+    size_t      preloaded;  // kept by res_preload, not counted above
+    size_t      preloadedBytes;
+};
+typedef struct ResCacheStats ResCacheStats;
+
+/// get cache counters, all zero until the cache is first used, disabling it empties it but keeps the counts
+ResCacheStats* res_cache_stats (RFILE *rp, ResCacheStats *buf);
+
+/**
+    Read resources into memory, where they stay until the file is closed
+    Resources with the preload attribute and all resources of the given types are read
+    in file order, neighbouring ones with a single read, and later reads of them don't
+    do any I/O. They're kept in the cache, but don't count towards its budget.
+    @param types        types to read completely, or NULL
+    @param background   read them on a separate thread and return right away
+    @returns            number of resources read, 0 if started in the background, or -1 and errno,
+                        EBUSY if another res_preload is running on the file
+ */
+int res_preload (RFILE *rp, const uint32_t *types, size_t numTypes, int background);
+
+struct ResCatEntry {
+    uint32_t    type;
+    ResAttr     attr;
+};
+typedef struct ResCatEntry ResCatEntry;
+
+/**
+    Called by res_catalog for each file, one call at a time
+    @param entries  resources in the file, valid during the call
+    @param error    0, or errno if the file couldn't be read
+    @returns        0 to continue, anything else stops the catalog
+ */
+typedef int (*res_catalog_func)(void *ctx, const char *path, const ResCatEntry *entries, size_t count, int error);
+
+/**
+    List the resources in many files, opening them in parallel
+    Files are reported in no particular order.
+    @param threads  number of threads, 0 to use one per processor
+    @param mode     passed to res_open
+    @returns        0 when all files were visited, -1 if stopped or on error
+ */
+int res_catalog (const char * const *paths, size_t count, int threads, int mode, res_catalog_func func, void *ctx);
+
+struct ResStats {
+    uint64_t    reads;          // reads from the backend
+    uint64_t    bytesRead;
+    uint64_t    seeks;          // seek callbacks
+    uint64_t    calls;          // read syscalls and callbacks
+    uint64_t    allocs;         // internal allocations for the file
+    uint64_t    allocBytes;
+    uint64_t    loadTime;       // nanoseconds spent loading the map
+    uint64_t    lookupsByID;
+    uint64_t    lookupsByName;
+    uint64_t    lookupsHashed;  // name lookups that used the name index
+    uint64_t    lookupsByIndex;
+    uint64_t    bytesDecoded;   // output of decompressors, up to and in the parts read
+};
+typedef struct ResStats ResStats;
+
+/// get a file's counters, they start when it's opened
+ResStats* res_stats (RFILE *rp, ResStats *buf);
+
+/**
+    Called after each read from the backend
+    @param nanos    time the read took
+ */
+typedef void (*res_trace_func)(void *ctx, RFILE *rp, size_t offset, size_t length, uint64_t nanos);
+
+/// set or clear (NULL) the trace hook of a file, reads already running may still call the previous one
+void res_set_trace (RFILE *rp, res_trace_func func, void *ctx);
+
+/// create an empty fork to be filled with res_writer_add* and written with res_writer_write*
+RWRITER* res_writer_new (void);
+
+/**
+    Add a resource from memory
+    @param name     name, up to 255 bytes, or NULL
+    @param copy     1 to copy data, 0 to use it in place until the writer is closed
+    @returns        0 on success, -1 on error
+ */
+int res_writer_add (RWRITER *w, uint32_t type, int16_t ID, const char *name, RFlags flags, const void *data, size_t size, int copy);
+
+/**
+    Add a resource that's read through a function when the fork is written
+    @param read     positional read function, called with offsets from the start of the resource
+    @param size     size of the resource
+    @returns        0 on success, -1 on error
+ */
+int res_writer_add_func (RWRITER *w, uint32_t type, int16_t ID, const char *name, RFlags flags, res_read_at_func read, void *priv, size_t size);
+
+/**
+    Add a resource from an open file, with its name, attributes and data as stored
+    Compressed resources stay compressed. The file must stay open until the writer is closed.
+    @returns        0 on success, -1 on error
+ */
+int res_writer_add_res (RWRITER *w, RFILE *rp, uint32_t type, int16_t ID);
+
+/**
+    Write the fork in one pass, without seeking
+    @param fd       destination, written from its current position
+    @returns        0 on success, -1 on error; EEXIST for duplicate resources, EFBIG if it doesn't fit the format
+ */
+int res_writer_write (RWRITER *w, int fd);
+
+/// write the fork to a newly allocated buffer, returns NULL on error
+void* res_writer_write_mem (RWRITER *w, size_t *size);
+int res_writer_close (RWRITER *w);
+
 void res_printdir (RFILE *rp);
 void res_printattr (const ResAttr *attr, uint32_t type);
 #endif /* _RES_H_ */
@@ -0,0 +1,93 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// list the resources of many files as tab-separated values:
+// path, type, ID, size, attributes, name
+
+#define _XOPEN_SOURCE 700 // nftw
+#include <errno.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "res.h"
+#include "restool.h"
+
+static int failed;
+
+static void print_char (unsigned char c) {
+    // keep one record per line
+    if (c < 0x20 || c == 0x7F || c == '\\') printf("\\x%02X", c);
+    else putchar(c);
+}
+
+static void print_escaped (const char *s) {
+    for(; *s; s++) print_char(*s);
+}
+
+static void print_type (uint32_t type) {
+    for(int i=24; i >= 0; i -= 8) print_char((type >> i) & 0xFF);
+}
+
+static int print_file (void *ctx, const char *path, const ResCatEntry *entries, size_t count, int error) {
+    if (error) {
+        fprintf(stderr, "rescat: %s: %s\n", path, strerror(error));
+        failed = 1;
+        return 0;
+    }
+    for(size_t i=0; i < count; i++) {
+        const ResAttr *a = &entries[i].attr;
+        print_escaped(path);
+        putchar('\t');
+        print_type(entries[i].type);
+        printf("\t%hd\t%u\t%02X\t", a->ID, a->size, a->flags.b);
+        if (a->name) print_escaped(a->name);
+        putchar('\n');
+    }
+    return ferror(stdout) ? -1 : 0;
+}
+
+int main (int argc, char **argv) {
+    int threads = 0, mode = 0, c;
+    while ((c = getopt(argc, argv, "j:m")) != -1) {
+        switch (c) {
+            case 'j': threads = atoi(optarg); break;
+            case 'm': mode |= RES_MODE_MMAP; break;
+            default:
+                fprintf(stderr, "usage: rescat [-j threads] [-m] path...\n");
+                return 2;
+        }
+    }
+    
+    // directories are searched for files
+    for(int i=optind; i < argc; i++) {
+        if (nftw(argv[i], add_path, 64, FTW_PHYS)) {
+            fprintf(stderr, "rescat: %s: %s\n", argv[i], strerror(errno));
+            failed = 1;
+        }
+    }
+    
+    if (res_catalog((const char * const *)paths, numPaths, threads, mode, print_file, NULL)) {
+        fprintf(stderr, "rescat: %s\n", strerror(errno));
+        failed = 1;
+    }
+    for(size_t i=0; i < numPaths; i++) free(paths[i]);
+    free(paths);
+    return failed;
+}
@@ -0,0 +1,352 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// extract the resources of many files into a directory or a tar stream on
+// stdout, as path/TYPE/ID; uncompressed resources are copied by the kernel
+
+#define _GNU_SOURCE // copy_file_range, nftw
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include "res.h"
+#include "restool.h"
+
+static size_t nextPath;
+static uint32_t *types;
+static size_t numTypes;
+static int16_t *ids;
+static size_t numIDs;
+static const char *outDir;
+static int mode, failed;
+static int tarBroken;   // a member's data was cut short, nothing more can be appended
+static pthread_mutex_t outLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void fail (const char *path, const char *what, int error) {
+    pthread_mutex_lock(&outLock);
+    fprintf(stderr, "resextract: %s%s%s: %s\n", path, what ? ": " : "", what ? what : "", strerror(error));
+    failed = 1;
+    pthread_mutex_unlock(&outLock);
+}
+
+static void append (char *buf, size_t size, size_t *n, const char *s, size_t length) {
+    // like snprintf, n keeps counting past the end of buf
+    if (*n < size) memcpy(buf + *n, s, *n + length < size ? length : size - *n - 1);
+    *n += length;
+    buf[*n < size ? *n : size - 1] = '\0';
+}
+
+static size_t member_name (char *buf, size_t size, const char *path, uint32_t type, int16_t ID) {
+    // relative, without . or .. components, and type codes escaped
+    size_t n = 0;
+    for(const char *p = path; *p;) {
+        while (*p == '/') p++;
+        size_t length = strcspn(p, "/");
+        if (length == 0) break;
+        if ((length == 1 && p[0] == '.') || (length == 2 && p[0] == '.' && p[1] == '.')) append(buf, size, &n, "__", 2);
+        else append(buf, size, &n, p, length);
+        append(buf, size, &n, "/", 1);
+        p += length;
+    }
+    char code[16], id[8];
+    size_t length = 0;
+    for(int i=0; i < 4; i++) {
+        unsigned char c = (type >> (24 - 8*i)) & 0xFF;
+        if (c <= 0x20 || c >= 0x7F || c == '/' || c == '%' || (i == 0 && c == '.')) length += sprintf(code+length, "%%%02X", c);
+        else code[length++] = c;
+    }
+    append(buf, size, &n, code, length);
+    append(buf, size, &n, id, sprintf(id, "/%hd", ID));
+    return n;
+}
+
+static int write_all (int fd, const void *buf, size_t length) {
+    while (length) {
+        ssize_t r = write(fd, buf, length);
+        if (r == -1 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        buf += r;
+        length -= r;
+    }
+    return 0;
+}
+
+static int copy_range (int in, size_t offset, int out, size_t length) {
+    // written at out's position, falling back to sendfile and then to read/write
+    off_t inOff = (off_t)offset;
+#ifdef __linux__
+    while (length) {
+        ssize_t r = copy_file_range(in, &inOff, out, NULL, length, 0);
+        if (r == -1 && errno == EINTR) continue;
+        if (r <= 0) break;
+        length -= r;
+    }
+    while (length) {
+        ssize_t r = sendfile(out, in, &inOff, length);
+        if (r == -1 && errno == EINTR) continue;
+        if (r <= 0) break;
+        length -= r;
+    }
+#endif
+    char buf[0x10000];
+    while (length) {
+        ssize_t r = pread(in, buf, length < sizeof buf ? length : sizeof buf, inOff);
+        if (r == -1 && errno == EINTR) continue;
+        if (r <= 0 || write_all(out, buf, r)) return -1;
+        inOff += r;
+        length -= r;
+    }
+    return 0;
+}
+
+static void tar_field (char *field, size_t size, uint64_t value) {
+    snprintf(field, size, "%0*llo", (int)size - 1, (unsigned long long)value);
+}
+
+static int tar_header (const char *name, size_t size, time_t mtime, char type, char *block) {
+    // ustar header, long names are split into prefix and name or need a pax header first
+    memset(block, 0, 512);
+    size_t length = strlen(name), split = 0;
+    if (length > 100) {
+        while (split < length && (name[split] != '/' || length - split - 1 > 100)) split++;
+        if (split == length || split > 155) return -1;
+        memcpy(block+345, name, split);
+        name += split + 1;
+    }
+    memcpy(block, name, strlen(name));
+    strcpy(block+100, "0000644");
+    strcpy(block+108, "0000000");
+    strcpy(block+116, "0000000");
+    tar_field(block+124, 12, size);
+    tar_field(block+136, 12, (uint64_t)mtime);
+    block[156] = type;
+    memcpy(block+257, "ustar", 6);
+    memcpy(block+263, "00", 2);
+    
+    unsigned sum = 8 * ' ';
+    for(int i=0; i < 512; i++) sum += (unsigned char)block[i];
+    snprintf(block+148, 8, "%06o", sum);
+    return 0;
+}
+
+static int tar_member (const char *name, size_t size, time_t mtime) {
+    char block[512];
+    if (tar_header(name, size, mtime, '0', block) == 0) return write_all(1, block, 512);
+    
+    // pax record "length path=name\n", the length counts its own digits
+    size_t body = strlen(name) + 7, length = body, digits;
+    do {
+        digits = (size_t)snprintf(NULL, 0, "%zu", length);
+        length = body + digits;
+    } while ((size_t)snprintf(NULL, 0, "%zu", length) != digits);
+    size_t padded = (length + 511) / 512 * 512;
+    char *record = calloc(1, padded + 1);
+    if (record == NULL) return -1;
+    snprintf(record, padded + 1, "%zu path=%s\n", length, name);
+    int err = tar_header("PaxHeader", length, mtime, 'x', block) || write_all(1, block, 512) || write_all(1, record, padded);
+    free(record);
+    
+    // readers without pax get the end of the name
+    if (err || tar_header(name + strlen(name) - 100, size, mtime, '0', block)) return -1;
+    return write_all(1, block, 512);
+}
+
+static int mkdirs (char *path) {
+    // parent directories of path
+    for(char *p = strchr(path+1, '/'); p; p = strchr(p+1, '/')) {
+        *p = '\0';
+        int err = mkdir(path, 0777) && errno != EEXIST;
+        *p = '/';
+        if (err) return -1;
+    }
+    return 0;
+}
+
+static int extract (RFILE *rp, int fd, const char *path, time_t mtime, uint32_t type, const ResAttr *a) {
+    char name[4096];
+    size_t offset, size;
+    void *data = NULL;
+    if (a->flags.fl.compressed) {
+        data = res_read(rp, type, a->ID, NULL, 0, 0, &size, NULL);
+        if (data == NULL) return -1;
+    } else if (res_locate(rp, type, a->ID, &offset, &size)) return -1;
+    
+    int err = 0;
+    if (outDir) {
+        size_t n = (size_t)snprintf(name, sizeof name, "%s/", outDir);
+        if (n >= sizeof name || member_name(name+n, sizeof name - n, path, type, a->ID) >= sizeof name - n) err = ENAMETOOLONG;
+        int out = err ? -1 : open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (out == -1 && !err && errno == ENOENT && mkdirs(name) == 0) out = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (out == -1 && !err) err = errno;
+        if (out != -1) {
+            if (data ? write_all(out, data, size) : copy_range(fd, offset, out, size)) err = errno ? errno : EIO;
+            if (close(out) && !err) err = errno;
+        }
+    } else {
+        // whole members at a time, the data goes straight from the fork to the stream
+        static const char zeros[512];
+        if (member_name(name, sizeof name, path, type, a->ID) >= sizeof name) err = ENAMETOOLONG;
+        pthread_mutex_lock(&outLock);
+        if (!err && tarBroken) err = ECANCELED;
+        else if (!err) {
+            errno = 0;
+            if (tar_member(name, size, mtime) || (data ? write_all(1, data, size) : copy_range(fd, offset, 1, size)) ||
+                write_all(1, zeros, (512 - size % 512) % 512)) {
+                // the stream may stop short of what a header declared, nothing after it would line up
+                err = errno ? errno : EIO;
+                tarBroken = 1;
+            }
+        }
+        pthread_mutex_unlock(&outLock);
+    }
+    free(data);
+    if (err) errno = err;
+    return err ? -1 : 0;
+}
+
+static void extract_file (const char *path) {
+    // bare forks, or forks inside AppleDouble and MacBinary files
+    RFILE *rp = res_open_container(path, mode);
+    if (rp == NULL) {
+        fail(path, NULL, errno);
+        return;
+    }
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st)) {
+        fail(path, NULL, errno);
+        if (fd != -1) close(fd);
+        res_close(rp);
+        return;
+    }
+    
+    size_t count = res_typecount(rp);
+    uint32_t *fileTypes = res_types(rp, NULL, 0, 0, NULL, NULL);
+    for(size_t i=0; fileTypes && i < count; i++) {
+        int wanted = numTypes == 0;
+        for(size_t j=0; j < numTypes && !wanted; j++) wanted = types[j] == fileTypes[i];
+        if (!wanted) continue;
+        size_t numRes;
+        ResAttr *list = res_list(rp, fileTypes[i], NULL, 0, 0, &numRes, NULL);
+        for(size_t k=0; list && k < numRes; k++) {
+            wanted = numIDs == 0;
+            for(size_t j=0; j < numIDs && !wanted; j++) wanted = ids[j] == list[k].ID;
+            if (!wanted) continue;
+            if (extract(rp, fd, path, st.st_mtime, fileTypes[i], &list[k])) {
+                char what[16];
+                snprintf(what, sizeof what, "%c%c%c%c %hd", TYPECHARS(fileTypes[i]), list[k].ID);
+                fail(path, what, errno);
+            }
+        }
+        free(list);
+    }
+    free(fileTypes);
+    close(fd);
+    res_close(rp);
+}
+
+static void* worker (void *arg) {
+    for(;;) {
+        size_t i = __atomic_fetch_add(&nextPath, 1, __ATOMIC_RELAXED);
+        if (i >= numPaths) break;
+        extract_file(paths[i]);
+    }
+    return NULL;
+}
+
+static int add_type (const char *code) {
+    if (strlen(code) != 4) return -1;
+    uint32_t *t = realloc(types, (numTypes+1) * sizeof(uint32_t));
+    if (t == NULL) return -1;
+    types = t;
+    types[numTypes++] = (uint32_t)(unsigned char)code[0] << 24 | (unsigned char)code[1] << 16 | (unsigned char)code[2] << 8 | (unsigned char)code[3];
+    return 0;
+}
+
+static int add_id (const char *id) {
+    char *end;
+    long value = strtol(id, &end, 10);
+    if (*id == '\0' || *end || value < INT16_MIN || value > INT16_MAX) return -1;
+    int16_t *p = realloc(ids, (numIDs+1) * sizeof(int16_t));
+    if (p == NULL) return -1;
+    ids = p;
+    ids[numIDs++] = (int16_t)value;
+    return 0;
+}
+
+int main (int argc, char **argv) {
+    int threads = 0, c;
+    while ((c = getopt(argc, argv, "j:t:i:o:m")) != -1) {
+        int err = 0;
+        switch (c) {
+            case 'j': threads = atoi(optarg); break;
+            case 't': err = add_type(optarg); break;
+            case 'i': err = add_id(optarg); break;
+            case 'o': outDir = optarg; break;
+            case 'm': mode |= RES_MODE_MMAP; break;
+            default: err = -1;
+        }
+        if (err) {
+            fprintf(stderr, "usage: resextract [-j threads] [-t type]... [-i ID]... [-o dir] [-m] path...\n");
+            return 2;
+        }
+    }
+    if (outDir == NULL && isatty(1)) {
+        fprintf(stderr, "resextract: not writing a tar stream to a terminal, use -o dir\n");
+        return 2;
+    }
+    // only the wanted types get parsed
+    if (numTypes) mode |= RES_MODE_LAZY;
+    
+    // directories are searched for files
+    for(int i=optind; i < argc; i++) {
+        if (nftw(argv[i], add_path, 64, FTW_PHYS)) fail(argv[i], NULL, errno);
+    }
+    
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0) threads = 1;
+    if ((size_t)threads > numPaths) threads = numPaths ? (int)numPaths : 1;
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    int started = 1;
+    for(int i=1; tids && i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, worker, NULL)) break;
+        started++;
+    }
+    worker(NULL);
+    for(int i=1; i < started; i++) pthread_join(tids[i], NULL);
+    free(tids);
+    
+    if (outDir == NULL && !tarBroken) {
+        // end of archive
+        static const char zeros[1024];
+        if (write_all(1, zeros, sizeof zeros)) fail("stdout", NULL, errno);
+    }
+    for(size_t i=0; i < numPaths; i++) free(paths[i]);
+    free(paths);
+    free(types);
+    free(ids);
+    return failed;
+}
@@ -0,0 +1,40 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// file lists shared by the command line tools
+
+#include <ftw.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char **paths;
+static size_t numPaths, pathSlots;
+
+// nftw callback collecting regular files into paths
+static int add_path (const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    if (flag != FTW_F) return 0;
+    if (numPaths == pathSlots) {
+        pathSlots = pathSlots ? 2 * pathSlots : 256;
+        char **p = realloc(paths, pathSlots * sizeof(char*));
+        if (p == NULL) return -1;
+        paths = p;
+    }
+    if ((paths[numPaths] = strdup(path)) == NULL) return -1;
+    numPaths++;
+    return 0;
+}
@@ -0,0 +1,230 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// searching resource data for byte patterns
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "res.h"
+#include "libres_internal.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// one search over a file
+struct RmSearch {
+    RFILE           *rp;
+    const uint8_t   *pattern;
+    size_t          length;
+    res_hit_func    func;
+    void            *ctx;
+    uint8_t         *window;        // data read ahead of the resources being searched
+    size_t          windowStart;
+    size_t          windowLength;
+    uint8_t         *out;           // pieces of large or compressed resources
+};
+
+static int res_search_ref (struct RmSearch *s, struct RmSweep *sw, struct RmSweep *next, struct RmSweep *end);
+static int res_search_pieces (struct RmSearch *s, struct RmSweep *sw, struct RmDcmp *d, size_t offset);
+static int res_search_range (struct RmSearch *s, struct RmSweep *sw, const uint8_t *data, size_t size, size_t base);
+static int res_search_fail (struct RmSearch *s, struct RmSweep *sw, size_t offset, int error);
+static const uint8_t* res_search_scan (const uint8_t *data, size_t size, const uint8_t *pattern, size_t length);
+
+int res_search_data (RFILE *rp, const void *pattern, size_t length, const uint32_t *types, size_t numTypes, res_hit_func func, void *ctx) {
+    if (rp == NULL) eret(EBADF, -1);
+    if (pattern == NULL || length == 0 || length > kSearchDataChunk / 2 || func == NULL) eret(EINVAL, -1);
+
+    // resources to search, in file order
+    size_t count = 0;
+    for(size_t i=0; i < rp->numTypes; i++) {
+        int wanted = types == NULL || numTypes == 0;
+        for(size_t j=0; j < numTypes && !wanted; j++) wanted = types[j] == rp->types[i].type;
+        if (wanted) count += rp->types[i].count;
+    }
+    struct RmSweep *sweep = res_file_malloc(rp, count * sizeof(struct RmSweep) + 1);
+    if (sweep == NULL) eret(ENOMEM, -1);
+    size_t n = 0;
+    for(size_t i=0; i < rp->numTypes; i++) {
+        int wanted = types == NULL || numTypes == 0;
+        for(size_t j=0; j < numTypes && !wanted; j++) wanted = types[j] == rp->types[i].type;
+        if (!wanted) continue;
+        struct RmType *t = res_type_load(rp, &rp->types[i]);
+        if (t == NULL) {
+            res_free(sweep);
+            return -1;
+        }
+        for(size_t j=0; j < t->count; j++, n++) {
+            sweep[n].type = t->type;
+            sweep[n].ref = &t->list[j];
+        }
+    }
+    qsort(sweep, n, sizeof(struct RmSweep), (int(*)(const void*, const void*))res_sweep_compar);
+
+    struct RmSearch s;
+    bzero(&s, sizeof s);
+    s.rp = rp;
+    s.pattern = pattern;
+    s.length = length;
+    s.func = func;
+    s.ctx = ctx;
+    int r = 0;
+    for(size_t i=0; i < n && r == 0; i++) r = res_search_ref(&s, &sweep[i], &sweep[i+1], &sweep[n]);
+
+    int err = errno;
+    res_free(sweep);
+    if (s.window) res_free(s.window);
+    if (s.out) res_free(s.out);
+    errno = err;
+    return r;
+}
+
+#if 0
+#pragma mark -
+#pragma mark Private Functions
+#endif
+
+static int res_search_ref (struct RmSearch *s, struct RmSweep *sw, struct RmSweep *next, struct RmSweep *end) {
+    // resources that can't be read or decompressed are reported to the function
+    RFILE *rp = s->rp;
+    struct RmResRef *ref = sw->ref;
+    size_t rstart = ref->offset + rp->dataOffset + 4;
+    if (rstart + ref->psize > rp->size) return res_search_fail(s, sw, 0, EFAULT);
+
+    // the data as stored, in place or from the window
+    const uint8_t *data = NULL;
+    if (rp->buf) data = rp->buf + rstart;
+    else if (ref->psize <= kSearchDataChunk) {
+        if (rstart < s->windowStart || rstart + ref->psize > s->windowStart + s->windowLength) {
+            // read as far ahead as the next resources are close enough
+            size_t wend = rstart + ref->psize;
+            for(; next < end; next++) {
+                size_t nstart = next->ref->offset + rp->dataOffset + 4;
+                if (nstart + next->ref->psize > rp->size) continue;
+                if (nstart > wend + kSearchDataMaxGap || nstart + next->ref->psize - rstart > kSearchDataChunk) break;
+                if (nstart + next->ref->psize > wend) wend = nstart + next->ref->psize;
+            }
+            if (s->window == NULL) s->window = res_file_malloc(rp, kSearchDataChunk);
+            if (s->window == NULL) eret(ENOMEM, -1);
+            s->windowLength = 0;
+            if (res_bread(rp, s->window, rstart, wend - rstart) == NULL) return res_search_fail(s, sw, 0, errno);
+            s->windowStart = rstart;
+            s->windowLength = wend - rstart;
+        }
+        data = s->window + (rstart - s->windowStart);
+    }
+
+    if (!ref->flags.fl.compressed) {
+        if (data) return res_search_range(s, sw, data, ref->psize, 0);
+        return res_search_pieces(s, sw, NULL, rstart);
+    }
+
+    // decompressors need all of their input
+    void *tmp = NULL;
+    if (data == NULL) {
+        data = tmp = res_file_malloc(rp, ref->psize);
+        if (tmp == NULL) eret(ENOMEM, -1);
+        if (res_bread(rp, tmp, rstart, ref->psize) == NULL) {
+            int err = errno;
+            res_free(tmp);
+            return res_search_fail(s, sw, 0, err);
+        }
+    }
+    struct RmDcmp d;
+    int r;
+    if (res_dcmp_init(&d, data, ref->psize) == 0) {
+        d.rp = rp;
+        r = res_search_pieces(s, sw, &d, 0);
+    } else r = res_search_fail(s, sw, 0, errno);
+    res_dcmp_free(&d);
+    if (tmp) res_free(tmp);
+    return r;
+}
+
+static int res_search_pieces (struct RmSearch *s, struct RmSweep *sw, struct RmDcmp *d, size_t offset) {
+    // decompress or read a piece at a time, keeping the end of each one for matches across pieces
+    if (s->out == NULL) s->out = res_file_malloc(s->rp, kSearchDataChunk);
+    if (s->out == NULL) eret(ENOMEM, -1);
+    size_t size = d ? d->outLength : sw->ref->psize;
+    size_t pos = 0, keep = 0;
+    for(;;) {
+        size_t want = kSearchDataChunk - keep;
+        if (want > size - (pos + keep)) want = size - (pos + keep);
+        size_t from = pos + keep;
+        if (d && res_dcmp_run(d, s->out + keep, from, from + want)) return res_search_fail(s, sw, from, errno);
+        if (!d && res_bread(s->rp, s->out + keep, offset + from, want) == NULL) return res_search_fail(s, sw, from, errno);
+        size_t have = keep + want;
+        int r = res_search_range(s, sw, s->out, have, pos);
+        if (r || pos + have == size) return r;
+        keep = have < s->length - 1 ? have : s->length - 1;
+        memmove(s->out, s->out + have - keep, keep);
+        pos += have - keep;
+    }
+}
+
+static int res_search_range (struct RmSearch *s, struct RmSweep *sw, const uint8_t *data, size_t size, size_t base) {
+    ResHit hit;
+    hit.type = sw->type;
+    hit.ID = sw->ref->ID;
+    hit.error = 0;
+    for(const uint8_t *p = data; (p = res_search_scan(p, size - (p - data), s->pattern, s->length)); p++) {
+        hit.offset = base + (p - data);
+        int r = s->func(s->ctx, &hit);
+        if (r) return r;
+    }
+    return 0;
+}
+
+static int res_search_fail (struct RmSearch *s, struct RmSweep *sw, size_t offset, int error) {
+    ResHit hit;
+    hit.type = sw->type;
+    hit.ID = sw->ref->ID;
+    hit.offset = offset;
+    hit.error = error ? error : EIO;
+    return s->func(s->ctx, &hit);
+}
+
+static const uint8_t* res_search_scan (const uint8_t *data, size_t size, const uint8_t *pattern, size_t length) {
+    if (length > size) return NULL;
+    if (length == 1) return memchr(data, pattern[0], size);
+    size_t last = size - length; // last place a match can start
+    size_t i = 0;
+#ifdef __SSE2__
+    // 16 places at a time, where both the first and last bytes match
+    const __m128i first = _mm_set1_epi8((char)pattern[0]);
+    const __m128i final = _mm_set1_epi8((char)pattern[length-1]);
+    for(; i + 16 <= last + 1; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(data + i + length - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, final)));
+        for(; mask; mask &= mask - 1) {
+            const uint8_t *p = data + i + __builtin_ctz(mask);
+            if (memcmp(p + 1, pattern + 1, length - 2) == 0) return p;
+        }
+    }
+#endif
+    // the rest, or everything without SIMD
+    while (i <= last) {
+        const uint8_t *p = memchr(data + i, pattern[0], last - i + 1);
+        if (p == NULL) return NULL;
+        if (memcmp(p + 1, pattern + 1, length - 1) == 0) return p;
+        i = (size_t)(p - data) + 1;
+    }
+    return NULL;
+}
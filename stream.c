@@ -0,0 +1,148 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// reading resources in pieces
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "res.h"
+#include "libres_internal.h"
+
+static int res_stream_rewind (RSTREAM *sp);
+
+RSTREAM* res_stream_open (RFILE *rp, uint32_t type, int16_t ID) {
+    struct RmType *t = res_type_find(rp, type);
+    if (t == NULL) efail(ENOENT);
+    struct RmResRef *ref = res_ref_find(rp, t, ID);
+    if (ref == NULL) efail(ENOENT);
+    size_t offset = ref->offset + rp->dataOffset + 4;
+    if (offset + ref->psize > rp->size) efail(EFAULT);
+    
+    RSTREAM *sp = res_file_malloc(rp, sizeof(RSTREAM));
+    if (sp == NULL) efail(ENOMEM);
+    bzero(sp, sizeof(RSTREAM));
+    sp->rp = rp;
+    sp->offset = offset;
+    sp->psize = ref->psize;
+    sp->size = ref->size;
+    sp->compressed = ref->flags.fl.compressed;
+    sp->ref = ref;
+    if (!sp->compressed) return sp;
+    
+    // the decompressor needs all of its input
+    if (rp->buf == NULL) {
+        sp->in = res_file_malloc(rp, sp->psize);
+        if (sp->in == NULL) effail(ENOMEM, sp);
+        if (res_bread(rp, sp->in, offset, sp->psize) == NULL) {
+            int err = errno;
+            res_stream_close(sp);
+            efail(err);
+        }
+    }
+    if (res_dcmp_init(&sp->d, sp->in ? sp->in : rp->buf + offset, sp->psize)) {
+        int err = errno;
+        res_stream_close(sp);
+        efail(err);
+    }
+    sp->d.rp = rp;
+    return sp;
+}
+
+void* res_stream_read (RSTREAM *sp, void *buf, size_t size, size_t *read) {
+    if (buf == NULL || size == 0) efail(EINVAL);
+    if (size > sp->size - sp->pos) size = sp->size - sp->pos;
+    if (size == 0) {
+        if (read) *read = 0;
+        return buf;
+    }
+    
+    if (!sp->compressed) {
+        if (res_bread(sp->rp, buf, sp->offset + sp->pos, size) == NULL) return NULL;
+    } else {
+        // decoding only goes forwards, but can start from a checkpoint
+        if (sp->pos < sp->d.st.outPos && res_stream_rewind(sp)) return NULL;
+        res_dcmp_restore(sp->rp, sp->ref, &sp->d, sp->pos);
+        if (res_dcmp_run(&sp->d, buf, sp->pos, sp->pos + size)) return NULL;
+    }
+    sp->pos += size;
+    if (read) *read = size;
+    return buf;
+}
+
+const void* res_stream_next (RSTREAM *sp, size_t *size) {
+    size_t len = sp->size - sp->pos;
+    if (len > kStreamChunkSize) len = kStreamChunkSize;
+    
+    // straight from memory
+    if (sp->rp->buf && !sp->compressed) {
+        const void *data = sp->rp->buf + sp->offset + sp->pos;
+        sp->pos += len;
+        if (size) *size = len;
+        return data;
+    }
+    
+    if (sp->chunk == NULL) sp->chunk = res_file_malloc(sp->rp, kStreamChunkSize);
+    if (sp->chunk == NULL) efail(ENOMEM);
+    return res_stream_read(sp, sp->chunk, kStreamChunkSize, size);
+}
+
+int res_stream_seek (RSTREAM *sp, long offset, int whence) {
+    long base;
+    switch (whence) {
+        case SEEK_SET: base = 0; break;
+        case SEEK_CUR: base = (long)sp->pos; break;
+        case SEEK_END: base = (long)sp->size; break;
+        default: eret(EINVAL, -1);
+    }
+    if (offset < -base || base + offset > (long)sp->size) eret(EINVAL, -1);
+    sp->pos = base + offset;
+    return 0;
+}
+
+size_t res_stream_tell (RSTREAM *sp) {
+    return sp->pos;
+}
+
+size_t res_stream_size (RSTREAM *sp) {
+    return sp->size;
+}
+
+int res_stream_close (RSTREAM *sp) {
+    if (sp == NULL) eret(EBADF, EOF);
+    if (sp->compressed) res_dcmp_save(sp->rp, sp->ref, &sp->d);
+    res_dcmp_free(&sp->d);
+    if (sp->in) res_free(sp->in);
+    if (sp->chunk) res_free(sp->chunk);
+    res_free(sp);
+    return 0;
+}
+
+#if 0
+#pragma mark -
+#pragma mark Private Functions
+#endif
+
+static int res_stream_rewind (RSTREAM *sp) {
+    res_dcmp_save(sp->rp, sp->ref, &sp->d);
+    res_dcmp_free(&sp->d);
+    if (res_dcmp_init(&sp->d, sp->in ? sp->in : sp->rp->buf + sp->offset, sp->psize)) return -1;
+    sp->d.rp = sp->rp;
+    return 0;
+}
@@ -0,0 +1,195 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// asynchronous reads match res_read on every backend, through callbacks and polling
+
+#include "test.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+
+#define kResources  300
+#define kSize       3000
+#define kCompressed kResources  // ID of a 'dcmp' 2 resource of type kTestType
+
+static char path[64];
+
+// test_fork's resources and a compressed one, written to path
+static uint8_t* test_async_fork (size_t *forkSize) {
+    static const uint8_t compressed[] = {
+        0xA8, 0x9F, 0x65, 0x72, 0x00, 0x12, 0x09, 0x01, 0x00, 0x00, 0x00, 0x06,
+        0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x04,
+    };
+    RWRITER *w = res_writer_new();
+    RFlags flags = {.b = 0};
+    uint8_t data[kSize];
+    for(int16_t ID=0; ID < kResources; ID++) {
+        for(size_t i=0; i < kSize; i++) data[i] = test_byte(ID, i);
+        CHECK(res_writer_add(w, kTestType + ID % 4, ID, NULL, flags, data, kSize, 1) == 0);
+    }
+    flags.fl.compressed = 1;
+    CHECK(res_writer_add(w, kTestType, kCompressed, NULL, flags, compressed, sizeof compressed, 1) == 0);
+    uint8_t *fork = res_writer_write_mem(w, forkSize);
+    res_writer_close(w);
+    int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    CHECK(fd != -1 && write(fd, fork, *forkSize) == (ssize_t)*forkSize);
+    close(fd);
+    return fork;
+}
+
+static uint32_t test_type (int16_t ID) {
+    return ID == kCompressed ? kTestType : kTestType + ID % 4;
+}
+
+// a request somewhere in a resource, into a given buffer or a new one
+static void test_request (ResAsyncReq *req, int16_t ID, uint8_t *buf, res_async_func func, void *ctx) {
+    memset(req, 0, sizeof *req);
+    req->type = test_type(ID);
+    req->ID = ID;
+    req->start = ID == kCompressed ? 2 : (size_t)(ID % 7) * 13;
+    req->size = ID % 3 ? (size_t)(ID * 37) % 2000 + 1 : 0;
+    if (buf && req->size) req->buf = buf;
+    req->func = func;
+    req->ctx = ctx;
+}
+
+// whether a finished request read what res_read does
+static int test_matches (RFILE *rp, const ResAsyncReq *req) {
+    size_t read = 0;
+    uint8_t *data = res_read(rp, req->type, req->ID, NULL, req->start, req->size, &read, NULL);
+    int ok = data && req->error == 0 && req->size == read && memcmp(req->buf, data, read) == 0;
+    free(data);
+    return ok;
+}
+
+struct Callbacks {
+    RFILE   *rp;
+    int     done;
+    int     wrong;
+};
+
+static void test_callback (void *ctx, ResAsyncReq *req) {
+    struct Callbacks *cb = ctx;
+    if (!test_matches(cb->rp, req)) __atomic_add_fetch(&cb->wrong, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&cb->done, 1, __ATOMIC_RELEASE);
+}
+
+static void test_queue (RFILE *rp, const char *name) {
+    RQUEUE *q = res_queue_open(3);
+    CHECK(q != NULL);
+    if (q == NULL) return;
+    
+    // nothing pending, nothing done
+    errno = 0;
+    CHECK(res_queue_poll(q, 1) == NULL && errno == ENOENT);
+    errno = 0;
+    CHECK(res_queue_poll(q, 0) == NULL && errno == EAGAIN);
+    
+    // even IDs are polled, odd ones call back; the compressed one and a missing one are polled too
+    static ResAsyncReq reqs[kResources + 2];
+    static uint8_t bufs[kResources + 2][kSize];
+    struct Callbacks cb = {rp, 0, 0};
+    int polled = 0;
+    for(int16_t ID=0; ID < kResources + 2; ID++) {
+        int callback = ID < kResources && ID % 2;
+        test_request(&reqs[ID], ID, ID % 4 < 2 ? bufs[ID] : NULL, callback ? test_callback : NULL, &cb);
+        if (ID == kResources + 1) reqs[ID].type = kTestType + 9;
+        CHECK(res_read_async(q, rp, &reqs[ID]) == 0);
+        polled += !callback;
+    }
+    
+    // wait on the descriptor, then take what's done
+    int missing = 0;
+    for(int got = 0; got < polled;) {
+        struct pollfd pfd = {res_queue_fd(q), POLLIN, 0};
+        CHECK(poll(&pfd, 1, 10000) == 1);
+        ResAsyncReq *req;
+        while ((req = res_queue_poll(q, 0))) {
+            got++;
+            if (req->ID == kResources + 1) {
+                CHECK(req->error == ENOENT && req->size == 0);
+                missing++;
+            } else if (!test_matches(rp, req)) {
+                fprintf(stderr, "%s: %c%c%c%c %d read wrong\n", name, (char)(req->type >> 24), (char)(req->type >> 16), (char)(req->type >> 8), (char)req->type, req->ID);
+                failures++;
+            }
+            if (req->buf != bufs[req->ID]) free(req->buf);
+        }
+        CHECK(errno == EAGAIN || errno == ENOENT);
+    }
+    CHECK(missing == 1);
+    res_queue_close(q);
+    CHECK(cb.done == kResources / 2 && cb.wrong == 0);
+    for(int16_t ID=1; ID < kResources; ID += 2) if (reqs[ID].buf != bufs[ID]) free(reqs[ID].buf);
+}
+
+static void test_truncated (void) {
+    // the file shrinks after opening, reads past its end fail however they're done
+    RFILE *rp = res_open(path, 0);
+    CHECK(rp != NULL);
+    if (rp == NULL) return;
+    CHECK(truncate(path, 1024) == 0);
+    RQUEUE *q = res_queue_open(1);
+    ResAsyncReq req;
+    test_request(&req, kResources - 1, NULL, NULL, NULL);
+    CHECK(res_read_async(q, rp, &req) == 0);
+    CHECK(res_queue_poll(q, 1) == &req);
+    CHECK(req.error != 0 && req.size == 0 && req.buf == NULL);
+    errno = 0;
+    CHECK(res_queue_poll(q, 1) == NULL && errno == ENOENT);
+    res_queue_close(q);
+    res_close(rp);
+}
+
+int main (void) {
+    snprintf(path, sizeof path, "/tmp/libres-async-%ld", (long)getpid());
+    size_t forkSize;
+    uint8_t *fork = test_async_fork(&forkSize);
+    struct TestFile f = {.data = fork, .size = forkSize};
+    
+    RFILE *rp = res_open(path, 0);
+    CHECK(rp != NULL);
+    if (rp) {
+        test_queue(rp, "fd");
+        // cached resources are read the blocking way
+        CHECK(res_cache(rp, 0x100000) == 0);
+        test_queue(rp, "fd cached");
+        res_close(rp);
+    }
+    rp = res_open(path, RES_MODE_MMAP);
+    CHECK(rp != NULL);
+    if (rp) test_queue(rp, "mmap");
+    res_close(rp);
+    rp = res_open_mem(fork, forkSize, 1);
+    CHECK(rp != NULL);
+    if (rp) test_queue(rp, "mem");
+    res_close(rp);
+    rp = res_open_funcs(&f, test_seek, test_read);
+    CHECK(rp != NULL);
+    if (rp) test_queue(rp, "funcs");
+    res_close(rp);
+    rp = res_open_funcs_at(&f, f.size, test_read_at, 0);
+    CHECK(rp != NULL);
+    if (rp) test_queue(rp, "funcs_at");
+    res_close(rp);
+    
+    test_truncated();
+    unlink(path);
+    free(fork);
+    return test_done("async");
+}
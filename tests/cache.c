@@ -0,0 +1,80 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// the cache keeps what fits its budget, and nothing once disabled
+
+#include "test.h"
+
+#define kResources  200
+#define kSize       100
+
+static void test_reads (RFILE *rp) {
+    uint8_t buf[kSize];
+    for(int16_t ID=0; ID < kResources; ID++) {
+        size_t read = 1;
+        void *data = res_read(rp, kTestType + ID % 4, ID, buf, 0, sizeof buf, &read, NULL);
+        CHECK(ID % 2 ? data == buf && read == kSize && test_check_data(ID, buf, read) : data != NULL && read == 0);
+    }
+}
+
+int main (void) {
+    // every other resource is empty
+    RWRITER *w = res_writer_new();
+    RFlags flags = {.b = 0};
+    uint8_t data[kSize];
+    for(int16_t ID=0; ID < kResources; ID++) {
+        for(size_t i=0; i < kSize; i++) data[i] = test_byte(ID, i);
+        CHECK(res_writer_add(w, kTestType + ID % 4, ID, NULL, flags, data, ID % 2 ? kSize : 0, 1) == 0);
+    }
+    size_t forkSize;
+    uint8_t *fork = res_writer_write_mem(w, &forkSize);
+    res_writer_close(w);
+    struct TestFile f = {.data = fork, .size = forkSize};
+    RFILE *rp = res_open_funcs_at(&f, f.size, test_read_at, 0);
+    CHECK(rp != NULL);
+    if (rp == NULL) return test_done("cache");
+    
+    // everything fits
+    ResCacheStats stats;
+    CHECK(res_cache(rp, 0x100000) == 0);
+    test_reads(rp);
+    test_reads(rp);
+    res_cache_stats(rp, &stats);
+    CHECK(stats.misses == kResources && stats.hits == kResources && stats.entries == kResources);
+    
+    // disabled, reads don't touch it at all
+    CHECK(res_cache(rp, 0) == 0);
+    res_cache_stats(rp, &stats);
+    CHECK(stats.entries == 0 && stats.bytes == 0);
+    ResCacheStats before = stats;
+    unsigned long reads = f.reads;
+    test_reads(rp);
+    res_cache_stats(rp, &stats);
+    CHECK(stats.misses == before.misses && stats.hits == before.hits && stats.entries == 0);
+    CHECK(f.reads - reads == kResources / 2);
+    
+    // enabled again, it keeps to its budget
+    CHECK(res_cache(rp, 10 * kSize) == 0);
+    test_reads(rp);
+    res_cache_stats(rp, &stats);
+    CHECK(stats.bytes <= 10 * kSize && stats.entries > 0 && stats.misses > before.misses);
+    
+    res_close(rp);
+    free(fork);
+    return test_done("cache");
+}
@@ -0,0 +1,193 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// forks inside AppleSingle, AppleDouble and MacBinary files, and bare ones
+
+#include "test.h"
+#include <errno.h>
+
+#define kResources  20
+#define kSize       100
+
+static char path[64];
+static uint8_t *fork_;
+static size_t forkSize;
+
+static void test_put16 (uint8_t *p, uint16_t v) {
+    p[0] = v >> 8; p[1] = v & 0xFF;
+}
+
+static void test_put32 (uint8_t *p, uint32_t v) {
+    p[0] = v >> 24; p[1] = (v >> 16) & 0xFF; p[2] = (v >> 8) & 0xFF; p[3] = v & 0xFF;
+}
+
+static size_t test_get32 (const uint8_t *p) {
+    return (size_t)p[0] << 24 | (size_t)p[1] << 16 | (size_t)p[2] << 8 | p[3];
+}
+
+static uint16_t test_crc16 (const uint8_t *data, size_t size) {
+    uint16_t crc = 0;
+    for(size_t i=0; i < size; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for(int b=0; b < 8; b++) crc = crc & 0x8000 ? (uint16_t)(crc << 1 ^ 0x1021) : (uint16_t)(crc << 1);
+    }
+    return crc;
+}
+
+// AppleSingle or AppleDouble with a name entry, then the fork
+static uint8_t* test_apple (uint32_t magic, size_t *size) {
+    *size = 26 + 2 * 12 + 4 + forkSize;
+    uint8_t *file = calloc(1, *size);
+    test_put32(file, magic);
+    test_put32(file+4, 0x00020000);
+    test_put16(file+24, 2);
+    uint8_t *e = file + 26;
+    test_put32(e, 3);
+    test_put32(e+4, 50);
+    test_put32(e+8, 4);
+    memcpy(file+50, "Test", 4);
+    test_put32(e+12, 2);
+    test_put32(e+16, 54);
+    test_put32(e+20, (uint32_t)forkSize);
+    memcpy(file+54, fork_, forkSize);
+    return file;
+}
+
+// MacBinary II with a checksum, or MacBinary I without, and a data fork before the resource fork
+static uint8_t* test_macbinary (int crc, size_t *size) {
+    size_t dataLength = 200, o = 128 + 256;
+    *size = o + forkSize;
+    uint8_t *file = calloc(1, *size);
+    file[1] = 4;
+    memcpy(file+2, "Test", 4);
+    memcpy(file+65, "TEXTttxt", 8);
+    test_put32(file+83, (uint32_t)dataLength);
+    test_put32(file+87, (uint32_t)forkSize);
+    if (crc) {
+        file[122] = 129;
+        file[123] = 129;
+        test_put16(file+124, test_crc16(file, 124));
+    }
+    memset(file+128, 'd', dataLength);
+    memcpy(file+o, fork_, forkSize);
+    return file;
+}
+
+// a bare fork with its data 64K in, so its first bytes look like a MacBinary I header
+static uint8_t* test_far_fork (size_t *size) {
+    size_t dataOffset = test_get32(fork_), mapOffset = test_get32(fork_+4);
+    size_t dataLength = test_get32(fork_+8), mapLength = test_get32(fork_+12);
+    size_t newData = 0x10000;
+    *size = newData + dataLength + mapLength;
+    uint8_t *file = calloc(1, *size);
+    test_put32(file, (uint32_t)newData);
+    test_put32(file+4, (uint32_t)(newData + dataLength));
+    test_put32(file+8, (uint32_t)dataLength);
+    test_put32(file+12, (uint32_t)mapLength);
+    memcpy(file + newData, fork_ + dataOffset, dataLength);
+    memcpy(file + newData + dataLength, fork_ + mapOffset, mapLength);
+    memcpy(file + newData + dataLength, file, 16);
+    return file;
+}
+
+static void test_fork_ok (RFILE *rp, const char *name) {
+    CHECK(rp != NULL);
+    if (rp == NULL) {
+        fprintf(stderr, "%s: %s\n", name, strerror(errno));
+        return;
+    }
+    size_t count = 0;
+    for(uint32_t t=0; t < 4; t++) count += res_count(rp, kTestType + t);
+    CHECK(count == kResources);
+    uint8_t buf[kSize];
+    size_t read = 0;
+    CHECK(res_read(rp, kTestType + 3, 7, buf, 0, sizeof buf, &read, NULL) == buf);
+    CHECK(read == kSize && test_check_data(7, buf, read));
+    res_close(rp);
+}
+
+// opened from a file, mapped, and from memory copied or taken over
+static void test_open (const uint8_t *file, size_t size, const char *name) {
+    int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    CHECK(fd != -1 && write(fd, file, size) == (ssize_t)size);
+    close(fd);
+    test_fork_ok(res_open_container(path, 0), name);
+    test_fork_ok(res_open_container(path, RES_MODE_MMAP), name);
+    test_fork_ok(res_open_container_mem((void*)file, size, 1, 0), name);
+    uint8_t *copy = malloc(size);
+    memcpy(copy, file, size);
+    test_fork_ok(res_open_container_mem(copy, size, 0, RES_MODE_LAZY), name);
+}
+
+// a container that must not open, from a file and from memory
+static void test_bad (const uint8_t *file, size_t size, int error) {
+    int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    CHECK(fd != -1 && write(fd, file, size) == (ssize_t)size);
+    close(fd);
+    errno = 0;
+    RFILE *rp = res_open_container(path, 0);
+    CHECK(rp == NULL && (error == 0 || errno == error));
+    if (rp) res_close(rp);
+    errno = 0;
+    rp = res_open_container_mem((void*)file, size, 1, 0);
+    CHECK(rp == NULL && (error == 0 || errno == error));
+    if (rp) res_close(rp);
+}
+
+int main (void) {
+    snprintf(path, sizeof path, "/tmp/libres-container-%ld", (long)getpid());
+    fork_ = test_fork(kResources, kSize, &forkSize);
+    size_t size;
+    uint8_t *file;
+    
+    test_open(fork_, forkSize, "bare");
+    file = test_far_fork(&size);
+    test_open(file, size, "bare, data 64K in");
+    free(file);
+    file = test_apple(0x00051600, &size);
+    test_open(file, size, "AppleSingle");
+    free(file);
+    file = test_apple(0x00051607, &size);
+    test_open(file, size, "AppleDouble");
+    
+    // entries past the end of the file, past the header, or missing
+    test_bad(file, 20, EINVAL);
+    test_bad(file, size - 1, EINVAL);
+    test_put16(file+24, 400);
+    test_bad(file, size, EINVAL);
+    test_put16(file+24, 2);
+    test_put32(file+26+16, 0xFFFFFFF0);
+    test_bad(file, size, EINVAL);
+    test_put32(file+26+16, 54);
+    test_put32(file+26+12, 1);
+    test_bad(file, size, ENOENT);
+    free(file);
+    
+    file = test_macbinary(1, &size);
+    test_open(file, size, "MacBinary II");
+    // a resource fork past the end isn't MacBinary, nor a fork
+    test_bad(file, size - 1, 0);
+    free(file);
+    file = test_macbinary(0, &size);
+    test_open(file, size, "MacBinary I");
+    free(file);
+    
+    unlink(path);
+    free(fork_);
+    return test_done("container");
+}
@@ -0,0 +1,412 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// 'dcmp' 0, 1 and 2 decode fixed vectors, whole and in windows
+
+#include "test.h"
+#include <errno.h>
+#include <pthread.h>
+
+#define kSavedMax   16      // resources keeping checkpoints, kDcmpSavedMax
+#define kInterval   4096
+#define kWindow     8192
+
+// literals (remembered or not), short backreferences, table words, byte and word runs,
+// word and long deltas, then 39 remembered words to reach the two longer backreference forms
+static const uint8_t dcmp0Body[] = {
+    0x12, 0x41, 0x42, 0x43, 0x44, 0x01, 0x45, 0x46, 0x23, 0x4B, 0x4C, 0xFD, 0x10, 0x03, 0x47, 0x48,
+    0x49, 0x4A, 0x4B, 0x4C, 0x24, 0xFE, 0x02, 0x78, 0x04, 0xFE, 0x03, 0xC1, 0x23, 0x02, 0xFE, 0x04,
+    0x10, 0x03, 0x01, 0xFF, 0x05, 0xFE, 0x06, 0xFF, 0x00, 0x01, 0x00, 0x00, 0x02, 0x05, 0x80, 0x00,
+    0x11, 0x32, 0x02, 0x11, 0x33, 0x03, 0x11, 0x34, 0x04, 0x11, 0x35, 0x05, 0x11, 0x36, 0x06, 0x11,
+    0x37, 0x07, 0x11, 0x38, 0x08, 0x11, 0x39, 0x09, 0x11, 0x3A, 0x0A, 0x11, 0x3B, 0x0B, 0x11, 0x3C,
+    0x0C, 0x11, 0x3D, 0x0D, 0x11, 0x3E, 0x0E, 0x11, 0x3F, 0x0F, 0x11, 0x40, 0x10, 0x11, 0x41, 0x11,
+    0x11, 0x42, 0x12, 0x11, 0x43, 0x13, 0x11, 0x44, 0x14, 0x11, 0x45, 0x15, 0x11, 0x46, 0x16, 0x11,
+    0x47, 0x17, 0x11, 0x48, 0x18, 0x11, 0x49, 0x19, 0x11, 0x4A, 0x1A, 0x11, 0x4B, 0x1B, 0x11, 0x4C,
+    0x1C, 0x11, 0x4D, 0x1D, 0x11, 0x4E, 0x1E, 0x11, 0x4F, 0x1F, 0x11, 0x50, 0x20, 0x11, 0x51, 0x21,
+    0x11, 0x52, 0x22, 0x11, 0x53, 0x23, 0x11, 0x54, 0x24, 0x11, 0x55, 0x25, 0x11, 0x56, 0x26, 0x11,
+    0x57, 0x27, 0x11, 0x30, 0x28, 0x4A, 0x20, 0x00, 0x22, 0x00, 0x00,
+};
+static const uint8_t dcmp0Out[] = {
+    0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x41, 0x42, 0x43, 0x44, 0x00, 0x00, 0x4E, 0xBA, 0x48, 0x41,
+    0x47, 0x48, 0x49, 0x4A, 0x4B, 0x4C, 0x47, 0x48, 0x49, 0x4A, 0x4B, 0x4C, 0x78, 0x78, 0x78, 0x78,
+    0x78, 0x01, 0x23, 0x01, 0x23, 0x01, 0x23, 0x00, 0x10, 0x00, 0x11, 0x00, 0x10, 0x00, 0x15, 0x00,
+    0x01, 0x00, 0x00, 0x00, 0x01, 0x00, 0x05, 0x00, 0x00, 0xC0, 0x05, 0x32, 0x02, 0x33, 0x03, 0x34,
+    0x04, 0x35, 0x05, 0x36, 0x06, 0x37, 0x07, 0x38, 0x08, 0x39, 0x09, 0x3A, 0x0A, 0x3B, 0x0B, 0x3C,
+    0x0C, 0x3D, 0x0D, 0x3E, 0x0E, 0x3F, 0x0F, 0x40, 0x10, 0x41, 0x11, 0x42, 0x12, 0x43, 0x13, 0x44,
+    0x14, 0x45, 0x15, 0x46, 0x16, 0x47, 0x17, 0x48, 0x18, 0x49, 0x19, 0x4A, 0x1A, 0x4B, 0x1B, 0x4C,
+    0x1C, 0x4D, 0x1D, 0x4E, 0x1E, 0x4F, 0x1F, 0x50, 0x20, 0x51, 0x21, 0x52, 0x22, 0x53, 0x23, 0x54,
+    0x24, 0x55, 0x25, 0x56, 0x26, 0x57, 0x27, 0x30, 0x28, 0x57, 0x27, 0x30, 0x28, 0x30, 0x28,
+};
+// literals (short and long, remembered or not), backreferences, table words, a byte run,
+// then 175 remembered bytes to reach the extended backreference
+static const uint8_t dcmp1Body[] = {
+    0x13, 0x61, 0x62, 0x63, 0x64, 0x02, 0x78, 0x79, 0x7A, 0x20, 0xD1, 0x05, 0x68, 0x65, 0x6C, 0x6C,
+    0x6F, 0xD0, 0x02, 0x21, 0x21, 0x21, 0xD5, 0xD6, 0xD9, 0xDD, 0xFE, 0x02, 0x2A, 0x06, 0x10, 0x02,
+    0x10, 0x03, 0x10, 0x04, 0x10, 0x05, 0x10, 0x06, 0x10, 0x07, 0x10, 0x08, 0x10, 0x09, 0x10, 0x0A,
+    0x10, 0x0B, 0x10, 0x0C, 0x10, 0x0D, 0x10, 0x0E, 0x10, 0x0F, 0x10, 0x10, 0x10, 0x11, 0x10, 0x12,
+    0x10, 0x13, 0x10, 0x14, 0x10, 0x15, 0x10, 0x16, 0x10, 0x17, 0x10, 0x18, 0x10, 0x19, 0x10, 0x1A,
+    0x10, 0x1B, 0x10, 0x1C, 0x10, 0x1D, 0x10, 0x1E, 0x10, 0x1F, 0x10, 0x20, 0x10, 0x21, 0x10, 0x22,
+    0x10, 0x23, 0x10, 0x24, 0x10, 0x25, 0x10, 0x26, 0x10, 0x27, 0x10, 0x28, 0x10, 0x29, 0x10, 0x2A,
+    0x10, 0x2B, 0x10, 0x2C, 0x10, 0x2D, 0x10, 0x2E, 0x10, 0x2F, 0x10, 0x30, 0x10, 0x31, 0x10, 0x32,
+    0x10, 0x33, 0x10, 0x34, 0x10, 0x35, 0x10, 0x36, 0x10, 0x37, 0x10, 0x38, 0x10, 0x39, 0x10, 0x3A,
+    0x10, 0x3B, 0x10, 0x3C, 0x10, 0x3D, 0x10, 0x3E, 0x10, 0x3F, 0x10, 0x40, 0x10, 0x41, 0x10, 0x42,
+    0x10, 0x43, 0x10, 0x44, 0x10, 0x45, 0x10, 0x46, 0x10, 0x47, 0x10, 0x48, 0x10, 0x49, 0x10, 0x4A,
+    0x10, 0x4B, 0x10, 0x4C, 0x10, 0x4D, 0x10, 0x4E, 0x10, 0x4F, 0x10, 0x50, 0x10, 0x51, 0x10, 0x52,
+    0x10, 0x53, 0x10, 0x54, 0x10, 0x55, 0x10, 0x56, 0x10, 0x57, 0x10, 0x58, 0x10, 0x59, 0x10, 0x5A,
+    0x10, 0x5B, 0x10, 0x5C, 0x10, 0x5D, 0x10, 0x5E, 0x10, 0x5F, 0x10, 0x60, 0x10, 0x61, 0x10, 0x62,
+    0x10, 0x63, 0x10, 0x64, 0x10, 0x65, 0x10, 0x66, 0x10, 0x67, 0x10, 0x68, 0x10, 0x69, 0x10, 0x6A,
+    0x10, 0x6B, 0x10, 0x6C, 0x10, 0x6D, 0x10, 0x6E, 0x10, 0x6F, 0x10, 0x70, 0x10, 0x71, 0x10, 0x72,
+    0x10, 0x73, 0x10, 0x74, 0x10, 0x75, 0x10, 0x76, 0x10, 0x77, 0x10, 0x78, 0x10, 0x79, 0x10, 0x7A,
+    0x10, 0x7B, 0x10, 0x7C, 0x10, 0x7D, 0x10, 0x7E, 0x10, 0x7F, 0x10, 0x80, 0x10, 0x81, 0x10, 0x82,
+    0x10, 0x83, 0x10, 0x84, 0x10, 0x85, 0x10, 0x86, 0x10, 0x87, 0x10, 0x88, 0x10, 0x89, 0x10, 0x8A,
+    0x10, 0x8B, 0x10, 0x8C, 0x10, 0x8D, 0x10, 0x8E, 0x10, 0x8F, 0x10, 0x90, 0x10, 0x91, 0x10, 0x92,
+    0x10, 0x93, 0x10, 0x94, 0x10, 0x95, 0x10, 0x96, 0x10, 0x97, 0x10, 0x98, 0x10, 0x99, 0x10, 0x9A,
+    0x10, 0x9B, 0x10, 0x9C, 0x10, 0x9D, 0x10, 0x9E, 0x10, 0x9F, 0x10, 0xA0, 0x10, 0xA1, 0x10, 0xA2,
+    0x10, 0xA3, 0x10, 0xA4, 0x10, 0xA5, 0x10, 0xA6, 0x10, 0xA7, 0x10, 0xA8, 0x10, 0xA9, 0x10, 0xAA,
+    0x10, 0xAB, 0x10, 0xAC, 0x10, 0xAD, 0x10, 0xAE, 0x10, 0xAF, 0x10, 0xB0, 0xCF, 0xD2, 0x00,
+};
+static const uint8_t dcmp1Out[] = {
+    0x61, 0x62, 0x63, 0x64, 0x78, 0x79, 0x7A, 0x61, 0x62, 0x63, 0x64, 0x68, 0x65, 0x6C, 0x6C, 0x6F,
+    0x21, 0x21, 0x68, 0x65, 0x6C, 0x6C, 0x6F, 0x00, 0x00, 0x00, 0x01, 0x2E, 0x01, 0xFF, 0xFF, 0x2A,
+    0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B,
+    0x0C, 0x0D, 0x0E, 0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x1B,
+    0x1C, 0x1D, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2A, 0x2B,
+    0x2C, 0x2D, 0x2E, 0x2F, 0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B,
+    0x3C, 0x3D, 0x3E, 0x3F, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A, 0x4B,
+    0x4C, 0x4D, 0x4E, 0x4F, 0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x5B,
+    0x5C, 0x5D, 0x5E, 0x5F, 0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A, 0x6B,
+    0x6C, 0x6D, 0x6E, 0x6F, 0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x7B,
+    0x7C, 0x7D, 0x7E, 0x7F, 0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8A, 0x8B,
+    0x8C, 0x8D, 0x8E, 0x8F, 0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0x9B,
+    0x9C, 0x9D, 0x9E, 0x9F, 0xA0, 0xA1, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xAB,
+    0xAC, 0xAD, 0xAE, 0xAF, 0xB0, 0xAF, 0xB0,
+};
+// default table indexes
+static const uint8_t dcmp2Body[] = {
+    0x00, 0x02, 0x04, 0x17, 0xFF,
+};
+static const uint8_t dcmp2Out[] = {
+    0x00, 0x00, 0x4E, 0xBA, 0x4E, 0x75, 0xFF, 0xFF, 0x02, 0x20,
+};
+// tag 0xA0: index, literal, index, five literals
+static const uint8_t dcmp2TagBody[] = {
+    0xA0, 0x02, 0x61, 0x62, 0x17, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A, 0x6B, 0x6C,
+};
+static const uint8_t dcmp2TagOut[] = {
+    0x4E, 0xBA, 0x61, 0x62, 0xFF, 0xFF, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A, 0x6B, 0x6C,
+};
+// custom table of three words
+static const uint8_t dcmp2Table[] = {
+    0x41, 0x41, 0x42, 0x42, 0x43, 0x43,
+};
+// its indexes
+static const uint8_t dcmp2CustomBody[] = {
+    0x00, 0x01, 0x02, 0x02, 0x01, 0x00,
+};
+static const uint8_t dcmp2CustomOut[] = {
+    0x41, 0x41, 0x42, 0x42, 0x43, 0x43, 0x43, 0x43, 0x42, 0x42, 0x41, 0x41,
+};
+// tag 0x40: literal, index, six literals
+static const uint8_t dcmp2CustomTagBody[] = {
+    0x40, 0x78, 0x79, 0x02, 0x7A, 0x7A, 0x7A, 0x7A, 0x7A, 0x7A, 0x7A, 0x7A, 0x7A, 0x7A, 0x7A, 0x7A,
+};
+static const uint8_t dcmp2CustomTagOut[] = {
+    0x78, 0x79, 0x43, 0x43, 0x7A, 0x7A, 0x7A, 0x7A, 0x7A, 0x7A, 0x7A, 0x7A, 0x7A, 0x7A, 0x7A, 0x7A,
+};
+
+// a compressed resource made of a body repeated, and what it decodes to
+struct Vector {
+    const char      *name;
+    int             dcmp;
+    uint8_t         flags;      // 'dcmp' 2 parameters
+    const uint8_t   *table;
+    size_t          tableSize;  // in words
+    const uint8_t   *body;
+    size_t          bodySize;
+    const uint8_t   *out;
+    size_t          outSize;
+};
+
+#define VEC(name, dcmp, flags, table, tableSize, body, out) {name, dcmp, flags, table, tableSize, body, sizeof body, out, sizeof out}
+
+static const struct Vector vectors[] = {
+    VEC("dcmp 0", 0, 0, NULL, 0, dcmp0Body, dcmp0Out),
+    VEC("dcmp 1", 1, 0, NULL, 0, dcmp1Body, dcmp1Out),
+    VEC("dcmp 2", 2, 0, NULL, 0, dcmp2Body, dcmp2Out),
+    VEC("dcmp 2 tagged", 2, 0x02, NULL, 0, dcmp2TagBody, dcmp2TagOut),
+    VEC("dcmp 2 custom table", 2, 0x01, dcmp2Table, 3, dcmp2CustomBody, dcmp2CustomOut),
+    VEC("dcmp 2 tagged custom table", 2, 0x03, dcmp2Table, 3, dcmp2CustomTagBody, dcmp2CustomTagOut),
+};
+#define kVectors    (sizeof vectors / sizeof vectors[0])
+
+static void test_put32 (uint8_t *p, uint32_t v) {
+    p[0] = v >> 24; p[1] = (v >> 16) & 0xFF; p[2] = (v >> 8) & 0xFF; p[3] = v & 0xFF;
+}
+
+// header, table, body repeated, an odd last byte, and the end code of 'dcmp' 0 and 1
+static uint8_t* test_pack (const struct Vector *v, size_t repeat, int odd, size_t *size, uint8_t **out, size_t *outSize) {
+    // 'dcmp' 0 only makes words
+    *out = NULL;
+    if (odd && v->dcmp == 0) return NULL;
+    *size = 18 + 2 * v->tableSize + repeat * v->bodySize + 3;
+    *outSize = repeat * v->outSize + (odd != 0);
+    uint8_t *data = calloc(1, *size);
+    uint8_t *p = data;
+    test_put32(p, 0xA89F6572);
+    test_put32(p+4, v->dcmp == 2 ? 0x00120901 : 0x00120801);
+    test_put32(p+8, (uint32_t)*outSize);
+    if (v->dcmp == 2) {
+        p[13] = 2;
+        p[16] = v->tableSize ? (uint8_t)(v->tableSize - 1) : 0;
+        p[17] = v->flags;
+    } else p[15] = (uint8_t)v->dcmp;
+    p += 18;
+    if (v->tableSize) memcpy(p, v->table, 2 * v->tableSize);
+    p += 2 * v->tableSize;
+    *out = malloc(*outSize);
+    for(size_t i=0; i < repeat; i++) {
+        memcpy(p, v->body, v->bodySize);
+        memcpy(*out + i * v->outSize, v->out, v->outSize);
+        p += v->bodySize;
+    }
+    if (odd) {
+        // 'dcmp' 1 has no such thing, use a one byte literal
+        if (v->dcmp == 1) *p++ = 0x00;
+        *p++ = 'Z';
+        (*out)[*outSize - 1] = 'Z';
+    }
+    if (v->dcmp != 2) *p++ = 0xFF;
+    *size = p - data;
+    return data;
+}
+
+// whole resource, then windows at random places
+static void test_windows (RFILE *rp, int16_t ID, const uint8_t *out, size_t outSize, const char *name) {
+    size_t read = 0, remain = 1;
+    uint8_t *data = res_read(rp, kTestType, ID, NULL, 0, 0, &read, &remain);
+    CHECK(data && read == outSize && remain == 0);
+    if (data == NULL || read != outSize || memcmp(data, out, outSize)) {
+        fprintf(stderr, "%s: %zu bytes decoded wrong\n", name, outSize);
+        failures++;
+    }
+    free(data);
+    uint8_t *buf = malloc(outSize);
+    for(int i=0; i < 200; i++) {
+        size_t start = (size_t)rand() % outSize;
+        size_t size = 1 + (size_t)rand() % (outSize - start);
+        if (i % 4 == 0 && size > 64) size = 1 + size % 64;
+        CHECK(res_read(rp, kTestType, ID, buf, start, size, &read, &remain) == buf);
+        CHECK(read == size && remain == outSize - start - size && memcmp(buf, out + start, size) == 0);
+    }
+    free(buf);
+}
+
+static void test_vectors (void) {
+    // each vector as is, repeated, and with an odd last byte
+    static const size_t repeats[] = {1, 97};
+    RWRITER *w = res_writer_new();
+    RFlags flags = {.b = 0};
+    flags.fl.compressed = 1;
+    uint8_t *outs[kVectors * 4] = {NULL};
+    size_t outSizes[kVectors * 4] = {0};
+    int16_t ID = 0;
+    for(size_t i=0; i < kVectors; i++) for(size_t r=0; r < 2; r++) for(int odd=0; odd < 2; odd++, ID++) {
+        size_t size;
+        uint8_t *data = test_pack(&vectors[i], repeats[r], odd, &size, &outs[ID], &outSizes[ID]);
+        if (data == NULL) continue;
+        CHECK(res_writer_add(w, kTestType, ID, NULL, flags, data, size, 1) == 0);
+        free(data);
+    }
+    size_t forkSize;
+    uint8_t *fork = res_writer_write_mem(w, &forkSize);
+    res_writer_close(w);
+    RFILE *rp = res_open_mem(fork, forkSize, 0);
+    CHECK(rp != NULL);
+    if (rp == NULL) return;
+    
+    for(ID=0; ID < (int16_t)(kVectors * 4); ID++) {
+        if (outs[ID] == NULL) continue;
+        ResAttr attr;
+        CHECK(res_attr(rp, kTestType, ID, &attr) && attr.size == outSizes[ID] && attr.flags.fl.compressed);
+        test_windows(rp, ID, outs[ID], outSizes[ID], vectors[ID / 4].name);
+        free(outs[ID]);
+    }
+    res_close(rp);
+}
+
+static void test_corrupt (void) {
+    // a custom table index past the table, and data ending early
+    static const uint8_t pastTable[] = {0, 1, 3};
+    static const struct Vector bad[] = {
+        VEC("past table", 2, 0x01, dcmp2Table, 3, pastTable, dcmp2CustomOut),
+        VEC("short", 1, 0, NULL, 0, dcmp1Body, dcmp1Out),
+    };
+    RWRITER *w = res_writer_new();
+    RFlags flags = {.b = 0};
+    flags.fl.compressed = 1;
+    for(int16_t ID=0; ID < 2; ID++) {
+        size_t size, outSize;
+        uint8_t *out;
+        uint8_t *data = test_pack(&bad[ID], 1, 0, &size, &out, &outSize);
+        if (ID == 1) size -= 10;
+        CHECK(res_writer_add(w, kTestType, ID, NULL, flags, data, size, 1) == 0);
+        free(data);
+        free(out);
+    }
+    size_t forkSize;
+    uint8_t *fork = res_writer_write_mem(w, &forkSize);
+    res_writer_close(w);
+    RFILE *rp = res_open_mem(fork, forkSize, 0);
+    CHECK(rp != NULL);
+    if (rp == NULL) return;
+    for(int16_t ID=0; ID < 2; ID++) {
+        errno = 0;
+        CHECK(res_read(rp, kTestType, ID, NULL, 0, 0, NULL, NULL) == NULL && errno == EILSEQ);
+    }
+    res_close(rp);
+}
+
+static uint64_t test_decoded (RFILE *rp) {
+    ResStats stats;
+    res_stats(rp, &stats);
+    return stats.bytesDecoded;
+}
+
+// bytes decoded to read a window, which must match out
+static uint64_t test_window (RFILE *rp, int16_t ID, const uint8_t *out, size_t start, size_t size) {
+    uint8_t buf[kWindow];
+    uint64_t before = test_decoded(rp);
+    size_t read = 0;
+    CHECK(res_read(rp, kTestType, ID, buf, start, size, &read, NULL) == buf);
+    CHECK(read == size && memcmp(buf, out + start, size) == 0);
+    return test_decoded(rp) - before;
+}
+
+// more resources than keep checkpoints, each a long 'dcmp' 1 resource
+static RFILE* test_long_fork (uint8_t **out, size_t *outSize) {
+    RWRITER *w = res_writer_new();
+    RFlags flags = {.b = 0};
+    flags.fl.compressed = 1;
+    for(int16_t ID=0; ID <= kSavedMax; ID++) {
+        size_t size;
+        uint8_t *data = test_pack(&vectors[1], 600, 0, &size, out, outSize);
+        CHECK(res_writer_add(w, kTestType, ID, NULL, flags, data, size, 1) == 0);
+        free(data);
+        if (ID < kSavedMax) free(*out);
+    }
+    size_t forkSize;
+    uint8_t *fork = res_writer_write_mem(w, &forkSize);
+    res_writer_close(w);
+    return res_open_mem(fork, forkSize, 0);
+}
+
+static void test_checkpoints (void) {
+    uint8_t *out;
+    size_t outSize;
+    RFILE *rp = test_long_fork(&out, &outSize);
+    CHECK(rp != NULL);
+    if (rp == NULL) return;
+    size_t last = outSize - kWindow;
+    // resuming costs at most a checkpoint interval, and a code that ran past it
+    uint64_t most = kWindow + kInterval + 256;
+    
+    // without checkpoints every window decodes from the start
+    CHECK(test_window(rp, 0, out, last, kWindow) == outSize);
+    CHECK(test_window(rp, 0, out, last, kWindow) == outSize);
+    
+    // paging through, each window resumes from the previous one's checkpoints
+    CHECK(res_checkpoint(rp, kInterval) == 0);
+    for(size_t start=0; start < outSize; start += kWindow) {
+        size_t size = outSize - start < kWindow ? outSize - start : kWindow;
+        CHECK(test_window(rp, 0, out, start, size) <= most);
+    }
+    // and going back uses them too, literals remembered before them included
+    for(int i=0; i < 100; i++) {
+        size_t start = (size_t)rand() % (last + 1);
+        CHECK(test_window(rp, 0, out, start, kWindow) <= most);
+    }
+    
+    // reading far into the others drops the least recently used
+    for(int16_t ID=1; ID <= kSavedMax; ID++) CHECK(test_window(rp, ID, out, last, kWindow) == outSize);
+    CHECK(test_window(rp, kSavedMax, out, last / 2, kWindow) <= most);
+    CHECK(test_window(rp, 0, out, last, kWindow) == outSize);
+    CHECK(test_window(rp, 0, out, last / 2, kWindow) <= most);
+    // 1 is now the oldest
+    CHECK(test_window(rp, 1, out, last / 2, kWindow) >= last / 2);
+    
+    // turning them off drops the saved ones
+    CHECK(res_checkpoint(rp, 0) == 0);
+    CHECK(test_window(rp, 0, out, last, kWindow) == outSize);
+    CHECK(res_checkpoint(rp, kInterval) == 0);
+    CHECK(test_window(rp, 0, out, last, kWindow) == outSize);
+    CHECK(test_window(rp, 0, out, last / 2, kWindow) <= most);
+    
+    res_close(rp);
+    free(out);
+}
+
+struct Pager {
+    RFILE           *rp;
+    const uint8_t   *out;
+    size_t          outSize;
+    unsigned int    seed;
+};
+
+static void* test_pager (void *arg) {
+    struct Pager *pg = arg;
+    uint8_t buf[kWindow];
+    for(int i=0; i < 300; i++) {
+        int16_t ID = (int16_t)(rand_r(&pg->seed) % 4);
+        size_t start = (size_t)rand_r(&pg->seed) % (pg->outSize - kWindow);
+        size_t read = 0;
+        CHECK(res_read(pg->rp, kTestType, ID, buf, start, kWindow, &read, NULL) == buf);
+        CHECK(read == kWindow && memcmp(buf, pg->out + start, kWindow) == 0);
+    }
+    return NULL;
+}
+
+static void test_checkpoints_threads (void) {
+    // checkpoints turned off and on while other threads read
+    uint8_t *out;
+    size_t outSize;
+    RFILE *rp = test_long_fork(&out, &outSize);
+    CHECK(rp != NULL);
+    if (rp == NULL) return;
+    pthread_t threads[4];
+    struct Pager pagers[4];
+    for(int i=0; i < 4; i++) {
+        pagers[i] = (struct Pager){rp, out, outSize, (unsigned int)i + 1};
+        pthread_create(&threads[i], NULL, test_pager, &pagers[i]);
+    }
+    for(int i=0; i < 200; i++) {
+        res_checkpoint(rp, i % 2 ? 0 : kInterval);
+        usleep(100);
+    }
+    for(int i=0; i < 4; i++) pthread_join(threads[i], NULL);
+    res_close(rp);
+    free(out);
+}
+
+int main (void) {
+    srand(1);
+    test_vectors();
+    test_corrupt();
+    test_checkpoints();
+    test_checkpoints_threads();
+    return test_done("dcmp");
+}
@@ -0,0 +1,114 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// reads through functions, and writes from them, continue short reads and fail on missing data
+
+#include "test.h"
+#include <errno.h>
+
+#define kResources  2000
+#define kSize       1000
+
+static RFILE* test_open (struct TestFile *f, int how) {
+    if (how == 0) return res_open_funcs_mode(f, test_seek, test_read, 0);
+    if (how == 1) return res_open_funcs_at(f, f->size, test_read_at, 0);
+    return res_open_funcs_at(f, f->size, test_read_at, RES_MODE_READAHEAD);
+}
+
+static void test_short (int how) {
+    // a few bytes at a time
+    struct TestFile f = {0};
+    f.data = test_fork(kResources, kSize, &f.size);
+    f.maxRead = 333;
+    RFILE *rp = test_open(&f, how);
+    CHECK(rp != NULL);
+    if (rp == NULL) return;
+    for(int16_t ID=0; ID < kResources; ID++) {
+        size_t read = 0;
+        void *data = res_read(rp, kTestType + ID % 4, ID, NULL, 0, 0, &read, NULL);
+        CHECK(data && read == kSize && test_check_data(ID, data, read));
+        free(data);
+    }
+    res_close(rp);
+    free(f.data);
+}
+
+static void test_missing (int how) {
+    // the data section stops halfway after opening
+    struct TestFile f = {0};
+    f.data = test_fork(kResources, kSize, &f.size);
+    RFILE *rp = test_open(&f, how);
+    CHECK(rp != NULL);
+    if (rp == NULL) return;
+    f.end = f.size / 2;
+    int failed = 0;
+    for(int16_t ID=0; ID < kResources; ID++) {
+        size_t read = 0;
+        errno = 0;
+        void *data = res_read(rp, kTestType + ID % 4, ID, NULL, 0, 0, &read, NULL);
+        if (data == NULL) {
+            CHECK(errno == EIO);
+            failed++;
+        } else CHECK(read == kSize && test_check_data(ID, data, read));
+        free(data);
+    }
+    // the block cache may still hold some of them
+    CHECK(failed > 0);
+    if (how != 2) CHECK(failed >= kResources / 3);
+    res_close(rp);
+    free(f.data);
+}
+
+static void test_writer (void) {
+    // resources read through functions a few bytes at a time, then one that runs out
+    struct TestFile f = {0};
+    f.size = 100000;
+    f.data = malloc(f.size);
+    for(size_t i=0; i < f.size; i++) f.data[i] = test_byte(1, i);
+    f.maxRead = 333;
+    RWRITER *w = res_writer_new();
+    CHECK(res_writer_add_func(w, kTestType, 1, "short", (RFlags){0}, test_read_at, &f, f.size) == 0);
+    size_t size = 0;
+    void *fork = res_writer_write_mem(w, &size);
+    CHECK(fork != NULL);
+    RFILE *rp = fork ? res_open_mem(fork, size, 0) : NULL;
+    CHECK(rp != NULL);
+    if (rp) {
+        size_t read = 0;
+        void *data = res_read(rp, kTestType, 1, NULL, 0, 0, &read, NULL);
+        CHECK(data && read == f.size && test_check_data(1, data, read));
+        free(data);
+        res_close(rp);
+    }
+    f.end = f.size / 2;
+    errno = 0;
+    fork = res_writer_write_mem(w, &size);
+    CHECK(fork == NULL && errno == EIO);
+    free(fork);
+    res_writer_close(w);
+    free(f.data);
+}
+
+int main (void) {
+    test_writer();
+    for(int how=0; how < 3; how++) {
+        test_short(how);
+        test_missing(how);
+    }
+    return test_done("funcs");
+}
@@ -0,0 +1,140 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// saved indexes, written concurrently and checked when loaded
+
+#include "test.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "libres_internal.h"
+
+#define kResources  1000
+#define kThreads    8
+
+static char path[64], indexPath[80];
+
+// the index was used if the map wasn't read
+static int test_indexed (RFILE *rp) {
+    ResStats stats;
+    res_stats(rp, &stats);
+    return stats.reads == 0;
+}
+
+static int test_lookups (RFILE *rp) {
+    int bad = 0;
+    ResAttr attr;
+    for(int16_t ID=0; ID < kResources; ID++)
+        if (res_attr(rp, kTestType + ID % 4, ID, &attr) == NULL || attr.ID != ID || attr.size != 16) bad++;
+    return bad;
+}
+
+static void* test_thread (void *arg) {
+    (void)arg;
+    RFILE *rp = res_open_indexed(path, indexPath, 0);
+    CHECK(rp != NULL);
+    if (rp) {
+        CHECK(test_lookups(rp) == 0);
+        res_close(rp);
+    }
+    return NULL;
+}
+
+// change the saved index in place
+static void test_tamper (void (*change)(void *index)) {
+    int fd = open(indexPath, O_RDWR);
+    struct stat st;
+    CHECK(fd != -1 && fstat(fd, &st) == 0);
+    void *index = mmap(NULL, (size_t)st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    CHECK(index != MAP_FAILED);
+    change(index);
+    munmap(index, (size_t)st.st_size);
+    close(fd);
+}
+
+static void test_swap_ids (void *index) {
+    struct RmIndexType *t = index + sizeof(struct RmIndexHdr);
+    int16_t *ids = index + t->ids;
+    int16_t id = ids[0];
+    ids[0] = ids[1];
+    ids[1] = id;
+}
+
+static void test_wrong_id (void *index) {
+    struct RmIndexType *t = index + sizeof(struct RmIndexHdr);
+    int16_t *ids = index + t->ids;
+    ids[3] = ids[2];
+}
+
+static void test_swap_types (void *index) {
+    struct RmIndexType *t = index + sizeof(struct RmIndexHdr);
+    uint32_t type = t[0].type;
+    t[0].type = t[1].type;
+    t[1].type = type;
+}
+
+static void test_rejected (void (*change)(void *index)) {
+    test_tamper(change);
+    RFILE *rp = res_open_indexed(path, indexPath, 0);
+    CHECK(rp != NULL && !test_indexed(rp));
+    if (rp) {
+        CHECK(test_lookups(rp) == 0);
+        res_close(rp);
+    }
+    
+    // and saved again
+    rp = res_open_indexed(path, indexPath, 0);
+    CHECK(rp != NULL && test_indexed(rp));
+    if (rp) res_close(rp);
+}
+
+int main (void) {
+    snprintf(path, sizeof path, "/tmp/libres-index-%ld", (long)getpid());
+    snprintf(indexPath, sizeof indexPath, "%s.idx", path);
+    test_write(path, kResources, 16);
+    
+    // everyone finds it missing and saves it at once
+    pthread_t threads[kThreads];
+    for(int i=0; i < kThreads; i++) pthread_create(&threads[i], NULL, test_thread, NULL);
+    for(int i=0; i < kThreads; i++) pthread_join(threads[i], NULL);
+    RFILE *rp = res_open_indexed(path, indexPath, 0);
+    CHECK(rp != NULL && test_indexed(rp));
+    if (rp) {
+        CHECK(test_lookups(rp) == 0);
+        res_close(rp);
+    }
+    
+    // no temporary files left behind
+    DIR *dir = opendir("/tmp");
+    struct dirent *de;
+    int left = 0;
+    while (dir && (de = readdir(dir)))
+        if (strncmp(de->d_name, indexPath + 5, strlen(indexPath + 5)) == 0 && strcmp(de->d_name, indexPath + 5)) left++;
+    if (dir) closedir(dir);
+    CHECK(left == 0);
+    
+    // lookups would go astray with these
+    test_rejected(test_swap_ids);
+    test_rejected(test_wrong_id);
+    test_rejected(test_swap_types);
+    
+    unlink(indexPath);
+    unlink(path);
+    return test_done("index");
+}
@@ -0,0 +1,77 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// res_load reads length prefixes in blocks, not once per resource, and not the data between them
+
+#include "test.h"
+
+#define kResources  4000
+#define kSize       100
+
+static void test_load (int mode) {
+    struct TestFile f = {0};
+    f.data = test_fork(kResources, kSize, &f.size);
+    RFILE *rp = res_open_funcs_mode(&f, test_seek, test_read, mode);
+    CHECK(rp != NULL);
+    if (rp == NULL) return;
+    
+    // sizes come from the length prefixes
+    size_t count = 0;
+    for(uint32_t t=0; t < 4; t++) count += res_count(rp, kTestType + t);
+    CHECK(count == kResources);
+    ResAttr attr;
+    for(int16_t ID=0; ID < kResources; ID++) {
+        CHECK(res_attr(rp, kTestType + ID % 4, ID, &attr) != NULL);
+        CHECK(attr.size == kSize);
+    }
+    
+    // a seek and a read for the header and the map, then for each 64K block of data,
+    // once for every type when they are loaded lazily
+    unsigned long blocks = (f.size / 0x10000 + 1) * (mode & RES_MODE_LAZY ? 4 : 1);
+    printf("mode %d: %zu resources in %lu blocks, %lu seeks, %lu reads\n", mode, count, blocks, f.seeks, f.reads);
+    CHECK(f.seeks + f.reads <= 2 * (blocks + 2));
+    uint8_t buf[kSize];
+    size_t read = 0;
+    CHECK(res_read(rp, kTestType + 3, 123, buf, 0, sizeof buf, &read, NULL) != NULL);
+    CHECK(read == kSize && test_check_data(123, buf, read));
+    res_close(rp);
+    free(f.data);
+}
+
+static void test_sparse (int mode) {
+    // resources far apart, where a block per prefix would read most of the data
+    struct TestFile f = {0};
+    f.data = test_fork(64, 200000, &f.size);
+    RFILE *rp = res_open_funcs_mode(&f, test_seek, test_read, mode);
+    CHECK(rp != NULL);
+    if (rp == NULL) return;
+    ResAttr attr;
+    for(int16_t ID=0; ID < 64; ID++) CHECK(res_attr(rp, kTestType + ID % 4, ID, &attr) && attr.size == 200000);
+    printf("sparse mode %d: %lu bytes in %lu reads\n", mode, f.bytesRead, f.reads);
+    CHECK(f.bytesRead < 0x2000);
+    res_close(rp);
+    free(f.data);
+}
+
+int main (void) {
+    test_load(0);
+    test_load(RES_MODE_LAZY);
+    test_sparse(0);
+    test_sparse(RES_MODE_LAZY);
+    return test_done("load");
+}
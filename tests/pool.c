@@ -0,0 +1,185 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// res_open shares handles while the pool is enabled
+
+#include "test.h"
+#include <errno.h>
+#include <pthread.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+#define kFiles      3
+#define kThreads    8
+
+static char paths[kFiles][64];
+
+// lookups made through a handle, a new one starts with none
+static uint64_t test_lookups (RFILE *rp) {
+    ResStats stats;
+    res_stats(rp, &stats);
+    return stats.lookupsByID;
+}
+
+static void test_use (RFILE *rp) {
+    ResAttr attr;
+    CHECK(res_attr(rp, kTestType, 0, &attr) != NULL);
+}
+
+static void* test_thread (void *arg) {
+    // everyone sets up the cache on the same handle
+    const char *path = arg;
+    for(int i=0; i < 200; i++) {
+        RFILE *rp = res_open(path, 0);
+        CHECK(rp != NULL);
+        if (rp == NULL) continue;
+        CHECK(res_cache(rp, i % 3 ? 0x10000 : 0) == 0);
+        uint8_t buf[16];
+        size_t read = 0;
+        CHECK(res_read(rp, kTestType + 1, 5, buf, 0, sizeof buf, &read, NULL) != NULL);
+        CHECK(read == 16 && test_check_data(5, buf, read));
+        res_close(rp);
+    }
+    return NULL;
+}
+
+// two trace hooks, each must only see its own context
+static int traceA, traceB, traceWrong;
+
+static void test_trace_a (void *ctx, RFILE *rp, size_t offset, size_t length, uint64_t nanos) {
+    (void)rp; (void)offset; (void)length; (void)nanos;
+    if (ctx != &traceA) __atomic_add_fetch(&traceWrong, 1, __ATOMIC_RELAXED);
+}
+
+static void test_trace_b (void *ctx, RFILE *rp, size_t offset, size_t length, uint64_t nanos) {
+    (void)rp; (void)offset; (void)length; (void)nanos;
+    if (ctx != &traceB) __atomic_add_fetch(&traceWrong, 1, __ATOMIC_RELAXED);
+}
+
+static int preloadsStarted;
+
+static void* test_settings_thread (void *arg) {
+    // callers that don't know they share a handle, each changing its settings
+    const char *path = arg;
+    static const uint32_t types[] = {kTestType + 2};
+    for(int i=0; i < 100; i++) {
+        RFILE *rp = res_open(path, 0);
+        CHECK(rp != NULL);
+        if (rp == NULL) continue;
+        int r = res_preload(rp, types, 1, 1);
+        CHECK(r == 0 || errno == EBUSY);
+        if (r == 0) __atomic_add_fetch(&preloadsStarted, 1, __ATOMIC_RELAXED);
+        if (i % 2) res_set_trace(rp, test_trace_a, &traceA);
+        else res_set_trace(rp, test_trace_b, &traceB);
+        uint8_t buf[16];
+        size_t read = 0;
+        CHECK(res_read(rp, kTestType + 1, (int16_t)(1 + 4 * (i % 20)), buf, 0, sizeof buf, &read, NULL) != NULL);
+        CHECK(read == 16 && test_check_data((int16_t)(1 + 4 * (i % 20)), buf, read));
+        res_close(rp);
+    }
+    return NULL;
+}
+
+int main (void) {
+    for(int i=0; i < kFiles; i++) {
+        snprintf(paths[i], sizeof paths[i], "/tmp/libres-pool-%ld-%d", (long)getpid(), i);
+        test_write(paths[i], 100, 16);
+    }
+    
+    // not shared unless enabled
+    RFILE *a = res_open(paths[0], 0), *b = res_open(paths[0], 0);
+    CHECK(a && b && a != b);
+    res_close(a);
+    res_close(b);
+    
+    // same file and mode, same handle
+    CHECK(res_pool(1, 2) == 0);
+    a = res_open(paths[0], 0);
+    b = res_open(paths[0], 0);
+    RFILE *c = res_open(paths[0], RES_MODE_LAZY);
+    CHECK(a && a == b);
+    CHECK(c && c != a);
+    res_close(c);
+    
+    // closing it once leaves it open for the other user
+    test_use(a);
+    res_close(a);
+    test_use(b);
+    CHECK(test_lookups(b) == 2);
+    res_close(b);
+    
+    // kept idle, and found again
+    a = res_open(paths[0], 0);
+    CHECK(test_lookups(a) == 2);
+    res_close(a);
+    
+    // only the two most recently used idle handles stay open
+    for(int i=1; i < kFiles; i++) {
+        RFILE *rp = res_open(paths[i], 0);
+        test_use(rp);
+        res_close(rp);
+    }
+    for(int i=kFiles-1; i >= 0; i--) {
+        RFILE *rp = res_open(paths[i], 0);
+        CHECK(test_lookups(rp) == (i == 0 ? 0 : 1));
+        res_close(rp);
+    }
+    
+    // a file that changed gets a new handle, the old one stays usable while held
+    a = res_open(paths[1], 0);
+    test_use(a);
+    struct stat st;
+    stat(paths[1], &st);
+    struct utimbuf times = {st.st_atime, st.st_mtime + 10};
+    CHECK(utime(paths[1], &times) == 0);
+    b = res_open(paths[1], 0);
+    CHECK(b && test_lookups(b) == 0 && b != a);
+    test_use(a);
+    res_close(a);
+    res_close(b);
+    test_write(paths[1], 200, 16);
+    CHECK(utime(paths[1], &times) == 0);
+    a = res_open(paths[1], 0);
+    CHECK(a && res_count(a, kTestType) == 50);
+    res_close(a);
+    
+    // shared between threads
+    pthread_t threads[kThreads];
+    for(int i=0; i < kThreads; i++) pthread_create(&threads[i], NULL, test_thread, paths[2]);
+    for(int i=0; i < kThreads; i++) pthread_join(threads[i], NULL);
+    
+    // background preloads and trace hooks from several users at once
+    a = res_open(paths[2], 0);
+    for(int i=0; i < kThreads; i++) pthread_create(&threads[i], NULL, test_settings_thread, paths[2]);
+    for(int i=0; i < kThreads; i++) pthread_join(threads[i], NULL);
+    CHECK(preloadsStarted > 0 && traceWrong == 0);
+    res_set_trace(a, NULL, NULL);
+    res_close(a);
+    
+    // disabling closes the idle handles, held ones live on
+    a = res_open(paths[2], 0);
+    CHECK(res_pool(0, 0) == 0);
+    b = res_open(paths[2], 0);
+    CHECK(b && b != a);
+    test_use(a);
+    res_close(a);
+    res_close(b);
+    
+    for(int i=0; i < kFiles; i++) unlink(paths[i]);
+    return test_done("pool");
+}
@@ -0,0 +1,108 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// the block cache makes fewer calls to slow read functions
+
+#include "test.h"
+#include <pthread.h>
+
+#define kResources  2000
+#define kSize       1000
+#define kLatency    50  // microseconds per call
+
+struct Scan {
+    RFILE   *rp;
+    int     bad;
+};
+
+static void* test_scan (void *arg) {
+    // in file order, the fork stores them from the last ID
+    struct Scan *s = arg;
+    uint8_t buf[kSize];
+    for(int16_t ID=kResources-1; ID >= 0; ID--) {
+        size_t read = 0;
+        if (res_read(s->rp, kTestType + ID % 4, ID, buf, 0, sizeof buf, &read, NULL) == NULL ||
+            read != kSize || !test_check_data(ID, buf, read)) s->bad++;
+    }
+    return NULL;
+}
+
+static void test_calls (int mode, unsigned long *open, unsigned long *scan) {
+    struct TestFile f = {0};
+    f.data = test_fork(kResources, kSize, &f.size);
+    f.latency = kLatency;
+    struct Scan s = {0};
+    s.rp = res_open_funcs_at(&f, f.size, test_read_at, mode);
+    CHECK(s.rp != NULL);
+    if (s.rp == NULL) return;
+    *open = f.reads;
+    test_scan(&s);
+    CHECK(s.bad == 0);
+    *scan = f.reads - *open;
+    res_close(s.rp);
+    free(f.data);
+}
+
+static void test_disable (void) {
+    // turned off and on again while another thread reads
+    struct TestFile f = {0};
+    f.data = test_fork(kResources, kSize, &f.size);
+    struct Scan s = {0};
+    s.rp = res_open_funcs_at(&f, f.size, test_read_at, RES_MODE_READAHEAD);
+    CHECK(s.rp != NULL);
+    if (s.rp == NULL) return;
+    pthread_t thread;
+    pthread_create(&thread, NULL, test_scan, &s);
+    for(int i=0; i < 20; i++) {
+        CHECK(res_readahead(s.rp, 0, 0) == 0);
+        usleep(500);
+        CHECK(res_readahead(s.rp, 4096, 4) == 0);
+        usleep(500);
+    }
+    pthread_join(thread, NULL);
+    CHECK(s.bad == 0);
+    
+    // reads go straight to the function once it's off
+    CHECK(res_readahead(s.rp, 0, 0) == 0);
+    unsigned long before = f.reads;
+    test_scan(&s);
+    CHECK(s.bad == 0);
+    CHECK(f.reads - before >= kResources);
+    res_close(s.rp);
+    free(f.data);
+}
+
+int main (void) {
+    unsigned long openOff = 0, scanOff = 0, openOn = 0, scanOn = 0;
+    test_calls(0, &openOff, &scanOff);
+    test_calls(RES_MODE_READAHEAD, &openOn, &scanOn);
+    printf("without read-ahead: %lu calls to open, %lu to read %d resources\n", openOff, scanOff, kResources);
+    printf("with read-ahead: %lu calls to open, %lu to read %d resources\n", openOn, scanOn, kResources);
+    CHECK(openOn < openOff);
+    CHECK(scanOn * 10 < scanOff);
+    test_disable();
+    
+    // only for files read through functions
+    struct TestFile f = {0};
+    f.data = test_fork(10, 10, &f.size);
+    RFILE *rp = res_open_mem(f.data, f.size, 1);
+    CHECK(res_readahead(rp, 4096, 4) == -1);
+    res_close(rp);
+    free(f.data);
+    return test_done("readahead");
+}
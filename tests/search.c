@@ -0,0 +1,86 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// searching reports every match, and every resource it couldn't read
+
+#include "test.h"
+#include <errno.h>
+
+#define kResources  2000
+#define kSize       1000
+
+static const uint8_t pattern[] = {5, 6, 7, 8};
+
+struct Found {
+    int     matches[kResources];
+    int     errors[kResources];
+    int     wrong;
+};
+
+static int test_hit (void *ctx, const ResHit *hit) {
+    struct Found *found = ctx;
+    if (hit->ID < 0 || hit->ID >= kResources || hit->type != kTestType + (uint32_t)hit->ID % 4) found->wrong++;
+    else if (hit->error) found->errors[hit->ID]++;
+    else if (hit->offset + sizeof pattern > kSize || test_byte(hit->ID, hit->offset) != pattern[0]) found->wrong++;
+    else found->matches[hit->ID]++;
+    return 0;
+}
+
+static int test_matches (int16_t ID) {
+    int n = 0;
+    for(size_t i=0; i + sizeof pattern <= kSize; i++) n += test_byte(ID, i) == pattern[0];
+    return n;
+}
+
+static void test_search (int missing) {
+    struct TestFile f = {0};
+    f.data = test_fork(kResources, kSize, &f.size);
+    RFILE *rp = res_open_funcs_at(&f, f.size, test_read_at, 0);
+    CHECK(rp != NULL);
+    if (rp == NULL) return;
+    if (missing) f.end = f.size / 2;
+    struct Found *found = calloc(1, sizeof *found);
+    CHECK(res_search_data(rp, pattern, sizeof pattern, NULL, 0, test_hit, found) == 0);
+    CHECK(found->wrong == 0);
+    // every resource is either searched whole or reported once
+    int errors = 0;
+    for(int16_t ID=0; ID < kResources; ID++) {
+        if (found->errors[ID]) {
+            CHECK(found->errors[ID] == 1 && found->matches[ID] <= test_matches(ID));
+            errors++;
+        } else CHECK(found->matches[ID] == test_matches(ID));
+    }
+    if (missing) CHECK(errors >= kResources / 3);
+    else CHECK(errors == 0);
+    free(found);
+    res_close(rp);
+    free(f.data);
+}
+
+static void test_args (void) {
+    struct Found found;
+    errno = 0;
+    CHECK(res_search_data(NULL, pattern, sizeof pattern, NULL, 0, test_hit, &found) == -1 && errno == EBADF);
+}
+
+int main (void) {
+    test_search(0);
+    test_search(1);
+    test_args();
+    return test_done("search");
+}
@@ -0,0 +1,137 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// helpers shared by the tests
+
+#define _DEFAULT_SOURCE // usleep
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "res.h"
+
+#define kTestType   0x54535430  // 'TST0', the next three codes are used too
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+// fork in memory, read through functions that count their calls
+struct TestFile {
+    uint8_t         *data;
+    size_t          size;
+    size_t          pos;
+    unsigned long   seeks;
+    unsigned long   reads;
+    unsigned long   bytesRead;  // returned by all reads
+    unsigned int    latency;    // microseconds slept in every call
+    unsigned long   maxRead;    // most bytes returned by a call, 0 for no limit
+    size_t          end;        // calls return nothing from here on, 0 for the end of data
+};
+
+static inline uint8_t test_byte (int16_t ID, size_t i) {
+    return (uint8_t)(ID * 7 + i);
+}
+
+// count resources of size bytes, spread over 4 types, stored in the reverse order of their IDs
+static inline uint8_t* test_fork (size_t count, size_t size, size_t *forkSize) {
+    RWRITER *w = res_writer_new();
+    uint8_t *data = malloc(size ? size : 1);
+    RFlags flags = {.b = 0};
+    for(size_t i=count; i > 0; i--) {
+        int16_t ID = (int16_t)(i-1);
+        for(size_t j=0; j < size; j++) data[j] = test_byte(ID, j);
+        if (res_writer_add(w, kTestType + (i-1) % 4, ID, NULL, flags, data, size, 1)) {
+            perror("res_writer_add");
+            exit(1);
+        }
+    }
+    uint8_t *fork = res_writer_write_mem(w, forkSize);
+    if (fork == NULL) {
+        perror("res_writer_write_mem");
+        exit(1);
+    }
+    res_writer_close(w);
+    free(data);
+    return fork;
+}
+
+// test_fork written to a file
+static inline void test_write (const char *path, size_t count, size_t size) {
+    size_t forkSize;
+    uint8_t *fork = test_fork(count, size, &forkSize);
+    int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    CHECK(fd != -1 && write(fd, fork, forkSize) == (ssize_t)forkSize);
+    close(fd);
+    free(fork);
+}
+
+// whether a resource read back has the data test_fork wrote
+static inline int test_check_data (int16_t ID, const uint8_t *data, size_t size) {
+    for(size_t i=0; i < size; i++) if (data[i] != test_byte(ID, i)) return 0;
+    return 1;
+}
+
+static inline unsigned long test_seek (void *priv, long offset, int whence) {
+    struct TestFile *f = priv;
+    f->seeks++;
+    if (f->latency) usleep(f->latency);
+    if (whence == SEEK_SET) f->pos = (size_t)offset;
+    else if (whence == SEEK_CUR) f->pos += (size_t)offset;
+    else f->pos = f->size + (size_t)offset;
+    return f->pos;
+}
+
+static inline unsigned long test_read (void *priv, void *buf, unsigned long count) {
+    struct TestFile *f = priv;
+    f->reads++;
+    if (f->latency) usleep(f->latency);
+    size_t end = f->end ? f->end : f->size;
+    if (f->pos >= end) return 0;
+    if (count > end - f->pos) count = end - f->pos;
+    if (f->maxRead && count > f->maxRead) count = f->maxRead;
+    memcpy(buf, f->data + f->pos, count);
+    f->pos += count;
+    f->bytesRead += count;
+    return count;
+}
+
+static inline unsigned long test_read_at (void *priv, void *buf, unsigned long count, unsigned long offset) {
+    struct TestFile *f = priv;
+    __atomic_add_fetch(&f->reads, 1, __ATOMIC_RELAXED);
+    if (f->latency) usleep(f->latency);
+    size_t end = f->end ? f->end : f->size;
+    if (offset >= end) return 0;
+    if (count > end - offset) count = end - offset;
+    if (f->maxRead && count > f->maxRead) count = f->maxRead;
+    memcpy(buf, f->data + offset, count);
+    __atomic_add_fetch(&f->bytesRead, count, __ATOMIC_RELAXED);
+    return count;
+}
+
+static inline int test_done (const char *name) {
+    if (failures) fprintf(stderr, "%s: %d failed\n", name, failures);
+    else printf("%s: ok\n", name);
+    return failures != 0;
+}
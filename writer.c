@@ -0,0 +1,343 @@
+/*
+ * libres - library for reading Macintosh resource forks
+ * Copyright (C) 2008-2009 Jesus A. Alvarez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+// writing resource forks
+
+#define _GNU_SOURCE // copy_file_range
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "res.h"
+#include "libres_internal.h"
+
+static struct RmWriterEnt * res_writer_ent (RWRITER *w, uint32_t type, int16_t ID, const char *name, RFlags flags, size_t size);
+static int res_writer_emit (RWRITER *w, struct RmWriterOut *out);
+static void* res_writer_map (RWRITER *w, struct RmWriterEnt **order, size_t numTypes, size_t mapLength, size_t nameListOffset);
+static int res_writer_data (struct RmWriterOut *out, struct RmWriterEnt *e);
+static int res_writer_put (struct RmWriterOut *out, const void *data, size_t size);
+static int res_writer_flush (struct RmWriterOut *out);
+static int res_writer_write_all (int fd, const void *data, size_t size);
+static int res_writer_ent_compar (struct RmWriterEnt * const *a, struct RmWriterEnt * const *b);
+
+RWRITER* res_writer_new (void) {
+    RWRITER *w = res_malloc(sizeof(RWRITER));
+    if (w == NULL) efail(ENOMEM);
+    bzero(w, sizeof(RWRITER));
+    return w;
+}
+
+int res_writer_add (RWRITER *w, uint32_t type, int16_t ID, const char *name, RFlags flags, const void *data, size_t size, int copy) {
+    if (data == NULL && size) eret(EINVAL, -1);
+    struct RmWriterEnt *e = res_writer_ent(w, type, ID, name, flags, size);
+    if (e == NULL) return -1;
+    e->data = data;
+    if (copy && size) {
+        void *buf = res_malloc(size);
+        if (buf == NULL) {
+            // the name went in last, drop it with the entry
+            if (e->name != kNoName) w->namesSize = e->name;
+            w->numEnts--;
+            eret(ENOMEM, -1);
+        }
+        memcpy(buf, data, size);
+        e->data = buf;
+        e->owned = 1;
+    }
+    return 0;
+}
+
+int res_writer_add_func (RWRITER *w, uint32_t type, int16_t ID, const char *name, RFlags flags, res_read_at_func read, void *priv, size_t size) {
+    if (read == NULL) eret(EINVAL, -1);
+    struct RmWriterEnt *e = res_writer_ent(w, type, ID, name, flags, size);
+    if (e == NULL) return -1;
+    e->read = read;
+    e->priv = priv;
+    return 0;
+}
+
+int res_writer_add_res (RWRITER *w, RFILE *rp, uint32_t type, int16_t ID) {
+    struct RmType *t = res_type_find(rp, type);
+    struct RmResRef *ref = t ? res_ref_find(rp, t, ID) : NULL;
+    if (ref == NULL) eret(ENOENT, -1);
+    size_t offset = ref->offset + rp->dataOffset + 4;
+    if (offset + ref->psize > rp->size) eret(EFAULT, -1);
+    struct RmWriterEnt *e = res_writer_ent(w, type, ID, res_ref_name(t, ref), ref->flags, ref->psize);
+    if (e == NULL) return -1;
+    e->rp = rp;
+    e->offset = offset;
+    return 0;
+}
+
+int res_writer_write (RWRITER *w, int fd) {
+    if (w == NULL || fd < 0) eret(EINVAL, -1);
+    struct RmWriterOut out;
+    bzero(&out, sizeof out);
+    out.fd = fd;
+    out.buf = res_malloc(kWriterBufSize);
+    if (out.buf == NULL) eret(ENOMEM, -1);
+    int err = res_writer_emit(w, &out) || res_writer_flush(&out);
+    int saved = errno;
+    res_free(out.buf);
+    if (err) eret(saved, -1);
+    return 0;
+}
+
+void* res_writer_write_mem (RWRITER *w, size_t *size) {
+    if (w == NULL) efail(EINVAL);
+    struct RmWriterOut out;
+    bzero(&out, sizeof out);
+    out.fd = -1;
+    if (res_writer_emit(w, &out)) {
+        int err = errno;
+        free(out.mem);
+        efail(err);
+    }
+    if (size) *size = out.pos;
+    return out.mem;
+}
+
+int res_writer_close (RWRITER *w) {
+    if (w == NULL) eret(EBADF, EOF);
+    for(size_t i=0; i < w->numEnts; i++)
+        if (w->ents[i].owned) res_free((void*)w->ents[i].data);
+    res_free(w->ents);
+    res_free(w->names);
+    res_free(w);
+    return 0;
+}
+
+#if 0
+#pragma mark -
+#pragma mark Private Functions
+#endif
+
+static struct RmWriterEnt * res_writer_ent (RWRITER *w, uint32_t type, int16_t ID, const char *name, RFlags flags, size_t size) {
+    if (w == NULL) efail(EINVAL);
+    size_t nameLength = name ? strlen(name) : 0;
+    if (nameLength > 255 || size > UINT32_MAX) efail(EINVAL);
+    
+    if (w->numEnts == w->entSlots) {
+        size_t slots = w->entSlots ? 2 * w->entSlots : 64;
+        struct RmWriterEnt *ents = res_malloc(slots * sizeof(struct RmWriterEnt));
+        if (ents == NULL) efail(ENOMEM);
+        if (w->numEnts) memcpy(ents, w->ents, w->numEnts * sizeof(struct RmWriterEnt));
+        res_free(w->ents);
+        w->ents = ents;
+        w->entSlots = slots;
+    }
+    
+    // pascal strings, their offsets have to fit in 16 bits
+    uint32_t nameOffset = kNoName;
+    if (name) {
+        if (w->namesSize >= 0xFFFF) efail(EFBIG);
+        if (w->namesSize + nameLength + 1 > w->nameSlots) {
+            size_t slots = w->nameSlots ? 2 * w->nameSlots : 1024;
+            while (slots < w->namesSize + nameLength + 1) slots *= 2;
+            uint8_t *names = res_malloc(slots);
+            if (names == NULL) efail(ENOMEM);
+            if (w->namesSize) memcpy(names, w->names, w->namesSize);
+            res_free(w->names);
+            w->names = names;
+            w->nameSlots = slots;
+        }
+        nameOffset = (uint32_t)w->namesSize;
+        w->names[w->namesSize] = (uint8_t)nameLength;
+        memcpy(w->names + w->namesSize + 1, name, nameLength);
+        w->namesSize += nameLength + 1;
+    }
+    struct RmWriterEnt *e = &w->ents[w->numEnts++];
+    bzero(e, sizeof(struct RmWriterEnt));
+    e->type = type;
+    e->ID = ID;
+    e->flags = flags;
+    e->name = nameOffset;
+    e->size = size;
+    return e;
+}
+
+static int res_writer_emit (RWRITER *w, struct RmWriterOut *out) {
+    // ref lists are sorted by type and ID, data stays in the order it was added
+    struct RmWriterEnt **order = res_malloc(w->numEnts * sizeof(struct RmWriterEnt*) + 1);
+    if (order == NULL) eret(ENOMEM, -1);
+    for(size_t i=0; i < w->numEnts; i++) order[i] = &w->ents[i];
+    qsort(order, w->numEnts, sizeof(struct RmWriterEnt*), (int(*)(const void*, const void*))res_writer_ent_compar);
+    size_t numTypes = 0;
+    for(size_t i=0; i < w->numEnts; i++) {
+        if (i && order[i]->type == order[i-1]->type && order[i]->ID == order[i-1]->ID) egoto(EEXIST, error);
+        if (i == 0 || order[i]->type != order[i-1]->type) numTypes++;
+    }
+    
+    // lay out everything first, the header comes before any of it
+    size_t dataLength = 0;
+    for(size_t i=0; i < w->numEnts; i++) {
+        // data offsets are 24 bits
+        if (dataLength > 0xFFFFFF) egoto(EFBIG, error);
+        w->ents[i].dataOffset = dataLength;
+        dataLength += 4 + w->ents[i].size;
+    }
+    size_t nameListOffset = sizeof(struct RfMap) + 2 + numTypes * sizeof(struct RfTypeEntry) + w->numEnts * sizeof(struct RfRefEntry);
+    size_t mapLength = nameListOffset + w->namesSize;
+    if (numTypes > 0x8000 || nameListOffset > 0xFFFF || kWriterDataOffset + dataLength + mapLength > UINT32_MAX) egoto(EFBIG, error);
+    
+    struct RfHdr hdr;
+    hdr.dataOffset = htonl(kWriterDataOffset);
+    hdr.mapOffset = htonl((uint32_t)(kWriterDataOffset + dataLength));
+    hdr.dataLength = htonl((uint32_t)dataLength);
+    hdr.mapLength = htonl((uint32_t)mapLength);
+    struct RfMap *map = res_writer_map(w, order, numTypes, mapLength, nameListOffset);
+    res_free(order);
+    if (map == NULL) return -1;
+    map->headerCopy = hdr;
+    
+    if (out->fd == -1) {
+        out->mem = malloc(kWriterDataOffset + dataLength + mapLength);
+        if (out->mem == NULL) {
+            res_free(map);
+            eret(ENOMEM, -1);
+        }
+    }
+    static const uint8_t zeros[kWriterDataOffset];
+    int err = res_writer_put(out, &hdr, sizeof hdr) || res_writer_put(out, zeros, kWriterDataOffset - sizeof hdr);
+    for(size_t i=0; i < w->numEnts && !err; i++) {
+        uint32_t length = htonl((uint32_t)w->ents[i].size);
+        err = res_writer_put(out, &length, sizeof length) || res_writer_data(out, &w->ents[i]);
+    }
+    if (!err) err = res_writer_put(out, map, mapLength);
+    int saved = errno;
+    res_free(map);
+    if (err) eret(saved, -1);
+    return 0;
+error:
+    res_free(order);
+    return -1;
+}
+
+static void* res_writer_map (RWRITER *w, struct RmWriterEnt **order, size_t numTypes, size_t mapLength, size_t nameListOffset) {
+    struct RfMap *map = res_malloc(mapLength);
+    if (map == NULL) efail(ENOMEM);
+    bzero(map, mapLength);
+    map->typeListOffset = htons(sizeof(struct RfMap));
+    map->nameListOffset = htons((uint16_t)nameListOffset);
+    
+    // type list, then each type's refs
+    struct RfTypeList *typeList = ((void*)map) + sizeof(struct RfMap);
+    struct RfRefEntry *ref = (void*)&typeList->entry[numTypes];
+    typeList->count = htons((uint16_t)(numTypes - 1));
+    for(size_t i=0, t=0; i < w->numEnts; t++) {
+        size_t j = i;
+        while (j < w->numEnts && order[j]->type == order[i]->type) j++;
+        typeList->entry[t].type = htonl(order[i]->type);
+        typeList->entry[t].count = htons((uint16_t)(j - i - 1));
+        typeList->entry[t].offset = htons((uint16_t)((void*)ref - (void*)typeList));
+        for(; i < j; i++, ref++) {
+            struct RmWriterEnt *e = order[i];
+            ref->ID = htons(e->ID);
+            ref->nameOffset = htons(e->name == kNoName ? 0xFFFF : (uint16_t)e->name);
+            ref->attributes = e->flags.b;
+            ref->offHi = (uint8_t)(e->dataOffset >> 16);
+            ref->offLo = htons((uint16_t)e->dataOffset);
+        }
+    }
+    if (w->namesSize) memcpy(((void*)map) + nameListOffset, w->names, w->namesSize);
+    return map;
+}
+
+static int res_writer_data (struct RmWriterOut *out, struct RmWriterEnt *e) {
+    if (e->data) return res_writer_put(out, e->data, e->size);
+    size_t done = 0;
+#ifdef __linux__
+    if (e->rp && e->rp->fd != -1 && out->fd != -1) {
+        // file to file, let the kernel copy it
+        if (res_writer_flush(out)) return -1;
+        loff_t offset = (loff_t)(e->rp->base + e->offset);
+        while (done < e->size) {
+            ssize_t r = copy_file_range(e->rp->fd, &offset, out->fd, NULL, e->size - done, 0);
+            if (r == -1 && errno == EINTR) continue;
+            if (r <= 0) break;
+            done += r;
+        }
+    }
+#endif
+    
+    // the rest goes through the buffer, or straight into memory
+    while (done < e->size) {
+        uint8_t *dst;
+        size_t count = e->size - done;
+        if (out->fd == -1) dst = out->mem + out->pos;
+        else {
+            if (out->used == kWriterBufSize && res_writer_flush(out)) return -1;
+            dst = out->buf + out->used;
+            if (count > kWriterBufSize - out->used) count = kWriterBufSize - out->used;
+        }
+        if (e->rp) {
+            if (res_bread(e->rp, dst, e->offset + done, count) == NULL) return -1;
+        } else {
+            // short reads are continued, like res_funcs_read
+            for(size_t got = 0; got < count;) {
+                unsigned long r = e->read(e->priv, dst + got, (unsigned long)(count - got), (unsigned long)(done + got));
+                if (r == 0 || r > count - got) eret(EIO, -1);
+                got += r;
+            }
+        }
+        if (out->fd == -1) out->pos += count;
+        else out->used += count;
+        done += count;
+    }
+    return 0;
+}
+
+static int res_writer_put (struct RmWriterOut *out, const void *data, size_t size) {
+    if (out->fd == -1) {
+        memcpy(out->mem + out->pos, data, size);
+        out->pos += size;
+        return 0;
+    }
+    
+    // big pieces are written in place
+    if (out->used + size > kWriterBufSize) {
+        if (res_writer_flush(out)) return -1;
+        if (size >= kWriterBufSize) return res_writer_write_all(out->fd, data, size);
+    }
+    memcpy(out->buf + out->used, data, size);
+    out->used += size;
+    return 0;
+}
+
+static int res_writer_flush (struct RmWriterOut *out) {
+    if (res_writer_write_all(out->fd, out->buf, out->used)) return -1;
+    out->used = 0;
+    return 0;
+}
+
+static int res_writer_write_all (int fd, const void *data, size_t size) {
+    for(size_t done = 0; done < size;) {
+        ssize_t r = write(fd, data + done, size - done);
+        if (r == -1 && errno == EINTR) continue;
+        if (r <= 0) eret(r ? errno : EIO, -1);
+        done += r;
+    }
+    return 0;
+}
+
+static int res_writer_ent_compar (struct RmWriterEnt * const *a, struct RmWriterEnt * const *b) {
+    if ((*a)->type != (*b)->type) return (*a)->type < (*b)->type ? -1 : 1;
+    return (*a)->ID - (*b)->ID;
+}